@@ -0,0 +1,93 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string_view>
+
+// minimal protocol buffers wire format reader.
+// enough to walk onnx model files and read spiece.model without linking protobuf, nothing is copied.
+// shared by gptreranker and onnx-runtime-test, both add this directory to their include path.
+class ProtobufReader
+{
+public:
+	static constexpr uint32_t c_varint = 0;
+	static constexpr uint32_t c_fixed64 = 1;
+	static constexpr uint32_t c_lengthDelimited = 2;
+	static constexpr uint32_t c_fixed32 = 5;
+
+	ProtobufReader(const void* data, size_t size) :
+		m_ptr(reinterpret_cast<const uint8_t*>(data)), m_end(reinterpret_cast<const uint8_t*>(data) + size) {}
+
+	// returns false at the end of message.
+	bool Next(uint32_t& fieldNumber, uint32_t& wireType) {
+		if (IsEnd()) return false;
+		const auto key = ReadVarint();
+		fieldNumber = static_cast<uint32_t>(key >> 3);
+		wireType = static_cast<uint32_t>(key & 7);
+		return true;
+	}
+
+	bool IsEnd() const { return m_ptr >= m_end; }
+
+	uint64_t ReadVarint() {
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			if (m_ptr >= m_end) throw std::runtime_error("broken protobuf");
+			const auto byte = *m_ptr++;
+			value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0) return value;
+		}
+		throw std::runtime_error("broken protobuf");
+	}
+
+	uint32_t ReadFixed32() {
+		uint32_t value;
+		memcpy(&value, Advance(sizeof(value)), sizeof(value));
+		return value;
+	}
+
+	uint64_t ReadFixed64() {
+		uint64_t value;
+		memcpy(&value, Advance(sizeof(value)), sizeof(value));
+		return value;
+	}
+
+	float ReadFloat() {
+		const auto bits = ReadFixed32();
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	std::string_view ReadBytes() {
+		const auto length = static_cast<size_t>(ReadVarint());
+		const auto top = Advance(length);
+		return std::string_view(reinterpret_cast<const char*>(top), length);
+	}
+
+	ProtobufReader ReadMessage() {
+		const auto bytes = ReadBytes();
+		return ProtobufReader(bytes.data(), bytes.size());
+	}
+
+	void Skip(uint32_t wireType) {
+		switch (wireType) {
+		case c_varint: ReadVarint(); break;
+		case c_fixed64: Advance(8); break;
+		case c_lengthDelimited: ReadBytes(); break;
+		case c_fixed32: Advance(4); break;
+		default: throw std::runtime_error("unsupported wire type");
+		}
+	}
+
+private:
+	const uint8_t* Advance(size_t length) {
+		if (static_cast<size_t>(m_end - m_ptr) < length) throw std::runtime_error("broken protobuf");
+		const auto top = m_ptr;
+		m_ptr += length;
+		return top;
+	}
+
+	const uint8_t* m_ptr;
+	const uint8_t* m_end;
+};
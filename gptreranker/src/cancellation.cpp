@@ -0,0 +1,37 @@
+#include "cancellation.h"
+
+RequestTracker::Request RequestTracker::Begin(long long channel) {
+	if (channel == 0) return Request{};
+	Request request{ 0, std::make_shared<CancellationToken>() };
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& [id, entry] : m_requests) {
+		if (entry.channel != channel || entry.cancellation->IsCancelled()) continue;
+		entry.cancellation->Cancel();
+		++m_cancelledCount;
+	}
+	request.id = ++m_nextId;
+	m_requests.emplace(request.id, Entry{ channel, request.cancellation });
+	return request;
+}
+
+void RequestTracker::End(long long id) {
+	if (id == 0) return;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_requests.erase(id);
+}
+
+bool RequestTracker::Cancel(long long id) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const auto it = m_requests.find(id);
+	if (it == m_requests.end()) return false;
+	if (!it->second.cancellation->IsCancelled()) {
+		it->second.cancellation->Cancel();
+		++m_cancelledCount;
+	}
+	return true;
+}
+
+long long RequestTracker::GetCancelledCount() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_cancelledCount;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+// set by the owner of a request (or by a newer request on the same channel), checked by the scoring code
+// before tokenizing, between model sub-runs and while reading out scores.
+class CancellationToken
+{
+public:
+	void Cancel() { m_isCancelled = true; }
+	bool IsCancelled() const { return m_isCancelled; }
+
+private:
+	std::atomic<bool> m_isCancelled = false;
+};
+
+// thrown at a check of a cancelled token. the exports turn it into -2.
+class OperationCancelled : public std::runtime_error
+{
+public:
+	OperationCancelled() : std::runtime_error("cancelled") {}
+};
+
+inline void ThrowIfCancelled(const CancellationToken* cancellation) {
+	if (cancellation != nullptr && cancellation->IsCancelled()) throw OperationCancelled();
+}
+
+// requests in flight by id. a channel is one input context (e.g. one text field): a new request on a channel
+// cancels the older ones on it, which are superseded. channel 0 requests are not tracked: they get id 0 and no token,
+// nothing can cancel them, so they run without the checks and in one model run.
+class RequestTracker
+{
+public:
+	struct Request {
+		long long id = 0;
+		std::shared_ptr<CancellationToken> cancellation;
+	};
+
+	Request Begin(long long channel);
+	void End(long long id);
+	// false when the request has already ended.
+	bool Cancel(long long id);
+	long long GetCancelledCount();
+
+private:
+	struct Entry {
+		long long channel;
+		std::shared_ptr<CancellationToken> cancellation;
+	};
+
+	std::mutex m_mutex;
+	long long m_nextId = 0;
+	long long m_cancelledCount = 0;
+	std::map<long long, Entry> m_requests;
+};
@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include "cascadeReranker.h"
+#include "scoreCache.h"
+
+namespace {
+	// pruned candidates are put this far below the worst rescored candidate.
+	constexpr float c_prunedScoreGap = 1.0f;
+
+	void Score(const ScoringStage& stage, const std::string_view* sentences, const std::vector<int>& indices, float* scores, const CancellationToken* cancellation) {
+		std::vector<std::string_view> selected;
+		for (const auto index : indices) {
+			selected.push_back(sentences[index]);
+		}
+		const auto& tokensList = stage.tokenizer->EncodeBatch(selected.data(), selected.size());
+		stage.onnx->CompareSentenceDiffs(tokensList, stage.tokenizer->eos_id(), scores, cancellation);
+	}
+
+	int GetBestIndex(const float* scores, int count) {
+		return static_cast<int>(std::max_element(scores, scores + count) - scores);
+	}
+}
+
+void CascadeReranker::SetOptions(const Options& options) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_options = options;
+}
+
+uint64_t CascadeReranker::GetOptionsKey() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto hash = ScoreCache::c_hashSeed;
+	hash = ScoreCache::HashBytes(hash, &m_options.topK, sizeof(m_options.topK));
+	hash = ScoreCache::HashBytes(hash, &m_options.scoreMargin, sizeof(m_options.scoreMargin));
+	hash = ScoreCache::HashBytes(hash, &m_options.minCandidates, sizeof(m_options.minCandidates));
+	return hash;
+}
+
+CascadeReranker::Statistics CascadeReranker::GetStatistics() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_statistics;
+}
+
+double CascadeReranker::PredictSeconds(const ScoringStage& finalStage, const ScoringStage& filterStage, int sentenceCount, int sequenceLength) {
+	Options options;
+	double keptShare;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		options = m_options;
+		keptShare = m_filteredCount > 0 ? static_cast<double>(m_keptCount) / m_filteredCount : 1.0;
+	}
+
+	if (!filterStage.onnx || sentenceCount < options.minCandidates) {
+		return finalStage.onnx->PredictRunSeconds(sentenceCount, sequenceLength);
+	}
+	const auto keptCount = std::clamp(static_cast<int>(std::ceil(sentenceCount * keptShare)), std::min(options.topK, sentenceCount), sentenceCount);
+	return filterStage.onnx->PredictRunSeconds(sentenceCount, sequenceLength) + finalStage.onnx->PredictRunSeconds(keptCount, sequenceLength);
+}
+
+void CascadeReranker::Evaluate(const ScoringStage& finalStage, const ScoringStage& filterStage, const std::string_view* sentences, int sentenceCount, float* scores,
+	const CancellationToken* cancellation) {
+	Options options;
+	long long cascadedCount;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		options = m_options;
+		++m_statistics.requestCount;
+		m_statistics.candidateCount += sentenceCount;
+		cascadedCount = m_statistics.cascadedCount;
+	}
+
+	std::vector<int> allIndices(sentenceCount);
+	std::iota(allIndices.begin(), allIndices.end(), 0);
+	if (!filterStage.onnx || sentenceCount < options.minCandidates) {
+		Score(finalStage, sentences, allIndices, scores, cancellation);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_statistics.rescoredCount += sentenceCount;
+		return;
+	}
+
+	std::vector<float> filterScores(sentenceCount, 0.0f);
+	Score(filterStage, sentences, allIndices, filterScores.data(), cancellation);
+
+	// both rules keep a prefix of the filter ranking.
+	auto order = allIndices;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return filterScores[a] > filterScores[b]; });
+	const auto filterBest = filterScores[order[0]];
+	int keptCount = 0;
+	while (keptCount < sentenceCount &&
+		(keptCount < options.topK || filterScores[order[keptCount]] >= filterBest - options.scoreMargin)) {
+		++keptCount;
+	}
+	keptCount = std::max(keptCount, 1);
+
+	const std::vector<int> keptIndices(order.begin(), order.begin() + keptCount);
+	std::vector<float> finalScores(keptCount, 0.0f);
+	Score(finalStage, sentences, keptIndices, finalScores.data(), cancellation);
+
+	const auto worstFinal = *std::min_element(finalScores.begin(), finalScores.end());
+	const auto worstKeptFilter = filterScores[order[keptCount - 1]];
+	for (int rank = 0; rank < sentenceCount; ++rank) {
+		const auto index = order[rank];
+		scores[index] = rank < keptCount ? finalScores[rank] : worstFinal - c_prunedScoreGap + (filterScores[index] - worstKeptFilter);
+	}
+
+	// audit: what the final model alone would have picked.
+	const auto isAudit = options.auditInterval > 0 && (cascadedCount + 1) % options.auditInterval == 0;
+	bool rankingChanged = false;
+	bool bestPruned = false;
+	if (isAudit) {
+		std::vector<float> fullScores(sentenceCount, 0.0f);
+		Score(finalStage, sentences, allIndices, fullScores.data(), cancellation);
+		const auto fullBest = GetBestIndex(fullScores.data(), sentenceCount);
+		rankingChanged = fullBest != GetBestIndex(scores, sentenceCount);
+		bestPruned = std::find(keptIndices.begin(), keptIndices.end(), fullBest) == keptIndices.end();
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_statistics.cascadedCount;
+	m_statistics.rescoredCount += keptCount;
+	m_filteredCount += sentenceCount;
+	m_keptCount += keptCount;
+	if (isAudit) {
+		++m_statistics.auditCount;
+		m_statistics.rankingChangedCount += rankingChanged ? 1 : 0;
+		m_statistics.bestPrunedCount += bestPruned ? 1 : 0;
+	}
+}
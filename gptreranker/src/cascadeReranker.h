@@ -0,0 +1,60 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include "cancellation.h"
+#include "onnxConnector.h"
+#include "tokenizer.h"
+
+// model and its own tokenizer, filter and final models may use different vocabularies.
+struct ScoringStage
+{
+	std::shared_ptr<Tokenizer> tokenizer;
+	std::shared_ptr<OnnxConnector> onnx;
+	uint64_t modelId = 0;	// changes when the model file is replaced
+};
+
+// two-stage reranking: a small filter model scores every candidate, and only the survivors are rescored
+// by the large final model. scores of pruned candidates are placed below all rescored ones, keeping filter order.
+class CascadeReranker
+{
+public:
+	struct Options {
+		int topK = 4;				// candidates ranked under topK by the filter model survive,
+		float scoreMargin = 2.0f;	// and so do those within scoreMargin (log probability) of the filter best.
+		int minCandidates = 6;		// smaller requests go to the final model directly.
+		int auditInterval = 0;		// every n-th cascaded request is also scored fully by the final model, 0 = never.
+	};
+
+	struct Statistics {
+		long long requestCount = 0;
+		long long cascadedCount = 0;
+		long long candidateCount = 0;
+		long long rescoredCount = 0;
+		long long auditCount = 0;
+		long long rankingChangedCount = 0;	// audited requests where the final top-1 differs from the full scoring
+		long long bestPrunedCount = 0;		// ... and the true top-1 was dropped by the filter
+	};
+
+	void SetOptions(const Options& options);
+	// identifies the options which change scores, for cache keys.
+	uint64_t GetOptionsKey();
+	Statistics GetStatistics();
+
+	// filterStage without model scores everything with the final model.
+	// throws OperationCancelled when cancellation is set before the scores are complete.
+	void Evaluate(const ScoringStage& finalStage, const ScoringStage& filterStage, const std::string_view* sentences, int sentenceCount, float* scores,
+		const CancellationToken* cancellation = nullptr);
+	// seconds Evaluate() is expected to take, from the latency models of the stages and the share of candidates the
+	// filter has kept so far. sequenceLength (final model tokens) is used for the filter model too.
+	double PredictSeconds(const ScoringStage& finalStage, const ScoringStage& filterStage, int sentenceCount, int sequenceLength);
+
+private:
+	Options m_options;
+	Statistics m_statistics;
+	long long m_filteredCount = 0;	// candidates of cascaded requests, m_statistics.rescoredCount also counts direct ones
+	long long m_keptCount = 0;
+	std::mutex m_mutex;
+};
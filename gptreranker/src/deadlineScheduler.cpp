@@ -0,0 +1,21 @@
+#include "deadlineScheduler.h"
+
+ScoringMode DeadlineScheduler::Choose(const std::vector<Option>& options, double budgetSeconds) {
+	auto fastest = options.front();
+	for (const auto& option : options) {
+		if (option.predictedSeconds <= budgetSeconds) return option.mode;
+		if (option.predictedSeconds < fastest.predictedSeconds) fastest = option;
+	}
+	return fastest.mode;
+}
+
+void DeadlineScheduler::Record(ScoringMode mode, bool isMissed) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	++m_statistics.modeCounts[static_cast<int>(mode)];
+	m_statistics.missedCount += isMissed ? 1 : 0;
+}
+
+DeadlineScheduler::Statistics DeadlineScheduler::GetStatistics() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_statistics;
+}
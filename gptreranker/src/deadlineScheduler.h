@@ -0,0 +1,36 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include <vector>
+
+// what a response was computed with, from the best to the cheapest.
+enum class ScoringMode : int {
+	Full = 0,				// as EvaluateSentences(): cascade, or the final model alone
+	Cached = 1,				// full scores of an identical earlier request
+	TruncatedContext = 2,	// final model on the end of the context only
+	FilterModel = 3,		// small filter model alone
+};
+
+// picks how much work a request with a latency budget gets, from the predicted seconds of each mode.
+class DeadlineScheduler
+{
+public:
+	struct Option {
+		ScoringMode mode;
+		double predictedSeconds;
+	};
+
+	struct Statistics {
+		std::array<long long, 4> modeCounts = {};	// responses by ScoringMode
+		long long missedCount = 0;					// responses later than their budget
+	};
+
+	// options in quality order. returns the first predicted to fit budgetSeconds, else the one predicted fastest.
+	static ScoringMode Choose(const std::vector<Option>& options, double budgetSeconds);
+	void Record(ScoringMode mode, bool isMissed);
+	Statistics GetStatistics();
+
+private:
+	std::mutex m_mutex;
+	Statistics m_statistics;
+};
@@ -1,11 +1,29 @@
 ﻿#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <iostream>
 #include <io.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <future>
+#include <map>
+#include <string_view>
+#include <mutex>
+#include "cancellation.h"
+#include "cascadeReranker.h"
+#include "deadlineScheduler.h"
+#include "modelRegistry.h"
+#include "scoreCache.h"
+#include "scoringDaemon.h"
+#include "scoringExecutor.h"
 #include "tokenizer.h"
 #include "onnxConnector.h"
 
+// (batch, sequence) shapes used by the background loading.
+const std::vector<std::tuple<int, int>> c_defaultWarmupShapes = { { 1, 16 }, { 3, 16 }, { 3, 32 } };
+
 HMODULE GetThisModuleHandle() {
 	HMODULE hModule = {};
 	if (!GetModuleHandleEx(
@@ -38,41 +56,640 @@ std::wstring GetThisModuleDirectory() {
 }
 
 
-std::tuple<std::shared_ptr<Tokenizer>, std::shared_ptr<OnnxConnector>> EnsureInitialized() {
-	const auto& thisModuleDir = GetThisModuleDirectory();
+CascadeReranker g_cascadeReranker;
+ScoreCache g_scoreCache;
+
+// model identity, scoring mode (cascade options) and token ids of the final model tokenizer.
+uint64_t GetScoreKey(const ScoringStage& finalStage, const ScoringStage& filterStage, const int* const* tokenIds, const int* tokenCounts, int sentenceCount) {
+	auto hash = ScoreCache::HashBytes(ScoreCache::c_hashSeed, &finalStage.modelId, sizeof(finalStage.modelId));
+	if (filterStage.onnx) {
+		const auto optionsKey = g_cascadeReranker.GetOptionsKey();
+		hash = ScoreCache::HashBytes(hash, &filterStage.modelId, sizeof(filterStage.modelId));
+		hash = ScoreCache::HashBytes(hash, &optionsKey, sizeof(optionsKey));
+	}
+	for (int i = 0; i < sentenceCount; ++i) {
+		hash = ScoreCache::HashBytes(hash, &tokenCounts[i], sizeof(tokenCounts[i]));
+		hash = ScoreCache::HashBytes(hash, tokenIds[i], tokenCounts[i] * sizeof(int));
+	}
+	return hash;
+}
+
+// "default" is the model beside the DLL, RegisterModel() adds others.
+const wchar_t* const c_defaultModelName = L"default";
+
+ModelRegistry& GetModelRegistry() {
+	static ModelRegistry registry;
+	static std::once_flag defaultRegistered;
+	std::call_once(defaultRegistered, []() { registry.Register(c_defaultModelName, GetThisModuleDirectory()); });
+	return registry;
+}
+
+LoadedModels EnsureInitialized(const wchar_t* modelName = c_defaultModelName) {
+	return GetModelRegistry().Acquire(modelName);
+}
+
+bool g_isScoringDaemon = false;
+
+// GPTRERANKER_DAEMON=<socket path> ("1" = the default path) sends EvaluateSentences() and EvaluateSentencesUtf8()
+// to RunScoringDaemon in another process, which holds the models instead of this one.
+ScoringClient* GetDaemonClient() {
+	static const auto client = []() -> std::unique_ptr<ScoringClient> {
+		wchar_t value[MAX_PATH] = {};
+		if (g_isScoringDaemon || GetEnvironmentVariable(L"GPTRERANKER_DAEMON", value, ARRAYSIZE(value)) == 0 || value[0] == L'0') {
+			return nullptr;
+		}
+		return std::make_unique<ScoringClient>(wcscmp(value, L"1") == 0 ? ScoringProtocol::GetDefaultSocketPath() : std::wstring(value));
+	}();
+	return client.get();
+}
+
+bool IsDaemonClientEnabled() {
+	wchar_t value[8] = {};
+	return GetEnvironmentVariable(L"GPTRERANKER_DAEMON", value, ARRAYSIZE(value)) != 0 && value[0] != L'0';
+}
+
+// starts loading and warmup in background and returns immediately.
+// shapes are (batchSizes[i], sequenceLengths[i]), pass shapeCount = 0 for no warmup.
+// returns -1 for a negative shapeCount, null arrays or a dimension below 1.
+extern "C" __declspec(dllexport)
+int WINAPI Preload(const int* batchSizes, const int* sequenceLengths, int shapeCount) try
+{
+	if (shapeCount < 0 || (shapeCount > 0 && (batchSizes == nullptr || sequenceLengths == nullptr))) return -1;
+	std::vector<std::tuple<int, int>> warmupShapes;
+	for (int i = 0; i < shapeCount; ++i) {
+		if (batchSizes[i] <= 0 || sequenceLengths[i] <= 0) return -1;
+		warmupShapes.emplace_back(batchSizes[i], sequenceLengths[i]);
+	}
+	if (GetDaemonClient() != nullptr) return 0;
+	GetModelRegistry().StartLoading(c_defaultModelName, warmupShapes);
+	return 0;
+}
+catch (...) { return -1; }
+
+// called from DllMain when GPTRERANKER_PRELOAD is set, runs after DllMain returns (loader lock is released).
+// the thread gets a module reference taken before it was created, and releases it when the loading is done.
+DWORD WINAPI PreloadThreadProc(LPVOID parameter) {
+	const auto hModule = reinterpret_cast<HMODULE>(parameter);
+	try {
+		GetModelRegistry().StartLoading(c_defaultModelName, c_defaultWarmupShapes).wait();
+	}
+	catch (...) {}
+	FreeLibraryAndExitThread(hModule, 0);
+}
+
+void StartBackgroundLoadingIfEnabled() {
+	wchar_t value[8] = {};
+	if (GetEnvironmentVariable(L"GPTRERANKER_PRELOAD", value, ARRAYSIZE(value)) == 0 || value[0] == L'0') {
+		return;
+	}
+	// a client has no models to load. the daemon process loads them itself in RunScoringDaemon.
+	if (IsDaemonClientEnabled()) return;
+	HMODULE hModule = {};
+	if (!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, reinterpret_cast<LPCWSTR>(PreloadThreadProc), &hModule)) return;
+	const auto thread = CreateThread(nullptr, 0, PreloadThreadProc, hModule, 0, nullptr);
+	if (thread == nullptr) {
+		FreeLibrary(hModule);
+		return;
+	}
+	CloseHandle(thread);
+}
+
+// a request with identical candidates (same token ids) merged, each unique candidate is scored once.
+struct PreparedRequest {
+	ScoringStage finalStage;
+	ScoringStage filterStage;
+	std::vector<std::vector<int>> tokensList;	// final model ids of every candidate
+	std::vector<const int*> uniqueTokenIds;		// views of tokensList
+	std::vector<int> uniqueTokenCounts;
+	std::vector<std::string_view> uniqueSentences;
+	std::vector<int> uniqueIndices;				// unique candidate of each candidate
+	uint64_t key = 0;							// score cache key of the full scores
+
+	int GetUniqueCount() const { return static_cast<int>(uniqueSentences.size()); }
+
+	void Scatter(const std::vector<float>& uniqueScores, float* scores) const {
+		for (size_t i = 0; i < uniqueIndices.size(); ++i) {
+			scores[i] = uniqueScores[uniqueIndices[i]];
+		}
+	}
+};
+
+// sentences are views of the caller's utf-8 text, nothing is copied before the tokenizer.
+// the models are held by the request, a swap or eviction meanwhile does not affect it.
+PreparedRequest PrepareRequest(const wchar_t* modelName, const std::string_view* sentences, int sentenceCount, const CancellationToken* cancellation) {
+	ThrowIfCancelled(cancellation);
+	PreparedRequest request;
+	std::tie(request.finalStage, request.filterStage) = EnsureInitialized(modelName);
+
+	// keys point into tokensList, ids are compared in place.
+	const auto idsLess = [](const std::vector<int>* a, const std::vector<int>* b) { return *a < *b; };
+	std::map<const std::vector<int>*, int, decltype(idsLess)> uniqueIds(idsLess);
+	request.uniqueIndices.resize(sentenceCount);
+	request.tokensList = request.finalStage.tokenizer->EncodeBatch(sentences, sentenceCount);
+	for (int i = 0; i < sentenceCount; ++i) {
+		const auto& tokens = request.tokensList[i];
+		const auto [it, isNew] = uniqueIds.emplace(&tokens, request.GetUniqueCount());
+		if (isNew) {
+			request.uniqueTokenIds.push_back(tokens.data());
+			request.uniqueTokenCounts.push_back(static_cast<int>(tokens.size()));
+			request.uniqueSentences.push_back(sentences[i]);
+		}
+		request.uniqueIndices[i] = it->second;
+	}
+	ThrowIfCancelled(cancellation);
+
+	request.key = GetScoreKey(request.finalStage, request.filterStage, request.uniqueTokenIds.data(), request.uniqueTokenCounts.data(), request.GetUniqueCount());
+	return request;
+}
+
+std::vector<float> ComputeFullScores(const PreparedRequest& request, const CancellationToken* cancellation) {
+	return g_scoreCache.GetOrCompute(request.key, request.GetUniqueCount(), [&]() {
+		std::vector<float> computedScores(request.GetUniqueCount(), 0.0f);
+		g_cascadeReranker.Evaluate(request.finalStage, request.filterStage, request.uniqueSentences.data(), request.GetUniqueCount(), computedScores.data(), cancellation);
+		return computedScores;
+	});
+}
+
+// throws OperationCancelled when cancellation is set before the scores are complete.
+void EvaluateUtf8(const wchar_t* modelName, const std::string_view* sentences, int sentenceCount, float* scores,
+	const CancellationToken* cancellation = nullptr) {
+	const auto request = PrepareRequest(modelName, sentences, sentenceCount, cancellation);
+	request.Scatter(ComputeFullScores(request, cancellation), scores);
+}
+
+// default model, in this process or in the daemon. a request in the daemon runs to its end,
+// its cancellation only drops the result.
+int EvaluateDefault(const std::string_view* sentences, int sentenceCount, float* scores, const CancellationToken* cancellation = nullptr) {
+	if (const auto client = GetDaemonClient()) {
+		ThrowIfCancelled(cancellation);
+		const auto isSucceeded = client->Evaluate(sentences, sentenceCount, scores);
+		ThrowIfCancelled(cancellation);
+		return isSucceeded ? 0 : -1;
+	}
+	EvaluateUtf8(c_defaultModelName, sentences, sentenceCount, scores, cancellation);
+	return 0;
+}
 
-	static std::shared_ptr<Tokenizer> tokenizer;
-	if (!tokenizer) {
-		tokenizer = Tokenizer::CreateInstance();
-		const auto& modelPath = thisModuleDir + L"spiece.model";
-		tokenizer->Load(modelPath.c_str());
+extern "C" __declspec(dllexport)
+int WINAPI EvaluateSentences(const char** sentences, float* scores, int sentenceCount) try
+{
+	const std::vector<std::string_view> sentenceViews(sentences, sentences + sentenceCount);
+	return EvaluateDefault(sentenceViews.data(), sentenceCount, scores);
+}
+catch (...) { return -1; }
+
+// utf-8 spans, sentence i is texts[i][0 .. byteLengths[i]) and needs no terminating zero.
+extern "C" __declspec(dllexport)
+int WINAPI EvaluateSentencesUtf8(const char* const* texts, const int* byteLengths, float* scores, int sentenceCount) try
+{
+	std::vector<std::string_view> sentenceViews;
+	for (int i = 0; i < sentenceCount; ++i) {
+		if (byteLengths[i] < 0) return -1;
+		sentenceViews.emplace_back(texts[i], static_cast<size_t>(byteLengths[i]));
 	}
+	return EvaluateDefault(sentenceViews.data(), sentenceCount, scores);
+}
+catch (...) { return -1; }
+
+// result is 0, -1 (failed) or -2 (cancelled) with scores = nullptr. scores are valid during the call only.
+typedef void (WINAPI* ScoresCallback)(void* context, int result, const float* scores, int sentenceCount);
+
+// never destroyed, joining its threads at DLL_PROCESS_DETACH would deadlock on the loader lock.
+// the module is pinned instead, so queued requests never run in an unloaded DLL.
+ScoringExecutor& GetScoringExecutor() {
+	static const auto executor = []() {
+		HMODULE hModule = {};
+		GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, reinterpret_cast<LPCWSTR>(GetThisModuleHandle), &hModule);
+		return new ScoringExecutor(2);
+	}();
+	return *executor;
+}
+
+RequestTracker g_requestTracker;
 
-	static std::shared_ptr<OnnxConnector> onnx;
-	if (!onnx) {
-		onnx = OnnxConnector::CreateInstance();
-		const auto& modelPath = thisModuleDir + L"decoder_model.onnx";
-		onnx->Initialize(modelPath.c_str());
+// returns the request id for CancelScoringRequest().
+long long PostEvaluation(long long channel, std::vector<std::string> texts, ScoresCallback callback, void* context) {
+	const auto request = g_requestTracker.Begin(channel);
+	GetScoringExecutor().Post([request, texts = std::move(texts), callback, context]() {
+		const std::vector<std::string_view> sentenceViews(texts.begin(), texts.end());
+		const auto sentenceCount = static_cast<int>(texts.size());
+		std::vector<float> scores(sentenceCount, 0.0f);
+		int result = -1;
+		try {
+			result = EvaluateDefault(sentenceViews.data(), sentenceCount, scores.data(), request.cancellation.get());
+		}
+		catch (const OperationCancelled&) { result = -2; }
+		catch (...) {}
+		g_requestTracker.End(request.id);
+		callback(context, result, result == 0 ? scores.data() : nullptr, sentenceCount);
+	});
+	return request.id;
+}
+
+// same as EvaluateSentences(), but returns at once. callback runs on a scoring thread (not the caller's), and two requests
+// in flight may complete out of order, context tells them apart. sentences are copied, the caller may free them when this returns.
+extern "C" __declspec(dllexport)
+int WINAPI EvaluateSentencesAsync(const char** sentences, int sentenceCount, ScoresCallback callback, void* context) try
+{
+	if (callback == nullptr) return -1;
+	PostEvaluation(0, std::vector<std::string>(sentences, sentences + sentenceCount), callback, context);
+	return 0;
+}
+catch (...) { return -1; }
+
+// same as EvaluateSentencesUtf8(), delivered as EvaluateSentencesAsync() does.
+extern "C" __declspec(dllexport)
+int WINAPI EvaluateSentencesUtf8Async(const char* const* texts, const int* byteLengths, int sentenceCount, ScoresCallback callback, void* context) try
+{
+	if (callback == nullptr) return -1;
+	std::vector<std::string> sentenceTexts;
+	for (int i = 0; i < sentenceCount; ++i) {
+		if (byteLengths[i] < 0) return -1;
+		sentenceTexts.emplace_back(texts[i], static_cast<size_t>(byteLengths[i]));
 	}
+	PostEvaluation(0, std::move(sentenceTexts), callback, context);
+	return 0;
+}
+catch (...) { return -1; }
+
+// EvaluateSentencesAsync() on a channel, one per input context (e.g. a text field). the request cancels the older ones
+// on the same channel that are still queued or running, their callbacks get -2. channel 0 cancels nothing and
+// can not be cancelled. returns the request id for CancelScoringRequest() (0 on channel 0), or -1.
+extern "C" __declspec(dllexport)
+long long WINAPI EvaluateChannelSentencesAsync(long long channel, const char** sentences, int sentenceCount, ScoresCallback callback, void* context) try
+{
+	if (callback == nullptr) return -1;
+	return PostEvaluation(channel, std::vector<std::string>(sentences, sentences + sentenceCount), callback, context);
+}
+catch (...) { return -1; }
 
-	return std::make_tuple(tokenizer, onnx);
+// a queued request is dropped when it starts, a running one stops at its next check (next model sub-run or readout row).
+// returns -1 when the request has already completed.
+extern "C" __declspec(dllexport)
+int WINAPI CancelScoringRequest(long long requestId)
+{
+	return g_requestTracker.Cancel(requestId) ? 0 : -1;
+}
+
+// values: cancelled requests, requests waiting for a scoring thread.
+// returns the number of values written.
+extern "C" __declspec(dllexport)
+int WINAPI GetScoringRequestStatistics(long long* values, int valueCount) try
+{
+	if (values == nullptr || valueCount < 0) return -1;
+	const long long allValues[] = {
+		g_requestTracker.GetCancelledCount(), static_cast<long long>(GetScoringExecutor().GetPendingCount()) };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
+
+// same as EvaluateSentences() on a model added by RegisterModel().
+extern "C" __declspec(dllexport)
+int WINAPI EvaluateModelSentences(const wchar_t* modelName, const char** sentences, float* scores, int sentenceCount) try
+{
+	const std::vector<std::string_view> sentenceViews(sentences, sentences + sentenceCount);
+	EvaluateUtf8(modelName, sentenceViews.data(), sentenceCount, scores);
+	return 0;
 }
+catch (...) { return -1; }
 
+// already tokenized input (ids of spiece.model beside the DLL), the tokenizer and the cascade are skipped.
+// sentence i is tokenCounts[i] ids, sentences are stored back to back in tokenIds. an id out of the vocabulary returns -1.
 extern "C" __declspec(dllexport)
-int WINAPI EvaluateSentences(const char** sentences, float* scores, int sentenceCount)
+int WINAPI EvaluateTokenIds(const int* tokenIds, const int* tokenCounts, float* scores, int sentenceCount) try
 {
-	const auto [tokenizer, onnx] = EnsureInitialized();
+	if (sentenceCount <= 0) return -1;
+	const auto [finalStage, filterStage] = EnsureInitialized();
 
-	std::vector<std::vector<int>> tokensList;
+	// every id must be a piece of the vocabulary, the model has no logits for others.
+	const auto pieceSize = finalStage.tokenizer->GetPieceSize();
+	std::vector<const int*> sentenceIds;
 	for (int i = 0; i < sentenceCount; ++i) {
-		auto&& encodedSentence = tokenizer->Encode(sentences[i]);
-		tokensList.emplace_back(encodedSentence);
+		if (tokenCounts[i] <= 0) return -1;
+		for (int j = 0; j < tokenCounts[i]; ++j) {
+			if (tokenIds[j] < 0 || tokenIds[j] >= pieceSize) return -1;
+		}
+		sentenceIds.push_back(tokenIds);
+		tokenIds += tokenCounts[i];
+	}
+
+	// same key as text input without a filter model, both are scored by the final model only.
+	const auto key = GetScoreKey(finalStage, ScoringStage{}, sentenceIds.data(), tokenCounts, sentenceCount);
+	const auto& computedScores = g_scoreCache.GetOrCompute(key, sentenceCount, [&]() {
+		std::vector<float> results(sentenceCount, 0.0f);
+		finalStage.onnx->CompareTokenDiffs(sentenceIds.data(), tokenCounts, sentenceCount, finalStage.tokenizer->eos_id(), results.data());
+		return results;
+	});
+	std::copy(computedScores.begin(), computedScores.end(), scores);
+	return 0;
+}
+catch (...) { return -1; }
+
+// modelDir holds spiece.model and decoder_model.onnx (and optional filter\), it ends with a path separator.
+// the model is loaded on its first use, an existing name gets the new directory at its next load.
+extern "C" __declspec(dllexport)
+int WINAPI RegisterModel(const wchar_t* modelName, const wchar_t* modelDir) try
+{
+	GetModelRegistry().Register(modelName, modelDir);
+	return 0;
+}
+catch (...) { return -1; }
+
+// requests in flight finish on the model, it is freed after them.
+extern "C" __declspec(dllexport)
+int WINAPI UnregisterModel(const wchar_t* modelName) try
+{
+	return GetModelRegistry().Unregister(modelName) ? 0 : -1;
+}
+catch (...) { return -1; }
+
+// loads a new version (modelDir, or the registered directory when nullptr) and swaps it in without a restart.
+// requests keep using the current version until the swap, and the ones in flight finish on it.
+// returns -1 and keeps the current version when the new one fails to load.
+extern "C" __declspec(dllexport)
+int WINAPI ReloadModel(const wchar_t* modelName, const wchar_t* modelDir) try
+{
+	GetModelRegistry().Reload(modelName != nullptr ? modelName : c_defaultModelName, modelDir != nullptr ? modelDir : L"", c_defaultWarmupShapes);
+	return 0;
+}
+catch (...) { return -1; }
+
+// idle models are unloaded, least recently used first, while the loaded model files exceed maxBytes. 0 = no limit, negative is rejected (-1).
+extern "C" __declspec(dllexport)
+int WINAPI SetModelMemoryBudget(long long maxBytes) try
+{
+	if (maxBytes < 0) return -1;
+	GetModelRegistry().SetMemoryBudget(static_cast<size_t>(maxBytes));
+	return 0;
+}
+catch (...) { return -1; }
+
+// values: loads, reloads, failed loads, evictions, registered models, loaded models, loaded model bytes.
+// returns the number of values written.
+extern "C" __declspec(dllexport)
+int WINAPI GetModelStatistics(long long* values, int valueCount) try
+{
+	if (values == nullptr || valueCount < 0) return -1;
+	const auto statistics = GetModelRegistry().GetStatistics();
+	const long long allValues[] = {
+		statistics.loadCount, statistics.reloadCount, statistics.failedCount, statistics.evictedCount,
+		statistics.registeredCount, statistics.loadedCount, statistics.memoryBytes };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
+
+// hosts the models for other processes: rundll32 gptreranker.dll,RunScoringDaemon [socket path]
+// without a path it listens on %TEMP%\gptreranker.sock. requests use the default model, score cache and cascade options
+// of this process. blocks until the process is ended.
+extern "C" __declspec(dllexport)
+void CALLBACK RunScoringDaemonW(HWND, HINSTANCE, LPWSTR commandLine, int)
+{
+	g_isScoringDaemon = true;
+	std::wstring socketPath = commandLine != nullptr ? commandLine : L"";
+	socketPath.erase(0, socketPath.find_first_not_of(L" \t\""));
+	socketPath.erase(socketPath.find_last_not_of(L" \t\"") + 1);
+	if (socketPath.empty()) socketPath = ScoringProtocol::GetDefaultSocketPath();
+
+	// the first client does not wait for the model loading.
+	GetModelRegistry().StartLoading(c_defaultModelName, c_defaultWarmupShapes);
+	ScoringServer::Run(socketPath, [](const std::string_view* sentences, int sentenceCount, float* scores) {
+		EvaluateUtf8(c_defaultModelName, sentences, sentenceCount, scores);
+	});
+}
+
+// end-to-end cost of the daemon (socketPath, nullptr = default) against scoring in this process.
+// each repetition scores a new request, so neither score cache hits.
+// values: ping round-trip microseconds, in process microseconds per request, daemon microseconds per request,
+// largest score difference in 1e-6 units. returns the number of values written, -1 when the daemon fails.
+extern "C" __declspec(dllexport)
+int WINAPI BenchmarkScoringDaemon(const wchar_t* socketPath, int repeatCount, long long* values, int valueCount) try
+{
+	ScoringClient client(socketPath != nullptr ? socketPath : ScoringProtocol::GetDefaultSocketPath());
+	if (repeatCount <= 0 || !client.Ping()) return -1;
+
+	const std::string candidates[] = {
+		(const char*)u8"登校時間が、いつもよりとても速い",
+		(const char*)u8"登校時間が、いつもよりとても早い",
+		(const char*)u8"登校時間が、いつもよりとても遅い",
+	};
+	static std::atomic<int> benchmarkNumber = 0;
+	const auto prefix = std::to_string(++benchmarkNumber) + "-";
+	std::vector<std::vector<std::string>> requests(repeatCount);
+	for (int i = 0; i < repeatCount; ++i) {
+		for (const auto& candidate : candidates) requests[i].push_back(prefix + std::to_string(i) + candidate);
+	}
+	const auto toViews = [](const std::vector<std::string>& request) { return std::vector<std::string_view>(request.begin(), request.end()); };
+	const auto sentenceCount = static_cast<int>(ARRAYSIZE(candidates));
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeatCount; ++i) {
+		if (!client.Ping()) return -1;
+	}
+	const auto pingSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<float> localScores(repeatCount * sentenceCount);
+	EnsureInitialized();
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeatCount; ++i) {
+		EvaluateUtf8(c_defaultModelName, toViews(requests[i]).data(), sentenceCount, &localScores[i * sentenceCount]);
+	}
+	const auto localSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::vector<float> daemonScores(repeatCount * sentenceCount);
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeatCount; ++i) {
+		if (!client.Evaluate(toViews(requests[i]).data(), sentenceCount, &daemonScores[i * sentenceCount])) return -1;
 	}
+	const auto daemonSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-	onnx->CompareSentenceDiffs(tokensList, tokenizer->eos_id(), scores);
+	float maxDifference = 0.0f;
+	for (size_t i = 0; i < localScores.size(); ++i) {
+		const auto difference = std::abs(localScores[i] - daemonScores[i]);
+		if (difference > maxDifference) maxDifference = difference;
+	}
+
+	const long long allValues[] = {
+		static_cast<long long>(pingSeconds * 1e6 / repeatCount), static_cast<long long>(localSeconds * 1e6 / repeatCount),
+		static_cast<long long>(daemonSeconds * 1e6 / repeatCount), static_cast<long long>(maxDifference * 1e6) };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
+
+// truncated context mode keeps this many tokens of the context all candidates share.
+constexpr int c_truncatedContextTokens = 16;
+
+DeadlineScheduler g_deadlineScheduler;
+
+// leading ids of every candidate dropped by the truncated context mode, at least one id of each candidate is kept.
+int GetTruncatedCount(const PreparedRequest& request) {
+	int commonCount = *std::min_element(request.uniqueTokenCounts.begin(), request.uniqueTokenCounts.end()) - 1;
+	for (int i = 1; i < request.GetUniqueCount(); ++i) {
+		int j = 0;
+		while (j < commonCount && request.uniqueTokenIds[i][j] == request.uniqueTokenIds[0][j]) ++j;
+		commonCount = j;
+	}
+	return commonCount > c_truncatedContextTokens ? commonCount - c_truncatedContextTokens : 0;
+}
+
+// scores of a degraded mode, they are not cached, the cache holds full scores only.
+std::vector<float> ComputeDegradedScores(const PreparedRequest& request, ScoringMode mode, int truncatedCount) {
+	const auto uniqueCount = request.GetUniqueCount();
+	std::vector<float> scores(uniqueCount, 0.0f);
+	if (mode == ScoringMode::TruncatedContext) {
+		std::vector<const int*> tokenIds;
+		std::vector<int> tokenCounts;
+		for (int i = 0; i < uniqueCount; ++i) {
+			tokenIds.push_back(request.uniqueTokenIds[i] + truncatedCount);
+			tokenCounts.push_back(request.uniqueTokenCounts[i] - truncatedCount);
+		}
+		request.finalStage.onnx->CompareTokenDiffs(tokenIds.data(), tokenCounts.data(), uniqueCount, request.finalStage.tokenizer->eos_id(), scores.data());
+	} else {
+		const auto& tokensList = request.filterStage.tokenizer->EncodeBatch(request.uniqueSentences.data(), request.uniqueSentences.size());
+		request.filterStage.onnx->CompareSentenceDiffs(tokensList, request.filterStage.tokenizer->eos_id(), scores.data());
+	}
+	return scores;
+}
 
+// EvaluateSentences() within a latency budget. the best of full scoring, the final model on the last 16 tokens of the
+// context the candidates share, and the filter model alone, that is predicted to finish in time is used (the fastest
+// when none is). predictions come from the latency models of the connectors, learned from every run.
+// full scores in the score cache are always used. *mode gets the ScoringMode used: 0 full, 1 cached, 2 truncated
+// context, 3 filter model. budgetMicroseconds <= 0 (and the daemon client) always score fully.
+extern "C" __declspec(dllexport)
+int WINAPI EvaluateSentencesWithDeadline(const char** sentences, float* scores, int sentenceCount, int budgetMicroseconds, int* mode) try
+{
+	const auto startTime = std::chrono::steady_clock::now();
+	const std::vector<std::string_view> sentenceViews(sentences, sentences + sentenceCount);
+	if (mode != nullptr) *mode = static_cast<int>(ScoringMode::Full);
+	if (budgetMicroseconds <= 0 || sentenceCount <= 0 || GetDaemonClient() != nullptr) return EvaluateDefault(sentenceViews.data(), sentenceCount, scores);
+
+	const auto request = PrepareRequest(c_defaultModelName, sentenceViews.data(), sentenceCount, nullptr);
+	const auto budgetSeconds = budgetMicroseconds * 1e-6;
+	auto usedMode = ScoringMode::Cached;
+	std::vector<float> uniqueScores;
+	if (!g_scoreCache.TryGet(request.key, request.GetUniqueCount(), uniqueScores)) {
+		const auto uniqueCount = request.GetUniqueCount();
+		const auto sequenceLength = *std::max_element(request.uniqueTokenCounts.begin(), request.uniqueTokenCounts.end());
+		const auto truncatedCount = GetTruncatedCount(request);
+
+		std::vector<DeadlineScheduler::Option> options;
+		options.push_back({ ScoringMode::Full, g_cascadeReranker.PredictSeconds(request.finalStage, request.filterStage, uniqueCount, sequenceLength) });
+		if (truncatedCount > 0) {
+			options.push_back({ ScoringMode::TruncatedContext, request.finalStage.onnx->PredictRunSeconds(uniqueCount, sequenceLength - truncatedCount) });
+		}
+		if (request.filterStage.onnx) {
+			options.push_back({ ScoringMode::FilterModel, request.filterStage.onnx->PredictRunSeconds(uniqueCount, sequenceLength) });
+		}
+
+		const auto elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		usedMode = DeadlineScheduler::Choose(options, budgetSeconds - elapsedSeconds);
+		uniqueScores = usedMode == ScoringMode::Full ? ComputeFullScores(request, nullptr) : ComputeDegradedScores(request, usedMode, truncatedCount);
+	}
+	request.Scatter(uniqueScores, scores);
+
+	const auto totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	g_deadlineScheduler.Record(usedMode, totalSeconds > budgetSeconds);
+	if (mode != nullptr) *mode = static_cast<int>(usedMode);
 	return 0;
 }
+catch (...) { return -1; }
+
+// values: full, cached, truncated context and filter model responses of EvaluateSentencesWithDeadline(),
+// responses later than their budget. returns the number of values written.
+extern "C" __declspec(dllexport)
+int WINAPI GetDeadlineStatistics(long long* values, int valueCount) try
+{
+	if (values == nullptr || valueCount < 0) return -1;
+	const auto statistics = g_deadlineScheduler.GetStatistics();
+	const long long allValues[] = {
+		statistics.modeCounts[0], statistics.modeCounts[1], statistics.modeCounts[2], statistics.modeCounts[3], statistics.missedCount };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
+
+// cascade thresholds, see CascadeReranker::Options. takes effect only when the filter model exists.
+extern "C" __declspec(dllexport)
+int WINAPI SetCascadeOptions(int topK, float scoreMargin, int minCandidates, int auditInterval) try
+{
+	CascadeReranker::Options options;
+	options.topK = topK;
+	options.scoreMargin = scoreMargin;
+	options.minCandidates = minCandidates;
+	options.auditInterval = auditInterval;
+	g_cascadeReranker.SetOptions(options);
+	return 0;
+}
+catch (...) { return -1; }
+
+// maxBytes = 0 disables the score cache (16MB by default).
+// persistentFileName keeps scores in a memory mapped file across restarts, nullptr or empty for memory only.
+extern "C" __declspec(dllexport)
+int WINAPI SetScoreCacheOptions(long long maxBytes, const wchar_t* persistentFileName) try
+{
+	if (maxBytes < 0) return -1;
+	g_scoreCache.SetCapacity(static_cast<size_t>(maxBytes));
+	return g_scoreCache.OpenPersistentFile(persistentFileName != nullptr ? persistentFileName : L"") ? 0 : -1;
+}
+catch (...) { return -1; }
+
+// values: lookups, hits, persistent file hits, coalesced with a request in flight, misses, evictions, entries, bytes.
+// returns the number of values written.
+extern "C" __declspec(dllexport)
+int WINAPI GetScoreCacheStatistics(long long* values, int valueCount) try
+{
+	if (values == nullptr || valueCount < 0) return -1;
+	const auto statistics = g_scoreCache.GetStatistics();
+	const long long allValues[] = {
+		statistics.lookupCount, statistics.hitCount, statistics.persistentHitCount, statistics.coalescedCount,
+		statistics.missCount, statistics.evictedCount, statistics.entryCount, statistics.memoryBytes };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
+
+// encodes every line of a utf-8 corpus with the native tokenizer and SentencePieceProcessor (final model spiece.model).
+// values: lines, lines with different ids, native microseconds, library microseconds.
+// returns the number of values written, -1 when the native tokenizer does not support the model.
+// run it on a corpus of the application before enabling the native tokenizer (GPTRERANKER_NATIVE_TOKENIZER=1).
+extern "C" __declspec(dllexport)
+int WINAPI VerifyTokenizer(const wchar_t* corpusFileName, long long* values, int valueCount) try
+{
+	const auto [finalStage, filterStage] = EnsureInitialized();
+	const auto check = finalStage.tokenizer->VerifyNativeEncoder(corpusFileName);
+	const long long allValues[] = {
+		check.lineCount, check.mismatchCount,
+		static_cast<long long>(check.nativeSeconds * 1e6), static_cast<long long>(check.librarySeconds * 1e6) };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
+
+// values: requests, cascaded requests, candidates, rescored candidates, audited requests,
+// audited requests with a different top-1, audited requests whose true top-1 was pruned.
+// returns the number of values written.
+extern "C" __declspec(dllexport)
+int WINAPI GetCascadeStatistics(long long* values, int valueCount) try
+{
+	if (values == nullptr || valueCount < 0) return -1;
+	const auto statistics = g_cascadeReranker.GetStatistics();
+	const long long allValues[] = {
+		statistics.requestCount, statistics.cascadedCount, statistics.candidateCount, statistics.rescoredCount,
+		statistics.auditCount, statistics.rankingChangedCount, statistics.bestPrunedCount };
+	const auto count = valueCount < static_cast<int>(ARRAYSIZE(allValues)) ? valueCount : static_cast<int>(ARRAYSIZE(allValues));
+	for (int i = 0; i < count; ++i) values[i] = allValues[i];
+	return count;
+}
+catch (...) { return -1; }
 
 extern "C" __declspec(dllexport)
 void WINAPI TestFunction()
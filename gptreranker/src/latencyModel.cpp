@@ -0,0 +1,40 @@
+#include <algorithm>
+#include <cmath>
+#include "latencyModel.h"
+
+void LatencyModel::Observe(double workUnits, double seconds) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// error of the fit before this run, so the margin measures how far predictions are off.
+	if (m_observationCount > 0) {
+		const auto residual = seconds - PredictMeanLocked(workUnits);
+		m_residualSquares = c_decay * m_residualSquares + (1.0 - c_decay) * residual * residual;
+	}
+	m_weight = c_decay * m_weight + 1.0;
+	m_sumX = c_decay * m_sumX + workUnits;
+	m_sumY = c_decay * m_sumY + seconds;
+	m_sumXX = c_decay * m_sumXX + workUnits * workUnits;
+	m_sumXY = c_decay * m_sumXY + workUnits * seconds;
+	++m_observationCount;
+}
+
+double LatencyModel::Predict(double workUnits) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_observationCount == 0) return 0.0;
+	return PredictMeanLocked(workUnits) + 2.0 * std::sqrt(m_residualSquares);
+}
+
+long long LatencyModel::GetObservationCount() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_observationCount;
+}
+
+double LatencyModel::PredictMeanLocked(double workUnits) const {
+	const auto meanX = m_sumX / m_weight;
+	const auto meanY = m_sumY / m_weight;
+	const auto varianceX = m_sumXX / m_weight - meanX * meanX;
+	// runs of one size only give the mean, the time is taken as proportional to the work then.
+	const auto slope = varianceX > 1e-9 * (meanX * meanX + 1.0)
+		? (m_sumXY / m_weight - meanX * meanY) / varianceX
+		: (meanX > 0.0 ? meanY / meanX : 0.0);
+	return std::max(meanY + std::max(slope, 0.0) * (workUnits - meanX), 0.0);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <mutex>
+
+// online latency model of one model's runs: seconds = a + b * workUnits (batch * sequence tokens), fitted by
+// exponentially weighted least squares, so it follows load changes within about the last 20 runs.
+// predictions add twice the weighted deviation of past predictions, budgets are about the tail, not the mean.
+class LatencyModel
+{
+public:
+	void Observe(double workUnits, double seconds);
+	// 0 before the first observation.
+	double Predict(double workUnits);
+	long long GetObservationCount();
+
+private:
+	double PredictMeanLocked(double workUnits) const;
+
+	static constexpr double c_decay = 0.95;
+
+	std::mutex m_mutex;
+	double m_weight = 0.0;
+	double m_sumX = 0.0;
+	double m_sumY = 0.0;
+	double m_sumXX = 0.0;
+	double m_sumXY = 0.0;
+	double m_residualSquares = 0.0;
+	long long m_observationCount = 0;
+};
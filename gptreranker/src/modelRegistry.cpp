@@ -0,0 +1,220 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <stdexcept>
+#include "modelRegistry.h"
+#include "scoreCache.h"
+
+namespace {
+	bool FileExists(const std::wstring& filePath) {
+		const auto attributes = GetFileAttributes(filePath.c_str());
+		return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+	}
+
+	size_t GetDirectoryFileBytes(const std::wstring& directory) {
+		size_t totalBytes = 0;
+		WIN32_FIND_DATA findData = {};
+		const auto find = FindFirstFile((directory + L"*").c_str(), &findData);
+		if (find == INVALID_HANDLE_VALUE) return 0;
+		do {
+			if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+				totalBytes += (static_cast<size_t>(findData.nFileSizeHigh) << 32) | findData.nFileSizeLow;
+			}
+		} while (FindNextFile(find, &findData));
+		FindClose(find);
+		return totalBytes;
+	}
+
+	ScoringStage LoadStage(const std::wstring& modelDir, const ModelRegistry::WarmupShapes& warmupShapes) {
+		auto tokenizer = Tokenizer::CreateInstance();
+		const auto& tokenizerPath = modelDir + L"spiece.model";
+		tokenizer->Load(tokenizerPath.c_str());
+
+		auto onnx = OnnxConnector::CreateInstance();
+		const auto& modelPath = modelDir + L"decoder_model.onnx";
+		onnx->Initialize(modelPath.c_str());
+
+		for (const auto& [batchSize, sequenceLength] : warmupShapes) {
+			onnx->Warmup(batchSize, sequenceLength);
+		}
+
+		return ScoringStage{ tokenizer, onnx, ModelRegistry::GetModelId(modelPath) };
+	}
+}
+
+void ModelRegistry::Register(const std::wstring& name, const std::wstring& modelDir) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries[name].modelDir = modelDir;
+}
+
+bool ModelRegistry::Unregister(const std::wstring& name) {
+	// a loading in progress is waited for by the future destructor, that must not happen under the lock.
+	std::shared_future<LoadedModels> released;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const auto it = m_entries.find(name);
+	if (it == m_entries.end()) return false;
+	released = std::move(it->second.models);
+	m_entries.erase(it);
+	return true;
+}
+
+void ModelRegistry::SetMemoryBudget(size_t maxBytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxBytes = maxBytes;
+	EvictOverBudgetLocked(L"");
+}
+
+LoadedModels ModelRegistry::Acquire(const std::wstring& name) {
+	std::shared_future<LoadedModels> models;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto it = m_entries.find(name);
+		if (it == m_entries.end()) throw std::runtime_error("unknown model");
+		auto& entry = it->second;
+		if (!entry.models.valid() || entry.hasFailed) StartLoadingLocked(name, entry, {});
+		entry.lastUsed = ++m_useClock;
+		models = entry.models;
+	}
+	// the copy keeps this version alive until the caller releases it, even if it is swapped or evicted meanwhile.
+	return models.get();
+}
+
+std::shared_future<LoadedModels> ModelRegistry::StartLoading(const std::wstring& name, const WarmupShapes& warmupShapes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const auto it = m_entries.find(name);
+	if (it == m_entries.end()) throw std::runtime_error("unknown model");
+	auto& entry = it->second;
+	if (!entry.models.valid() || entry.hasFailed) StartLoadingLocked(name, entry, warmupShapes);
+	return entry.models;
+}
+
+void ModelRegistry::Reload(const std::wstring& name, const std::wstring& modelDir, const WarmupShapes& warmupShapes) {
+	std::wstring targetDir;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto it = m_entries.find(name);
+		if (it == m_entries.end()) throw std::runtime_error("unknown model");
+		targetDir = modelDir.empty() ? it->second.modelDir : modelDir;
+	}
+
+	std::promise<LoadedModels> loaded;
+	try {
+		loaded.set_value(Load(targetDir, warmupShapes));
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_statistics.failedCount;
+		throw;
+	}
+
+	std::shared_future<LoadedModels> replaced; // destroyed after the lock, see Unregister()
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const auto it = m_entries.find(name);
+	if (it == m_entries.end()) throw std::runtime_error("unknown model");
+	auto& entry = it->second;
+	replaced = std::move(entry.models);
+	entry.modelDir = targetDir;
+	entry.models = loaded.get_future().share();
+	entry.loadId = ++m_nextLoadId;
+	entry.isLoaded = true;
+	entry.hasFailed = false;
+	entry.memoryBytes = GetModelBytes(targetDir);
+	entry.lastUsed = ++m_useClock;
+	++m_statistics.reloadCount;
+	EvictOverBudgetLocked(name);
+}
+
+ModelRegistry::Statistics ModelRegistry::GetStatistics() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto statistics = m_statistics;
+	statistics.registeredCount = static_cast<long long>(m_entries.size());
+	for (const auto& [name, entry] : m_entries) {
+		if (!entry.isLoaded) continue;
+		++statistics.loadedCount;
+		statistics.memoryBytes += static_cast<long long>(entry.memoryBytes);
+	}
+	return statistics;
+}
+
+LoadedModels ModelRegistry::Load(const std::wstring& modelDir, const WarmupShapes& warmupShapes) {
+	auto finalStage = LoadStage(modelDir, warmupShapes);
+
+	// small model (gpt2-xsmall etc.) with its own spiece.model turns on the cascade.
+	ScoringStage filterStage;
+	const auto& filterDir = modelDir + L"filter\\";
+	if (FileExists(filterDir + L"decoder_model.onnx")) {
+		filterStage = LoadStage(filterDir, warmupShapes);
+	}
+
+	return std::make_tuple(finalStage, filterStage);
+}
+
+uint64_t ModelRegistry::GetModelId(const std::wstring& modelPath) {
+	auto hash = ScoreCache::HashBytes(ScoreCache::c_hashSeed, modelPath.data(), modelPath.size() * sizeof(wchar_t));
+	WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+	if (GetFileAttributesEx(modelPath.c_str(), GetFileExInfoStandard, &attributes)) {
+		hash = ScoreCache::HashBytes(hash, &attributes.nFileSizeHigh, sizeof(attributes.nFileSizeHigh));
+		hash = ScoreCache::HashBytes(hash, &attributes.nFileSizeLow, sizeof(attributes.nFileSizeLow));
+		hash = ScoreCache::HashBytes(hash, &attributes.ftLastWriteTime, sizeof(attributes.ftLastWriteTime));
+	}
+	return hash;
+}
+
+std::shared_future<LoadedModels> ModelRegistry::StartLoadingLocked(const std::wstring& name, Entry& entry, const WarmupShapes& warmupShapes) {
+	const auto loadId = ++m_nextLoadId;
+	entry.loadId = loadId;
+	entry.isLoaded = false;
+	entry.hasFailed = false;
+	entry.memoryBytes = GetModelBytes(entry.modelDir);
+	++m_statistics.loadCount;
+
+	entry.models = std::async(std::launch::async, [this, name, loadId, modelDir = entry.modelDir, warmupShapes]() {
+		try {
+			auto models = Load(modelDir, warmupShapes);
+			OnLoaded(name, loadId, true);
+			return models;
+		}
+		catch (...) {
+			OnLoaded(name, loadId, false);
+			throw;
+		}
+	}).share();
+	return entry.models;
+}
+
+// runs on the loading thread before the future is ready. the entry keeps the future, dropping it here would make
+// the future destructor wait for this very thread.
+void ModelRegistry::OnLoaded(const std::wstring& name, uint64_t loadId, bool isSucceeded) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!isSucceeded) ++m_statistics.failedCount;
+	const auto it = m_entries.find(name);
+	if (it == m_entries.end() || it->second.loadId != loadId) return;
+	it->second.isLoaded = isSucceeded;
+	it->second.hasFailed = !isSucceeded;
+	if (isSucceeded) EvictOverBudgetLocked(name);
+}
+
+// unloads idle models, least recently used first, until the loaded ones fit in the budget.
+void ModelRegistry::EvictOverBudgetLocked(const std::wstring& keepName) {
+	if (m_maxBytes == 0) return;
+	for (;;) {
+		size_t totalBytes = 0;
+		Entry* oldest = nullptr;
+		for (auto& [name, entry] : m_entries) {
+			if (!entry.isLoaded) continue;
+			totalBytes += entry.memoryBytes;
+			if (name == keepName || entry.models.wait_for(std::chrono::seconds(0)) != std::future_status::ready) continue;
+			// requests in flight hold copies, unloading would not free anything yet.
+			if (std::get<0>(entry.models.get()).onnx.use_count() > 1) continue;
+			if (oldest == nullptr || entry.lastUsed < oldest->lastUsed) oldest = &entry;
+		}
+		if (totalBytes <= m_maxBytes || oldest == nullptr) return;
+		oldest->models = std::shared_future<LoadedModels>();
+		oldest->isLoaded = false;
+		++m_statistics.evictedCount;
+	}
+}
+
+// file bytes of the model directory and its filter model, as an estimate of the memory they take when loaded.
+size_t ModelRegistry::GetModelBytes(const std::wstring& modelDir) {
+	return GetDirectoryFileBytes(modelDir) + GetDirectoryFileBytes(modelDir + L"filter\\");
+}
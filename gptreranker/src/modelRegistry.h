@@ -0,0 +1,75 @@
+#pragma once
+#include <cstdint>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "cascadeReranker.h"
+
+// final stage, filter stage (empty unless "filter\decoder_model.onnx" exists in the model directory).
+using LoadedModels = std::tuple<ScoringStage, ScoringStage>;
+
+// named models, each a directory with spiece.model + decoder_model.onnx (and optional filter\), loaded on first use.
+// when loaded models exceed the memory budget, idle ones are unloaded, least recently used first.
+// Reload() loads a new version beside the current one and swaps it in. requests in flight hold their own LoadedModels
+// (shared_ptrs), so they finish on the old version, which is freed when the last of them returns (RCU style).
+class ModelRegistry
+{
+public:
+	using WarmupShapes = std::vector<std::tuple<int, int>>;
+
+	struct Statistics {
+		long long loadCount = 0;
+		long long reloadCount = 0;
+		long long failedCount = 0;
+		long long evictedCount = 0;
+		long long registeredCount = 0;
+		long long loadedCount = 0;
+		long long memoryBytes = 0;	// model file bytes of the loaded models
+	};
+
+	// a new directory for a registered name takes effect at the next load or Reload().
+	void Register(const std::wstring& name, const std::wstring& modelDir);
+	bool Unregister(const std::wstring& name);
+	// 0 = no limit. models in use are never unloaded, so the budget may be exceeded while they run.
+	void SetMemoryBudget(size_t maxBytes);
+
+	// loads on first use, concurrent callers wait for the same loading. throws for unknown names and failed loads,
+	// a failed load is retried by the next call.
+	LoadedModels Acquire(const std::wstring& name);
+	// starts loading in background and returns at once, warmupShapes are used when the loading starts here.
+	std::shared_future<LoadedModels> StartLoading(const std::wstring& name, const WarmupShapes& warmupShapes);
+	// loads modelDir (empty = the registered directory, files replaced in place) on the calling thread, then swaps it in.
+	// the current version keeps serving until then, and also when the new one fails to load (the exception is thrown).
+	void Reload(const std::wstring& name, const std::wstring& modelDir, const WarmupShapes& warmupShapes);
+	Statistics GetStatistics();
+
+	static LoadedModels Load(const std::wstring& modelDir, const WarmupShapes& warmupShapes);
+	// path, size and last write time of the model file, score cache keys change with it.
+	static uint64_t GetModelId(const std::wstring& modelPath);
+
+private:
+	struct Entry {
+		std::wstring modelDir;
+		std::shared_future<LoadedModels> models;	// invalid while unloaded
+		uint64_t loadId = 0;						// tells a finished load whether it is still the current one
+		bool isLoaded = false;
+		bool hasFailed = false;						// the next Acquire() loads again
+		size_t memoryBytes = 0;
+		uint64_t lastUsed = 0;
+	};
+
+	std::shared_future<LoadedModels> StartLoadingLocked(const std::wstring& name, Entry& entry, const WarmupShapes& warmupShapes);
+	void OnLoaded(const std::wstring& name, uint64_t loadId, bool isSucceeded);
+	void EvictOverBudgetLocked(const std::wstring& keepName);
+	static size_t GetModelBytes(const std::wstring& modelDir);
+
+	std::mutex m_mutex;
+	std::map<std::wstring, Entry> m_entries;
+	size_t m_maxBytes = 0;
+	uint64_t m_useClock = 0;
+	uint64_t m_nextLoadId = 0;
+	Statistics m_statistics;
+};
@@ -1,13 +1,43 @@
 
 #define NOMINMAX
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <mutex>
+#include "latencyModel.h"
 #include "MemAlignedTensor.h"
 #include "onnxConnector.h"
+#include "workerPool.h"
+#include <windows.ai.machinelearning.native.h>
 #include <winrt/Windows.AI.MachineLearning.h>
 #include <winrt/Windows.Foundation.Collections.h>
 #include <winrt/Windows.Storage.h>
 #include "miscUtils.h"
 
+namespace {
+    // predicted time of one sub-run of a cancellable request, a cancelled request ends within about this long.
+    constexpr double c_cancellableRunSeconds = 0.010;
+    // sentences per sub-run of a cancellable request until the latency model has observed a run.
+    constexpr int c_cancellableRunSize = 4;
+    // the readout of a sub-run is shared by the worker pool threads, each with at least this many logits vectors (about 10us each).
+    constexpr size_t c_readoutsPerThread = 32;
+
+    // adds the predicted microseconds of a request to the queue of its connector while it waits for or holds the session.
+    class QueuedRun {
+    public:
+        QueuedRun(std::atomic<long long>& queuedMicroseconds, long long microseconds) : m_queuedMicroseconds(queuedMicroseconds), m_microseconds(microseconds) {
+            m_queuedMicroseconds += m_microseconds;
+        }
+        QueuedRun(const QueuedRun&) = delete;
+        QueuedRun& operator = (const QueuedRun&) = delete;
+        ~QueuedRun() { m_queuedMicroseconds -= m_microseconds; }
+
+    private:
+        std::atomic<long long>& m_queuedMicroseconds;
+        long long m_microseconds;
+    };
+}
+
 namespace winrt {
     using namespace ::winrt::Windows::AI::MachineLearning;
     using namespace ::winrt::Windows::Foundation::Collections;
@@ -22,6 +52,7 @@ public:
 
     std::tuple<int64_t, float> GetPrediction(const std::vector<int64_t>& tokens) override try {
         const auto startTime = std::chrono::system_clock::now();
+        std::lock_guard<std::mutex> lock(m_mutex);
         EnsureInitialized();
 
         // create attention-mask, that is filled by '1' where token vector has token value.
@@ -61,6 +92,7 @@ public:
 
     std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) override try {
         const auto startTime = std::chrono::system_clock::now();
+        std::lock_guard<std::mutex> lock(m_mutex);
         EnsureInitialized();
 
         // getting max token size
@@ -146,27 +178,44 @@ public:
     }
     catch (...) { return std::vector<std::vector<float>>(); }
 
-    void CompareSentenceDiffs(const std::vector<std::vector<int>>& sentences, int eosId, float* resultProbs) override try {
+    void CompareSentenceDiffs(const std::vector<std::vector<int>>& sentences, int eosId, float* resultProbs,
+        const CancellationToken* cancellation) override {
+        std::vector<const int*> tokenIds;
+        std::vector<int> tokenCounts;
+        for (const auto& sentence : sentences) {
+            tokenIds.push_back(sentence.data());
+            tokenCounts.push_back(static_cast<int>(sentence.size()));
+        }
+        CompareTokenDiffs(tokenIds.data(), tokenCounts.data(), static_cast<int>(sentences.size()), eosId, resultProbs, cancellation);
+    }
+
+    void CompareTokenDiffs(const int* const* tokenIds, const int* tokenCounts, int sentenceCount, int eosId, float* resultProbs,
+        const CancellationToken* cancellation) override {
         const auto startTime = std::chrono::system_clock::now();
-        EnsureInitialized();
 
         // getting max token size
-        auto maxTokenSize = sentences[0].size();
-        for (const auto& sentence : sentences) {
-            maxTokenSize = std::max(maxTokenSize, sentence.size());
+        size_t maxTokenSize = tokenCounts[0];
+        for (int i = 0; i < sentenceCount; ++i) {
+            maxTokenSize = std::max(maxTokenSize, static_cast<size_t>(tokenCounts[i]));
         }
 
-        // allocate token and attention-mask matrix
-        std::vector<int64_t> tokenArray(maxTokenSize * sentences.size(), 0LL);
-        std::vector<int64_t> attentionMaskArray(maxTokenSize * sentences.size(), 0LL);
+        // requests take turns on the session, predictions for later requests include the wait for this one.
+        const QueuedRun queuedRun(m_queuedMicroseconds,
+            static_cast<long long>(m_latencyModel.Predict(static_cast<double>(sentenceCount) * maxTokenSize) * 1e6));
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ThrowIfCancelled(cancellation);
+        EnsureInitialized();
 
-        // setup token and attention-mask matrix
-        for (size_t i = 0; i < sentences.size(); ++i) {
-            const auto& sentence = sentences[i];
-            auto tokenTop = &tokenArray[i * maxTokenSize];
-            auto maskTop = &attentionMaskArray[i * maxTokenSize];
-            for (size_t j = 0; j < sentence.size(); ++j) {
-                tokenTop[j] = sentence[j];
+        // token and attention-mask matrix, buffers are kept between calls.
+        m_tokenArray.assign(maxTokenSize * sentenceCount, 0LL);
+        m_attentionMaskArray.assign(maxTokenSize * sentenceCount, 0LL);
+
+        // setup token and attention-mask matrix, ids are copied (widened) only here.
+        for (int i = 0; i < sentenceCount; ++i) {
+            auto tokenTop = &m_tokenArray[i * maxTokenSize];
+            auto maskTop = &m_attentionMaskArray[i * maxTokenSize];
+            for (int j = 0; j < tokenCounts[i]; ++j) {
+                tokenTop[j] = tokenIds[i][j];
                 maskTop[j] = 1LL;
             }
         }
@@ -174,13 +223,13 @@ public:
         // finding different token index
         size_t compareStartPoint = 0;
         for (size_t i = 0; i < maxTokenSize; ++i) {
-            if (i >= sentences[0].size()) {
+            if (i >= static_cast<size_t>(tokenCounts[0])) {
                 compareStartPoint = i;
                 break;
             }
-            const auto targetToken = sentences[0][i];
-            for (size_t j = 1; j < sentences.size(); ++j) {
-                if (i >= sentences[j].size() || targetToken != sentences[j][i]) {
+            const auto targetToken = tokenIds[0][i];
+            for (int j = 1; j < sentenceCount; ++j) {
+                if (i >= static_cast<size_t>(tokenCounts[j]) || targetToken != tokenIds[j][i]) {
                     compareStartPoint = i;
                     break;
                 }
@@ -190,61 +239,136 @@ public:
             }
         }
 
-        // binding input
-        m_binding.Clear();
-        const auto& inputIdsTensor = winrt::TensorInt64Bit::CreateFromArray({ sentences.size(), maxTokenSize }, tokenArray);
-        m_binding.Bind(L"input_ids", inputIdsTensor);
+        // rows are independent (right padding), so a batch can run in parts with the same sequence size.
+        const auto runSize = cancellation != nullptr ? GetCancellableRunSize(sentenceCount, maxTokenSize) : sentenceCount;
+        for (int runBegin = 0; runBegin < sentenceCount; runBegin += runSize) {
+            ThrowIfCancelled(cancellation);
+            const auto runEnd = std::min(runBegin + runSize, sentenceCount);
+
+            // binding input
+            const auto batchSize = static_cast<int64_t>(runEnd - runBegin);
+            const auto sequenceSize = static_cast<int64_t>(maxTokenSize);
+            const auto inputBegin = runBegin * maxTokenSize;
+            const auto inputEnd = runEnd * maxTokenSize;
+            m_binding.Clear();
+            const auto& inputIdsTensor = winrt::TensorInt64Bit::CreateFromArray({ batchSize, sequenceSize },
+                winrt::array_view<const int64_t>(m_tokenArray.data() + inputBegin, m_tokenArray.data() + inputEnd));
+            m_binding.Bind(L"input_ids", inputIdsTensor);
+
+            const auto& attentionTensor = winrt::TensorInt64Bit::CreateFromArray({ batchSize, sequenceSize },
+                winrt::array_view<const int64_t>(m_attentionMaskArray.data() + inputBegin, m_attentionMaskArray.data() + inputEnd));
+            m_binding.Bind(L"attention_mask", attentionTensor);
+
+            const auto evaluateStartTime = std::chrono::steady_clock::now();
+            const auto& results = m_session.Evaluate(m_binding, L"correlationId");
+            const auto evaluateEndTime = std::chrono::steady_clock::now();
+            // the first run pays for the session setup, it would mislead the latency model.
+            if (m_runCount++ > 0) {
+                m_latencyModel.Observe(static_cast<double>(batchSize * sequenceSize), std::chrono::duration<double>(evaluateEndTime - evaluateStartTime).count());
+            }
 
-        const auto& attentionTensor = winrt::TensorInt64Bit::CreateFromArray({ sentences.size(), maxTokenSize }, attentionMaskArray);
-        m_binding.Bind(L"attention_mask", attentionTensor);
+            const auto& resultOutput = results.Outputs().Lookup(L"logits").as<winrt::TensorFloat>();
+            const auto& outputShape = resultOutput.Shape();
+            if (outputShape.Size() != 3) throw std::runtime_error("unexpected shape");
 
-        const auto& results = m_session.Evaluate(m_binding, L"correlationId");
-        const auto evaluateEndTime = std::chrono::system_clock::now();
+            const auto sequenceCount = outputShape.GetAt(1);
+            const auto tokenCount = outputShape.GetAt(2);
 
-        const auto& resultOutput = results.Outputs().Lookup(L"logits").as<winrt::TensorFloat>();
-        const auto& outputShape = resultOutput.Shape();
-        if (outputShape.Size() != 3) throw std::runtime_error("unexpected shape");
+            // logits are read in place from the CPU buffer of the output, not through a vector view per token.
+            BYTE* logitsBytes = nullptr;
+            UINT32 logitsCapacity = 0;
+            winrt::check_hresult(resultOutput.as<ITensorNative>()->GetBuffer(&logitsBytes, &logitsCapacity));
+            if (static_cast<uint64_t>(logitsCapacity) < static_cast<uint64_t>(batchSize * sequenceCount * tokenCount) * sizeof(float)) {
+                throw std::runtime_error("unexpected logits size");
+            }
 
-        const auto batchCount = outputShape.GetAt(0);
-        const auto sequenceCount = outputShape.GetAt(1);
-        const auto tokenCount = outputShape.GetAt(2);
+            ReadScores(reinterpret_cast<const float*>(logitsBytes), sequenceCount, tokenCount, tokenIds, tokenCounts, runBegin, runEnd,
+                compareStartPoint, eosId, resultProbs, cancellation);
+        }
+    }
 
-        std::vector<std::vector<float>> result;
+    void Warmup(int batchSize, int sequenceLength) override {
+        if (batchSize <= 0 || sequenceLength <= 0) throw std::invalid_argument("warmup shape");
+        const std::vector<std::vector<int>> sentences(batchSize, std::vector<int>(sequenceLength, 0));
+        std::vector<float> scores(batchSize, 0.0f);
+        CompareSentenceDiffs(sentences, 0, scores.data(), nullptr);
+    }
 
-        MemAlignedTensor tokenVector;
-        tokenVector.Reserve(1, tokenCount);
-        auto [bufferPtr, _rowSize, _columnSize] = tokenVector.GetBuffer();
-        auto tokenVectorView = winrt::array_view<float>(bufferPtr, bufferPtr + tokenCount);
+    // most sentences whose predicted run time stays within c_cancellableRunSeconds, at least one.
+    // every sub-run pays the fixed cost of a run (the latency model's intercept) again.
+    int GetCancellableRunSize(int sentenceCount, size_t sequenceSize) {
+        if (m_latencyModel.GetObservationCount() == 0) return std::min(c_cancellableRunSize, sentenceCount);
+        int low = 1;
+        int high = sentenceCount;
+        while (low < high) {
+            const auto middle = (low + high + 1) / 2;
+            if (m_latencyModel.Predict(static_cast<double>(middle) * sequenceSize) <= c_cancellableRunSeconds) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+        return low;
+    }
 
-        for (size_t i = 0; i < sentences.size(); ++i) {
-            float sentenceScore = 0.0f;
-            std::vector<float> probList;
-            for (size_t tokenIndex = compareStartPoint; tokenIndex < sentences[i].size(); ++tokenIndex) {
-                if (tokenIndex > 0) { // TODO: consider if top token should not be 1.0?
-                    const auto targetVectorOffset = i * sequenceCount * tokenCount + (tokenIndex - 1) * tokenCount;
-                    resultOutput.GetAsVectorView().GetMany(targetVectorOffset, tokenVectorView);
-                    const auto probability = tokenVector.GetProbability(sentences[i][tokenIndex]);
-                    sentenceScore += logf(probability);
+    double PredictRunSeconds(int batchSize, int sequenceLength) override {
+        // the run itself is fitted without the wait, which does not grow with its tokens. the wait is the predicted
+        // time of the requests already waiting for or holding m_mutex (a running one counts in full).
+        return m_latencyModel.Predict(static_cast<double>(batchSize) * sequenceLength) + m_queuedMicroseconds.load() * 1e-6;
+    }
+
+private:
+    // log probability of each sentence of a sub-run, from its logits [row, sequence, token].
+    // rows are taken one by one by the calling thread and the shared WorkerPool, each worker with its own aligned buffer.
+    void ReadScores(const float* logits, int64_t sequenceCount, int64_t tokenCount, const int* const* tokenIds, const int* tokenCounts,
+        int runBegin, int runEnd, size_t compareStartPoint, int eosId, float* resultProbs, const CancellationToken* cancellation) {
+        size_t readoutCount = 0;
+        for (int i = runBegin; i < runEnd; ++i) {
+            readoutCount += static_cast<size_t>(tokenCounts[i]) - std::min(compareStartPoint, static_cast<size_t>(tokenCounts[i])) + 1;
+        }
+
+        std::atomic<int> nextRow = runBegin;
+        const auto readRows = [&]() {
+            MemAlignedTensor tokenVector;
+            const auto bufferPtr = tokenVector.Reserve(1, tokenCount);
+            const auto getProbability = [&](int64_t targetVectorOffset, int tokenId) {
+                if (tokenId < 0 || tokenId >= tokenCount) throw std::out_of_range("token id out of the vocabulary");
+                memcpy(bufferPtr, logits + targetVectorOffset, tokenCount * sizeof(float));
+                return tokenVector.GetProbability(tokenId);
+            };
+
+            for (auto i = nextRow++; i < runEnd; i = nextRow++) {
+                ThrowIfCancelled(cancellation);
+                const auto row = static_cast<int64_t>(i - runBegin);
+                float sentenceScore = 0.0f;
+                for (size_t tokenIndex = compareStartPoint; tokenIndex < static_cast<size_t>(tokenCounts[i]); ++tokenIndex) {
+                    if (tokenIndex > 0) { // TODO: consider if top token should not be 1.0?
+                        const auto targetVectorOffset = row * sequenceCount * tokenCount + static_cast<int64_t>(tokenIndex - 1) * tokenCount;
+                        sentenceScore += logf(getProbability(targetVectorOffset, tokenIds[i][tokenIndex]));
+                    }
                 }
+                const auto targetVectorOffset = row * sequenceCount * tokenCount + static_cast<int64_t>(tokenCounts[i] - 1) * tokenCount;
+                sentenceScore += logf(getProbability(targetVectorOffset, eosId));
+
+                resultProbs[i] = sentenceScore;
             }
-            const auto targetVectorOffset = i * sequenceCount * tokenCount + (sentences[i].size() - 1) * tokenCount;
-            resultOutput.GetAsVectorView().GetMany(targetVectorOffset, tokenVectorView);
-            const auto probability = tokenVector.GetProbability(eosId);
-            sentenceScore += logf(probability);
+        };
 
-            resultProbs[i] = sentenceScore;
-        }
+        auto& pool = WorkerPool::GetShared();
+        const auto workerCount = std::min({ pool.GetThreadCount(), readoutCount / c_readoutsPerThread + 1, static_cast<size_t>(runEnd - runBegin) });
+        pool.Run(workerCount, [&](size_t) { readRows(); });
     }
-    catch (...) { }
 
-private:
     void EnsureInitialized() {
         if (!m_model) {
             const auto& utf8FileName = ToUtf8(m_modelFileName);
 
             m_model = winrt::LearningModel::LoadFromFilePath(m_modelFileName);
             const auto deviceKind = winrt::LearningModelDeviceKind::Cpu;
-            m_session = winrt::LearningModelSession{ m_model, winrt::LearningModelDevice(deviceKind) };
+            // intra-op threads leave the processors of the worker pool, which reads out and tokenizes around the runs.
+            winrt::LearningModelSessionOptions sessionOptions;
+            winrt::check_hresult(sessionOptions.as<ILearningModelSessionOptionsNative>()->SetIntraOpNumThreadsOverride(WorkerPool::GetModelThreadCount()));
+            m_session = winrt::LearningModelSession{ m_model, winrt::LearningModelDevice(deviceKind), sessionOptions };
             m_binding = winrt::LearningModelBinding{ m_session };
         }
     }
@@ -266,6 +390,12 @@ private:
     winrt::LearningModel m_model{ nullptr };
     winrt::LearningModelSession m_session{ nullptr };
     winrt::LearningModelBinding m_binding{ nullptr };
+    std::mutex m_mutex; // the binding and input buffers are per connector, concurrent requests take turns
+    LatencyModel m_latencyModel;
+    std::atomic<long long> m_queuedMicroseconds = 0;
+    long long m_runCount = 0;
+    std::vector<int64_t> m_tokenArray;
+    std::vector<int64_t> m_attentionMaskArray;
 };
 
 std::shared_ptr<OnnxConnector> OnnxConnector::CreateInstance() {
@@ -2,12 +2,25 @@
 #include <memory>
 #include <string_view>
 #include <vector>
+#include "cancellation.h"
 
 struct OnnxConnector {
     virtual void Initialize(const std::wstring_view modelFile) = 0;
     virtual std::tuple<int64_t, float> GetPrediction(const std::vector<int64_t>& tokens) = 0;
     virtual std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) = 0;
-    virtual void CompareSentenceDiffs(const std::vector<std::vector<int>>& sentences, int eosId, float* results) = 0;
+    // errors of the model run are thrown, results are incomplete then and must not be used.
+    // with cancellation, the batch runs in sub-runs of a few sentences, and OperationCancelled is thrown at the first
+    // check after the token is set (WinML has no way to stop a run in progress).
+    virtual void CompareSentenceDiffs(const std::vector<std::vector<int>>& sentences, int eosId, float* results,
+        const CancellationToken* cancellation = nullptr) = 0;
+    // sentence i is tokenIds[i][0 .. tokenCounts[i]), ids are copied only once into the int64 model input.
+    virtual void CompareTokenDiffs(const int* const* tokenIds, const int* tokenCounts, int sentenceCount, int eosId, float* results,
+        const CancellationToken* cancellation = nullptr) = 0;
+    // runs a dummy batch of the given shape, so the first real request does not pay for the first-run setup.
+    virtual void Warmup(int batchSize, int sequenceLength) = 0;
+    // seconds one run of the shape is expected to take, learned online from past runs (see LatencyModel),
+    // plus the wait for requests already queued on this connector. 0 before the first run.
+    virtual double PredictRunSeconds(int batchSize, int sequenceLength) = 0;
 
     virtual ~OnnxConnector() {};
     static std::shared_ptr<OnnxConnector> CreateInstance();
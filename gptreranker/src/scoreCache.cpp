@@ -0,0 +1,252 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <cstring>
+#include <stdexcept>
+#include "cancellation.h"
+#include "scoreCache.h"
+
+namespace {
+	// persistent file is a direct-mapped table, a slot is overwritten by the next request with the same slot.
+	constexpr uint64_t c_fileMagic = 0x31454843534b5247ULL; // "GRKSCHE1"
+	constexpr uint32_t c_persistentSlotCount = 65536;
+	constexpr uint32_t c_maxPersistedScores = 32;	// larger requests stay in memory only
+
+	struct FileHeader {
+		uint64_t magic;
+		uint32_t slotCount;
+		uint32_t maxScores;
+	};
+
+	struct FileSlot {
+		uint64_t key;
+		uint32_t scoreCount;
+		uint32_t check;	// detects slots torn by a concurrent writer (other process)
+		float scores[c_maxPersistedScores];
+	};
+
+	uint32_t GetSlotCheck(uint64_t key, uint32_t scoreCount, const float* scores) {
+		const auto hash = ScoreCache::HashBytes(key ^ scoreCount, scores, scoreCount * sizeof(float));
+		return static_cast<uint32_t>(hash ^ (hash >> 32));
+	}
+}
+
+uint64_t ScoreCache::HashBytes(uint64_t hash, const void* data, size_t size) {
+	const auto bytes = reinterpret_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+void ScoreCache::SetCapacity(size_t maxBytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxBytes = maxBytes;
+	while (!m_entries.empty() && static_cast<size_t>(m_statistics.memoryBytes) > m_maxBytes) {
+		m_statistics.memoryBytes -= GetEntryBytes(m_entries.back());
+		m_index.erase(m_entries.back().key);
+		m_entries.pop_back();
+		++m_statistics.evictedCount;
+	}
+	m_statistics.entryCount = static_cast<long long>(m_entries.size());
+}
+
+bool ScoreCache::OpenPersistentFile(const std::wstring& fileName) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	ClosePersistentFile();
+	if (fileName.empty()) return true;
+
+	const auto fileSize = sizeof(FileHeader) + sizeof(FileSlot) * static_cast<size_t>(c_persistentSlotCount);
+	const auto file = CreateFileW(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	m_file = file;
+
+	LARGE_INTEGER currentSize = {};
+	GetFileSizeEx(file, &currentSize);
+	const auto isNewFile = static_cast<size_t>(currentSize.QuadPart) != fileSize;
+
+	LARGE_INTEGER mappingSize = {};
+	mappingSize.QuadPart = static_cast<LONGLONG>(fileSize);
+	m_mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, mappingSize.HighPart, mappingSize.LowPart, nullptr);
+	if (m_mapping == nullptr) {
+		ClosePersistentFile();
+		return false;
+	}
+	m_view = reinterpret_cast<uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, fileSize));
+	if (m_view == nullptr) {
+		ClosePersistentFile();
+		return false;
+	}
+
+	// file of other size or format is cleared.
+	auto header = reinterpret_cast<FileHeader*>(m_view);
+	if (isNewFile || header->magic != c_fileMagic || header->slotCount != c_persistentSlotCount || header->maxScores != c_maxPersistedScores) {
+		memset(m_view, 0, fileSize);
+		header->magic = c_fileMagic;
+		header->slotCount = c_persistentSlotCount;
+		header->maxScores = c_maxPersistedScores;
+	}
+	m_slotCount = c_persistentSlotCount;
+	return true;
+}
+
+void ScoreCache::ClosePersistentFile() {
+	if (m_view != nullptr) UnmapViewOfFile(m_view);
+	if (m_mapping != nullptr) CloseHandle(m_mapping);
+	if (m_file != nullptr) CloseHandle(m_file);
+	m_view = nullptr;
+	m_mapping = nullptr;
+	m_file = nullptr;
+	m_slotCount = 0;
+}
+
+std::vector<float> ScoreCache::GetOrCompute(uint64_t key, size_t scoreCount, const std::function<std::vector<float>()>& compute) {
+	std::promise<std::vector<float>> promise;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_maxBytes == 0) {
+			lock.unlock();
+			return compute();
+		}
+
+		++m_statistics.lookupCount;
+		const auto it = m_index.find(key);
+		if (it != m_index.end() && it->second->scores.size() == scoreCount) {
+			++m_statistics.hitCount;
+			m_entries.splice(m_entries.begin(), m_entries, it->second);
+			return it->second->scores;
+		}
+
+		std::vector<float> scores;
+		if (LoadPersistent(key, scoreCount, scores)) {
+			++m_statistics.persistentHitCount;
+			Insert(key, scores);
+			return scores;
+		}
+
+		auto inFlight = m_inFlight.find(key);
+		while (inFlight != m_inFlight.end()) {
+			++m_statistics.coalescedCount;
+			auto future = inFlight->second;
+			lock.unlock();
+			bool isOtherRequest = false;
+			try {
+				const auto& inFlightScores = future.get();
+				if (inFlightScores.size() == scoreCount) return inFlightScores;
+				isOtherRequest = true;
+			}
+			catch (const OperationCancelled&) {
+				// the first request was superseded, not this one. it is computed again, once more single-flight.
+			}
+			// other request with the same key (hash collision), scored on its own without the cache.
+			if (isOtherRequest) return compute();
+			lock.lock();
+			if (const auto it = m_index.find(key); it != m_index.end() && it->second->scores.size() == scoreCount) {
+				++m_statistics.hitCount;
+				return it->second->scores;
+			}
+			inFlight = m_inFlight.find(key);
+		}
+
+		++m_statistics.missCount;
+		m_inFlight.emplace(key, promise.get_future().share());
+	}
+
+	try {
+		auto scores = compute();
+		if (scores.size() != scoreCount) throw std::runtime_error("unexpected score count");
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Insert(key, scores);
+		StorePersistent(key, scores);
+		m_inFlight.erase(key);
+		promise.set_value(scores);
+		return scores;
+	}
+	catch (...) {
+		// waiters get the same error, the next request computes again.
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_inFlight.erase(key);
+		}
+		promise.set_exception(std::current_exception());
+		throw;
+	}
+}
+
+bool ScoreCache::TryGet(uint64_t key, size_t scoreCount, std::vector<float>& scores) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_maxBytes == 0) return false;
+
+	const auto it = m_index.find(key);
+	if (it != m_index.end() && it->second->scores.size() == scoreCount) {
+		++m_statistics.lookupCount;
+		++m_statistics.hitCount;
+		m_entries.splice(m_entries.begin(), m_entries, it->second);
+		scores = it->second->scores;
+		return true;
+	}
+	if (LoadPersistent(key, scoreCount, scores)) {
+		++m_statistics.lookupCount;
+		++m_statistics.persistentHitCount;
+		Insert(key, scores);
+		return true;
+	}
+	return false;
+}
+
+ScoreCache::Statistics ScoreCache::GetStatistics() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_statistics;
+}
+
+size_t ScoreCache::GetEntryBytes(const Entry& entry) {
+	// list node, hash map node and the score array, roughly.
+	return sizeof(Entry) + 4 * sizeof(void*) + sizeof(uint64_t) + sizeof(void*) * 2 + entry.scores.capacity() * sizeof(float);
+}
+
+void ScoreCache::Insert(uint64_t key, const std::vector<float>& scores) {
+	if (const auto it = m_index.find(key); it != m_index.end()) {
+		if (it->second->scores.size() == scores.size()) return;
+		// hash collision with a request of other size, the newer one takes the key.
+		m_statistics.memoryBytes -= GetEntryBytes(*it->second);
+		m_entries.erase(it->second);
+		m_index.erase(it);
+	}
+
+	m_entries.push_front(Entry{ key, scores });
+	m_index.emplace(key, m_entries.begin());
+	m_statistics.memoryBytes += GetEntryBytes(m_entries.front());
+
+	while (m_entries.size() > 1 && static_cast<size_t>(m_statistics.memoryBytes) > m_maxBytes) {
+		m_statistics.memoryBytes -= GetEntryBytes(m_entries.back());
+		m_index.erase(m_entries.back().key);
+		m_entries.pop_back();
+		++m_statistics.evictedCount;
+	}
+	m_statistics.entryCount = static_cast<long long>(m_entries.size());
+}
+
+bool ScoreCache::LoadPersistent(uint64_t key, size_t scoreCount, std::vector<float>& scores) const {
+	if (m_view == nullptr) return false;
+
+	// the file may have been written by another version or process, so the slot is trusted only when it fits the request.
+	FileSlot slot;
+	memcpy(&slot, m_view + sizeof(FileHeader) + sizeof(FileSlot) * (key % m_slotCount), sizeof(slot));
+	if (slot.key != key || slot.scoreCount == 0 || slot.scoreCount != scoreCount || slot.scoreCount > c_maxPersistedScores) return false;
+	if (slot.check != GetSlotCheck(slot.key, slot.scoreCount, slot.scores)) return false;
+
+	scores.assign(slot.scores, slot.scores + slot.scoreCount);
+	return true;
+}
+
+void ScoreCache::StorePersistent(uint64_t key, const std::vector<float>& scores) {
+	if (m_view == nullptr || scores.empty() || scores.size() > c_maxPersistedScores) return;
+
+	FileSlot slot = {};
+	slot.key = key;
+	slot.scoreCount = static_cast<uint32_t>(scores.size());
+	memcpy(slot.scores, scores.data(), scores.size() * sizeof(float));
+	slot.check = GetSlotCheck(slot.key, slot.scoreCount, slot.scores);
+	memcpy(m_view + sizeof(FileHeader) + sizeof(FileSlot) * (key % m_slotCount), &slot, sizeof(slot));
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// bounded LRU cache of request scores, keyed by a hash of (model identity, scoring mode, token ids).
+// scores of EvaluateSentences are relative to the common prefix of the whole request, so one entry is one request.
+// concurrent requests with the same key wait for the first one (single-flight).
+// optionally backed by a memory mapped file, so scores survive restarts.
+class ScoreCache
+{
+public:
+	struct Statistics {
+		long long lookupCount = 0;
+		long long hitCount = 0;
+		long long persistentHitCount = 0;
+		long long coalescedCount = 0;	// waited for the same request in flight
+		long long missCount = 0;
+		long long evictedCount = 0;
+		long long entryCount = 0;
+		long long memoryBytes = 0;
+	};
+
+	ScoreCache() = default;
+	ScoreCache(const ScoreCache&) = delete;
+	ScoreCache& operator = (const ScoreCache&) = delete;
+	~ScoreCache() { ClosePersistentFile(); }
+
+	// maxBytes = 0 disables the cache, compute() is called every time.
+	void SetCapacity(size_t maxBytes);
+	// empty fileName closes the file. returns false when the file can not be mapped.
+	bool OpenPersistentFile(const std::wstring& fileName);
+
+	// scoreCount is the size of the request, a cached entry of other size (hash collision) is a miss.
+	// nothing is cached when compute() throws, or returns other than scoreCount scores (then std::runtime_error).
+	std::vector<float> GetOrCompute(uint64_t key, size_t scoreCount, const std::function<std::vector<float>()>& compute);
+	// scores in memory or in the persistent file, without computing. only hits are counted as lookups.
+	bool TryGet(uint64_t key, size_t scoreCount, std::vector<float>& scores);
+	Statistics GetStatistics();
+
+	// FNV-1a
+	static uint64_t HashBytes(uint64_t hash, const void* data, size_t size);
+	static constexpr uint64_t c_hashSeed = 0xcbf29ce484222325ULL;
+
+private:
+	struct Entry {
+		uint64_t key;
+		std::vector<float> scores;
+	};
+
+	static size_t GetEntryBytes(const Entry& entry);
+	void Insert(uint64_t key, const std::vector<float>& scores);
+	bool LoadPersistent(uint64_t key, size_t scoreCount, std::vector<float>& scores) const;
+	void StorePersistent(uint64_t key, const std::vector<float>& scores);
+	void ClosePersistentFile();
+
+	std::mutex m_mutex;
+	size_t m_maxBytes = 16 * 1024 * 1024;
+	std::list<Entry> m_entries;		// most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> m_index;
+	std::unordered_map<uint64_t, std::shared_future<std::vector<float>>> m_inFlight;
+	Statistics m_statistics;
+
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+	uint8_t* m_view = nullptr;
+	size_t m_slotCount = 0;
+};
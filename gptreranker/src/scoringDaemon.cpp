@@ -0,0 +1,379 @@
+#define NOMINMAX
+#include <WinSock2.h>
+#include <afunix.h>
+#include <Windows.h>
+#include <sddl.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include "scoringDaemon.h"
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "advapi32.lib")
+
+using namespace ScoringProtocol;
+
+namespace {
+	std::atomic<uint32_t> g_nextSectionNumber = 0;
+
+	bool StartWinsock() {
+		static const bool isStarted = []() {
+			WSADATA data = {};
+			return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		}();
+		return isStarted;
+	}
+
+	// accept errors which go away by themselves: resource shortage, connections reset before they were taken.
+	bool IsTransientAcceptError(int error) {
+		switch (error) {
+		case WSAECONNRESET:
+		case WSAEINTR:
+		case WSAEMFILE:
+		case WSAENOBUFS:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool MakeAddress(const std::wstring& socketPath, sockaddr_un& address) {
+		address = {};
+		address.sun_family = AF_UNIX;
+		const auto length = WideCharToMultiByte(CP_UTF8, 0, socketPath.c_str(), static_cast<int>(socketPath.size()),
+			address.sun_path, sizeof(address.sun_path) - 1, nullptr, nullptr);
+		return length > 0;
+	}
+
+	bool SendAll(SOCKET socket, const void* data, size_t byteCount) {
+		auto bytes = reinterpret_cast<const char*>(data);
+		while (byteCount > 0) {
+			const auto sent = send(socket, bytes, static_cast<int>(std::min<size_t>(byteCount, INT_MAX)), 0);
+			if (sent <= 0) return false;
+			bytes += sent;
+			byteCount -= sent;
+		}
+		return true;
+	}
+
+	bool ReceiveAll(SOCKET socket, void* data, size_t byteCount) {
+		auto bytes = reinterpret_cast<char*>(data);
+		while (byteCount > 0) {
+			const auto received = recv(socket, bytes, static_cast<int>(std::min<size_t>(byteCount, INT_MAX)), 0);
+			if (received <= 0) return false;
+			bytes += received;
+			byteCount -= received;
+		}
+		return true;
+	}
+
+	// DACL of the shared sections, which grants access to the user of this process only. the daemon must run as the same user.
+	const std::wstring& GetSectionSecurityDescriptor() {
+		static const std::wstring sddl = []() {
+			std::wstring result;
+			HANDLE token = nullptr;
+			if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) return result;
+			DWORD size = 0;
+			GetTokenInformation(token, TokenUser, nullptr, 0, &size);
+			std::vector<uint8_t> tokenUser(size);
+			wchar_t* sidText = nullptr;
+			if (size != 0 && GetTokenInformation(token, TokenUser, tokenUser.data(), size, &size) &&
+				ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER*>(tokenUser.data())->User.Sid, &sidText)) {
+				result = L"D:P(A;;GA;;;" + std::wstring(sidText) + L")";
+				LocalFree(sidText);
+			}
+			CloseHandle(token);
+			return result;
+		}();
+		return sddl;
+	}
+
+	// header and inline payload in one send, the daemon wakes up once per message.
+	bool WriteMessage(SOCKET socket, MessageHeader header, const void* payload, uint32_t payloadBytes) {
+		header.payloadBytes = payloadBytes;
+		if (payloadBytes == 0) return SendAll(socket, &header, sizeof(header));
+		std::vector<uint8_t> message(sizeof(header) + payloadBytes);
+		memcpy(message.data(), &header, sizeof(header));
+		memcpy(message.data() + sizeof(header), payload, payloadBytes);
+		return SendAll(socket, message.data(), message.size());
+	}
+
+	// views of the sentences in a c_evaluate payload, false when the lengths do not fit in it.
+	bool ParseSentences(const uint8_t* payload, size_t payloadBytes, uint32_t sentenceCount, std::vector<std::string_view>& sentences) {
+		const auto lengthBytes = static_cast<size_t>(sentenceCount) * sizeof(uint32_t);
+		if (lengthBytes > payloadBytes) return false;
+		auto text = reinterpret_cast<const char*>(payload + lengthBytes);
+		auto remainingBytes = payloadBytes - lengthBytes;
+		sentences.clear();
+		for (uint32_t i = 0; i < sentenceCount; ++i) {
+			uint32_t length = 0;
+			memcpy(&length, payload + i * sizeof(uint32_t), sizeof(length));
+			if (length > remainingBytes) return false;
+			sentences.emplace_back(text, length);
+			text += length;
+			remainingBytes -= length;
+		}
+		return true;
+	}
+
+	struct SharedSection {
+		HANDLE mapping = nullptr;
+		uint8_t* view = nullptr;
+		size_t byteCount = 0;
+
+		SharedSection() = default;
+		SharedSection(const SharedSection&) = delete;
+		SharedSection& operator = (const SharedSection&) = delete;
+		~SharedSection() { Close(); }
+
+		void Close() {
+			if (view != nullptr) UnmapViewOfFile(view);
+			if (mapping != nullptr) CloseHandle(mapping);
+			view = nullptr;
+			mapping = nullptr;
+			byteCount = 0;
+		}
+	};
+}
+
+std::wstring ScoringProtocol::GetDefaultSocketPath() {
+	wchar_t tempPath[MAX_PATH] = {};
+	const auto length = GetTempPath(ARRAYSIZE(tempPath), tempPath);
+	return std::wstring(tempPath, length) + L"gptreranker.sock";
+}
+
+bool ScoringServer::Run(const std::wstring& socketPath, const Evaluate& evaluate) {
+	sockaddr_un address;
+	if (!StartWinsock() || !MakeAddress(socketPath, address)) return false;
+
+	const auto listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenSocket == INVALID_SOCKET) return false;
+	// the socket file of a previous daemon stays until it is deleted, bind fails on it.
+	DeleteFile(socketPath.c_str());
+	if (bind(listenSocket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+		listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+		closesocket(listenSocket);
+		return false;
+	}
+
+	// transient errors are retried after a pause which doubles up to 1s, others stop the daemon.
+	DWORD retryMilliseconds = 0;
+	for (;;) {
+		const auto clientSocket = accept(listenSocket, nullptr, nullptr);
+		if (clientSocket == INVALID_SOCKET) {
+			const auto error = WSAGetLastError();
+			OutputDebugString((L"gptreranker: accept failed with " + std::to_wstring(error) + L"\n").c_str());
+			if (!IsTransientAcceptError(error)) {
+				closesocket(listenSocket);
+				return false;
+			}
+			retryMilliseconds = std::clamp<DWORD>(retryMilliseconds * 2, 10, 1000);
+			Sleep(retryMilliseconds);
+			continue;
+		}
+		retryMilliseconds = 0;
+		std::thread(ServeConnection, static_cast<uintptr_t>(clientSocket), std::cref(evaluate)).detach();
+	}
+}
+
+void ScoringServer::ServeConnection(uintptr_t clientSocket, const Evaluate& evaluate) {
+	const auto socket = static_cast<SOCKET>(clientSocket);
+	SharedSection section;
+	std::vector<uint8_t> payload;
+	std::vector<std::string_view> sentences;
+	std::vector<float> scores;
+
+	MessageHeader request = {};
+	while (ReceiveAll(socket, &request, sizeof(request))) {
+		if (request.payloadBytes > c_inlinePayloadBytes) break;
+		payload.resize(request.payloadBytes);
+		if (!ReceiveAll(socket, payload.data(), payload.size())) break;
+
+		MessageHeader response = {};
+		if (request.type == c_ping) {
+			response.type = c_pong;
+			if (!WriteMessage(socket, response, nullptr, 0)) break;
+			continue;
+		}
+
+		if (request.type == c_attach) {
+			// the client grew its section, the previous one is released by both sides.
+			section.Close();
+			uint64_t byteCount = 0;
+			if (payload.size() < sizeof(byteCount)) break;
+			memcpy(&byteCount, payload.data(), sizeof(byteCount));
+			const std::wstring name(reinterpret_cast<const wchar_t*>(payload.data() + sizeof(byteCount)), (payload.size() - sizeof(byteCount)) / sizeof(wchar_t));
+			section.mapping = OpenFileMapping(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name.c_str());
+			if (section.mapping == nullptr) break;
+			section.view = reinterpret_cast<uint8_t*>(MapViewOfFile(section.mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, static_cast<size_t>(byteCount)));
+			if (section.view == nullptr) break;
+			section.byteCount = static_cast<size_t>(byteCount);
+			continue;
+		}
+
+		if (request.type != c_evaluate) break;
+
+		// shared payloads are scored in place, the client waits for the response before it writes the section again.
+		const auto isShared = request.sharedBytes != 0;
+		if (isShared && request.sharedBytes > section.byteCount) break;
+		const auto data = isShared ? section.view : payload.data();
+		const auto dataBytes = isShared ? static_cast<size_t>(request.sharedBytes) : payload.size();
+		if (!ParseSentences(data, dataBytes, request.count, sentences)) break;
+
+		scores.assign(request.count, 0.0f);
+		try {
+			evaluate(sentences.data(), static_cast<int>(sentences.size()), scores.data());
+			response.type = c_scores;
+			response.count = request.count;
+		}
+		catch (...) {
+			response.type = c_failed;
+		}
+
+		const auto scoreBytes = static_cast<uint32_t>(response.count * sizeof(float));
+		if (scoreBytes > c_inlinePayloadBytes && scoreBytes <= section.byteCount) {
+			memcpy(section.view, scores.data(), scoreBytes);
+			response.sharedBytes = scoreBytes;
+			if (!WriteMessage(socket, response, nullptr, 0)) break;
+		} else {
+			if (!WriteMessage(socket, response, scores.data(), scoreBytes)) break;
+		}
+	}
+	closesocket(socket);
+}
+
+struct ScoringClient::Connection {
+	SOCKET socket = INVALID_SOCKET;
+	SharedSection section;
+	std::vector<uint8_t> payload;
+
+	~Connection() {
+		if (socket != INVALID_SOCKET) closesocket(socket);
+	}
+};
+
+ScoringClient::ScoringClient(const std::wstring& socketPath) : m_socketPath(socketPath) {}
+
+ScoringClient::~ScoringClient() = default;
+
+bool ScoringClient::Evaluate(const std::string_view* sentences, int sentenceCount, float* scores) {
+	auto connection = TakeConnection();
+	if (!connection) return false;
+
+	size_t payloadBytes = sentenceCount * sizeof(uint32_t);
+	for (int i = 0; i < sentenceCount; ++i) payloadBytes += sentences[i].size();
+	if (payloadBytes > UINT32_MAX) return false;
+
+	const auto isShared = payloadBytes > c_inlinePayloadBytes;
+	if (isShared && !EnsureSection(*connection, payloadBytes)) return false;
+
+	// large requests are written straight into the section, small ones into the message buffer.
+	auto& buffer = connection->payload;
+	if (!isShared) buffer.resize(payloadBytes);
+	const auto data = isShared ? connection->section.view : buffer.data();
+	auto text = data + sentenceCount * sizeof(uint32_t);
+	for (int i = 0; i < sentenceCount; ++i) {
+		const auto length = static_cast<uint32_t>(sentences[i].size());
+		memcpy(data + i * sizeof(uint32_t), &length, sizeof(length));
+		memcpy(text, sentences[i].data(), length);
+		text += length;
+	}
+
+	MessageHeader request = {};
+	request.type = c_evaluate;
+	request.count = static_cast<uint32_t>(sentenceCount);
+	request.sharedBytes = isShared ? static_cast<uint32_t>(payloadBytes) : 0;
+	if (!WriteMessage(connection->socket, request, isShared ? nullptr : buffer.data(), isShared ? 0 : static_cast<uint32_t>(payloadBytes))) return false;
+
+	MessageHeader response = {};
+	if (!ReceiveAll(connection->socket, &response, sizeof(response)) || response.payloadBytes > c_inlinePayloadBytes) return false;
+	buffer.resize(response.payloadBytes);
+	if (!ReceiveAll(connection->socket, buffer.data(), buffer.size())) return false;
+
+	const auto scoreBytes = static_cast<size_t>(sentenceCount) * sizeof(float);
+	const auto isSucceeded = response.type == c_scores && response.count == request.count;
+	if (isSucceeded) {
+		if (response.sharedBytes != 0) {
+			if (response.sharedBytes != scoreBytes || scoreBytes > connection->section.byteCount) return false;
+			memcpy(scores, connection->section.view, scoreBytes);
+		} else {
+			if (buffer.size() != scoreBytes) return false;
+			memcpy(scores, buffer.data(), scoreBytes);
+		}
+	}
+	// the connection is in sync again, a failed request does not drop it.
+	ReturnConnection(std::move(connection));
+	return isSucceeded;
+}
+
+bool ScoringClient::Ping() {
+	auto connection = TakeConnection();
+	if (!connection) return false;
+
+	MessageHeader request = {};
+	request.type = c_ping;
+	MessageHeader response = {};
+	if (!WriteMessage(connection->socket, request, nullptr, 0) ||
+		!ReceiveAll(connection->socket, &response, sizeof(response)) || response.type != c_pong || response.payloadBytes != 0) {
+		return false;
+	}
+	ReturnConnection(std::move(connection));
+	return true;
+}
+
+// connections are dropped (not returned) on any transport error, the next request connects again.
+std::unique_ptr<ScoringClient::Connection> ScoringClient::TakeConnection() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_idleConnections.empty()) {
+			auto connection = std::move(m_idleConnections.back());
+			m_idleConnections.pop_back();
+			return connection;
+		}
+	}
+
+	sockaddr_un address;
+	if (!StartWinsock() || !MakeAddress(m_socketPath, address)) return nullptr;
+	auto connection = std::make_unique<Connection>();
+	connection->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (connection->socket == INVALID_SOCKET) return nullptr;
+	if (connect(connection->socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR) return nullptr;
+	return connection;
+}
+
+void ScoringClient::ReturnConnection(std::unique_ptr<Connection> connection) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_idleConnections.push_back(std::move(connection));
+}
+
+// a new, larger section replaces the current one, sizes double so a growing workload attaches only a few times.
+bool ScoringClient::EnsureSection(Connection& connection, size_t byteCount) {
+	auto& section = connection.section;
+	if (byteCount <= section.byteCount) return true;
+
+	const auto newByteCount = std::max<size_t>(byteCount, section.byteCount * 2);
+	const auto name = L"Local\\gptreranker-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(++g_nextSectionNumber);
+	section.Close();
+	PSECURITY_DESCRIPTOR descriptor = nullptr;
+	const auto& sddl = GetSectionSecurityDescriptor();
+	if (sddl.empty() || !ConvertStringSecurityDescriptorToSecurityDescriptorW(sddl.c_str(), SDDL_REVISION_1, &descriptor, nullptr)) return false;
+	SECURITY_ATTRIBUTES securityAttributes = { sizeof(securityAttributes), descriptor, FALSE };
+	section.mapping = CreateFileMapping(INVALID_HANDLE_VALUE, &securityAttributes, PAGE_READWRITE,
+		static_cast<DWORD>(static_cast<uint64_t>(newByteCount) >> 32), static_cast<DWORD>(newByteCount), name.c_str());
+	const auto isExisting = GetLastError() == ERROR_ALREADY_EXISTS;
+	LocalFree(descriptor);
+	// a section made beforehand under the same name by another process is not used, it would not have our DACL.
+	if (section.mapping == nullptr || isExisting) return false;
+	section.view = reinterpret_cast<uint8_t*>(MapViewOfFile(section.mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, newByteCount));
+	if (section.view == nullptr) return false;
+	section.byteCount = newByteCount;
+
+	std::vector<uint8_t> payload(sizeof(uint64_t) + name.size() * sizeof(wchar_t));
+	const uint64_t sectionBytes = newByteCount;
+	memcpy(payload.data(), &sectionBytes, sizeof(sectionBytes));
+	memcpy(payload.data() + sizeof(sectionBytes), name.data(), name.size() * sizeof(wchar_t));
+	MessageHeader header = {};
+	header.type = c_attach;
+	return WriteMessage(connection.socket, header, payload.data(), static_cast<uint32_t>(payload.size()));
+}
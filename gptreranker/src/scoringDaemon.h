@@ -0,0 +1,74 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// local scoring daemon: one process loads the models and scores requests of other processes over an AF_UNIX socket.
+// small payloads follow the message header on the socket, large ones are put in a shared memory section of the
+// connection, so only the header crosses the socket. the section is created by the client and grows on demand.
+namespace ScoringProtocol
+{
+	enum MessageType : uint32_t {
+		c_attach = 1,	// payload: uint64 section bytes, section name (wchar_t, no terminator)
+		c_evaluate = 2,	// payload: uint32 byte length of each sentence, then the utf-8 sentences back to back
+		c_ping = 3,
+		c_scores = 101,	// payload: float score of each sentence
+		c_failed = 102,
+		c_pong = 103,
+	};
+
+	struct MessageHeader {
+		uint32_t type;
+		uint32_t count;			// sentences or scores
+		uint32_t payloadBytes;	// bytes following the header on the socket
+		uint32_t sharedBytes;	// bytes at the top of the shared section, used instead of an inline payload
+	};
+
+	// payloads up to this size are sent inline. no message on the socket is larger (scores are no larger than
+	// their request), a header announcing more drops the connection.
+	constexpr uint32_t c_inlinePayloadBytes = 16 * 1024;
+
+	// %TEMP%\gptreranker.sock
+	std::wstring GetDefaultSocketPath();
+}
+
+class ScoringServer
+{
+public:
+	using Evaluate = std::function<void(const std::string_view* sentences, int sentenceCount, float* scores)>;
+
+	// serves until the process ends, one thread per client connection. returns only when the socket can not be opened.
+	static bool Run(const std::wstring& socketPath, const Evaluate& evaluate);
+
+private:
+	static void ServeConnection(uintptr_t clientSocket, const Evaluate& evaluate);
+};
+
+// thread safe, each calling thread takes its own pooled connection with its own shared section.
+class ScoringClient
+{
+public:
+	explicit ScoringClient(const std::wstring& socketPath);
+	ScoringClient(const ScoringClient&) = delete;
+	ScoringClient& operator = (const ScoringClient&) = delete;
+	~ScoringClient();
+
+	// returns false when the daemon can not be reached or fails the request.
+	bool Evaluate(const std::string_view* sentences, int sentenceCount, float* scores);
+	bool Ping();
+
+private:
+	struct Connection;
+
+	std::unique_ptr<Connection> TakeConnection();
+	void ReturnConnection(std::unique_ptr<Connection> connection);
+	bool EnsureSection(Connection& connection, size_t byteCount);
+
+	std::wstring m_socketPath;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<Connection>> m_idleConnections;
+};
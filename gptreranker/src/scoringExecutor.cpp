@@ -0,0 +1,47 @@
+#include "scoringExecutor.h"
+
+ScoringExecutor::ScoringExecutor(int threadCount) {
+	for (int i = 0; i < threadCount; ++i) {
+		m_threads.emplace_back(&ScoringExecutor::WorkerLoop, this);
+	}
+}
+
+ScoringExecutor::~ScoringExecutor() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isStopping = true;
+	}
+	m_condition.notify_all();
+	for (auto& thread : m_threads) thread.join();
+}
+
+void ScoringExecutor::Post(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+	m_condition.notify_one();
+}
+
+size_t ScoringExecutor::GetPendingCount() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_tasks.size();
+}
+
+void ScoringExecutor::WorkerLoop() {
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_isStopping || !m_tasks.empty(); });
+			if (m_tasks.empty()) return;
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		// tasks report their own errors, an exception must not end the worker.
+		try {
+			task();
+		}
+		catch (...) {}
+	}
+}
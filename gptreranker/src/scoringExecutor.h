@@ -0,0 +1,32 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// runs scoring requests on its own threads, so the caller (often a UI thread) returns at once.
+// with two threads, the next request is tokenized while the current one is in Session::Evaluate (the connector
+// serializes the session itself). requests start in the order they were posted.
+class ScoringExecutor
+{
+public:
+	explicit ScoringExecutor(int threadCount);
+	ScoringExecutor(const ScoringExecutor&) = delete;
+	ScoringExecutor& operator = (const ScoringExecutor&) = delete;
+	// queued requests still run, then the threads are joined.
+	~ScoringExecutor();
+
+	void Post(std::function<void()> task);
+	size_t GetPendingCount();
+
+private:
+	void WorkerLoop();
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_isStopping = false;
+	std::vector<std::thread> m_threads;
+};
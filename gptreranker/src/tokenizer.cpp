@@ -1,17 +1,40 @@
+#define NOMINMAX
 #include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <list>
+#include <mutex>
+#include <unordered_map>
 #include "miscUtils.h"
 #include "tokenizer.h"
+#include "unigramEncoder.h"
+#include "workerPool.h"
 #include <sentencepiece_processor.h>
 
+namespace {
+	constexpr size_t c_cacheCapacity = 4096;		// entries
+	constexpr size_t c_maxEncodeThreads = 4;
+	constexpr size_t c_sentencesPerThread = 16;		// smaller batches are not worth a thread
+}
+
 struct TokenizerImpl : public Tokenizer
 {
 	void Load(std::wstring_view fileName) override {
 		const auto& utf8FileName = ToUtf8(fileName);
-		m_processor.reset(new sentencepiece::SentencePieceProcessor());
-		const auto& result = m_processor->Load(utf8FileName);
-		if (!result.ok()) {
-			throw std::exception("model loading failed.");
-		}
+		m_processor = LoadProcessor(utf8FileName);
+		// the trie and pass-through table are built only when the encoder is used, VerifyNativeEncoder() builds its own.
+		m_nativeEncoder = IsNativeEncoderEnabled() ? LoadNativeEncoder(fileName) : nullptr;
+		m_useNativeEncoder = m_nativeEncoder != nullptr;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_fileName = fileName;
+		m_utf8FileName = utf8FileName;
+		m_workerProcessors.clear();
+		m_cacheEntries.clear();
+		m_cacheIndex.clear();
 	}
 
 	std::vector<int> Encode(std::string_view source) override {
@@ -20,36 +43,57 @@ struct TokenizerImpl : public Tokenizer
 		}
 
 		std::vector<int> tokenVector;
-		const auto& result = m_processor->Encode(source, &tokenVector);
-		if (!result.ok()) throw std::exception("failed to encode");
+		if (LookupCache(source, tokenVector)) return tokenVector;
 
+		tokenVector = EncodeWith(*m_processor, source);
+		InsertCache(source, tokenVector);
 		return tokenVector;
 	}
 
-	std::vector<int> Encode(std::wstring_view source) override {
+	std::vector<std::vector<int>> EncodeBatch(const std::string_view* sources, size_t count) override {
 		if (!m_processor) {
 			throw std::exception("processor is not loaded");
 		}
 
-		const auto& utf8Text = ToUtf8(source);
+		std::vector<std::vector<int>> results(count);
+		std::vector<size_t> misses;
+		for (size_t i = 0; i < count; ++i) {
+			if (!LookupCache(sources[i], results[i])) misses.push_back(i);
+		}
 
-		std::vector<int> tokenVector;
-		const auto& result = m_processor->Encode(utf8Text, &tokenVector);
-		if (!result.ok()) throw std::exception("failed to encode");
+		// each worker takes the next sentence from a shared counter, with its own processor.
+		// the native encoder is shared, its scratch buffers are per thread.
+		const auto threadCount = std::min(misses.size() / c_sentencesPerThread + 1, GetMaxThreadCount());
+		const auto& processors = m_useNativeEncoder ? std::vector<ProcessorPtr>(threadCount, m_processor) : GetWorkerProcessors(threadCount);
+		std::atomic<size_t> nextMiss = 0;
+		const auto encodeMisses = [&](size_t worker) {
+			for (auto miss = nextMiss++; miss < misses.size(); miss = nextMiss++) {
+				const auto index = misses[miss];
+				results[index] = EncodeWith(*processors[worker], sources[index]);
+			}
+		};
+		WorkerPool::GetShared().Run(threadCount, encodeMisses);
 
-		return tokenVector;
+		for (const auto index : misses) {
+			InsertCache(sources[index], results[index]);
+		}
+		return results;
 	}
 
-	std::vector<int64_t> Encode64(std::wstring_view source) override {
+	std::vector<int> Encode(std::wstring_view source) override {
 		if (!m_processor) {
 			throw std::exception("processor is not loaded");
 		}
 
-		const auto& utf8Text = ToUtf8(source);
+		return EncodeWith(*m_processor, ToUtf8(source));
+	}
+
+	std::vector<int64_t> Encode64(std::wstring_view source) override {
+		if (!m_processor) {
+			throw std::exception("processor is not loaded");
+		}
 
-		std::vector<int> tokenVector;
-		const auto& result = m_processor->Encode(utf8Text, &tokenVector);
-		if (!result.ok()) throw std::exception("failed to encode");
+		const auto& tokenVector = EncodeWith(*m_processor, ToUtf8(source));
 
 		std::vector<int64_t> resultVector(tokenVector.size(), 0LL);
 		for (auto i = 0ULL; i < tokenVector.size(); ++i) {
@@ -74,11 +118,143 @@ struct TokenizerImpl : public Tokenizer
 		return ToUtf16(decodedText);
 	}
 
+	EncoderCheck VerifyNativeEncoder(std::wstring_view corpusFileName) override {
+		if (!m_processor) {
+			throw std::exception("processor is not loaded");
+		}
+		auto nativeEncoder = m_nativeEncoder;
+		if (!nativeEncoder) {
+			std::wstring fileName;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				fileName = m_fileName;
+			}
+			nativeEncoder = LoadNativeEncoder(fileName);
+			if (!nativeEncoder) throw std::exception("native encoder does not support the model");
+		}
+
+		std::ifstream corpusFile(std::wstring(corpusFileName), std::ios::binary);
+		if (!corpusFile) throw std::exception("failed to open corpus");
+		std::vector<std::string> lines;
+		for (std::string line; std::getline(corpusFile, line);) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			lines.push_back(std::move(line));
+		}
+
+		EncoderCheck check;
+		check.lineCount = static_cast<long long>(lines.size());
+		std::vector<std::vector<int>> nativeResults(lines.size());
+		auto startTime = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lines.size(); ++i) {
+			nativeEncoder->Encode(lines[i], nativeResults[i]);
+		}
+		check.nativeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+		std::vector<std::vector<int>> libraryResults(lines.size());
+		startTime = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < lines.size(); ++i) {
+			if (!m_processor->Encode(lines[i], &libraryResults[i]).ok()) throw std::exception("failed to encode");
+		}
+		check.librarySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+		for (size_t i = 0; i < lines.size(); ++i) {
+			if (nativeResults[i] != libraryResults[i]) ++check.mismatchCount;
+		}
+		return check;
+	}
+
 	int bos_id() override { return m_processor->bos_id(); }
 	int eos_id() override { return m_processor->eos_id(); }
+	int GetPieceSize() override { return m_processor->GetPieceSize(); }
 
 private:
-	std::unique_ptr<sentencepiece::SentencePieceProcessor> m_processor;
+	using ProcessorPtr = std::shared_ptr<sentencepiece::SentencePieceProcessor>;
+
+	static ProcessorPtr LoadProcessor(const std::string& utf8FileName) {
+		auto processor = std::make_shared<sentencepiece::SentencePieceProcessor>();
+		const auto& result = processor->Load(utf8FileName);
+		if (!result.ok()) {
+			throw std::exception("model loading failed.");
+		}
+		return processor;
+	}
+
+	// null for models the native encoder does not handle.
+	static std::shared_ptr<UnigramEncoder> LoadNativeEncoder(std::wstring_view fileName) {
+		try {
+			std::ifstream modelFile(std::wstring(fileName), std::ios::binary);
+			std::stringstream modelBytes;
+			modelBytes << modelFile.rdbuf();
+			auto encoder = std::make_shared<UnigramEncoder>();
+			return encoder->Load(modelBytes.str()) ? encoder : nullptr;
+		}
+		catch (...) { return nullptr; }
+	}
+
+	// the native encoder is opt-in (GPTRERANKER_NATIVE_TOKENIZER=1), to be turned on once VerifyNativeEncoder()
+	// has matched it with the library on a corpus of the application.
+	static bool IsNativeEncoderEnabled() {
+		wchar_t value[8] = {};
+		return GetEnvironmentVariable(L"GPTRERANKER_NATIVE_TOKENIZER", value, ARRAYSIZE(value)) != 0 && value[0] == L'1';
+	}
+
+	std::vector<int> EncodeWith(const sentencepiece::SentencePieceProcessor& processor, std::string_view source) const {
+		std::vector<int> tokenVector;
+		if (m_useNativeEncoder) {
+			m_nativeEncoder->Encode(source, tokenVector);
+			return tokenVector;
+		}
+		const auto& result = processor.Encode(source, &tokenVector);
+		if (!result.ok()) throw std::exception("failed to encode");
+		return tokenVector;
+	}
+
+	// worker 0 is the calling thread, the others are threads of the shared WorkerPool.
+	static size_t GetMaxThreadCount() {
+		return std::min(c_maxEncodeThreads, WorkerPool::GetShared().GetThreadCount());
+	}
+
+	// worker 0 uses m_processor, others are loaded on the first batch which needs them.
+	std::vector<ProcessorPtr> GetWorkerProcessors(size_t threadCount) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_workerProcessors.empty()) m_workerProcessors.push_back(m_processor);
+		while (m_workerProcessors.size() < threadCount) {
+			m_workerProcessors.push_back(LoadProcessor(m_utf8FileName));
+		}
+		return m_workerProcessors;
+	}
+
+	// LRU keyed by the utf-8 text as passed, normalization is a part of the cached encoding.
+	bool LookupCache(std::string_view source, std::vector<int>& tokenVector) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const auto it = m_cacheIndex.find(source);
+		if (it == m_cacheIndex.end()) return false;
+		m_cacheEntries.splice(m_cacheEntries.begin(), m_cacheEntries, it->second);
+		tokenVector = it->second->second;
+		return true;
+	}
+
+	void InsertCache(std::string_view source, const std::vector<int>& tokenVector) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_cacheIndex.find(source) != m_cacheIndex.end()) return;
+		m_cacheEntries.emplace_front(std::string(source), tokenVector);
+		m_cacheIndex.emplace(m_cacheEntries.front().first, m_cacheEntries.begin());
+		if (m_cacheEntries.size() > c_cacheCapacity) {
+			m_cacheIndex.erase(m_cacheEntries.back().first);
+			m_cacheEntries.pop_back();
+		}
+	}
+
+	ProcessorPtr m_processor;
+	std::shared_ptr<UnigramEncoder> m_nativeEncoder;	// null when not enabled or the model is not supported
+	bool m_useNativeEncoder = false;					// otherwise the library encodes
+	std::wstring m_fileName;
+	std::string m_utf8FileName;
+	std::mutex m_mutex;
+	std::vector<ProcessorPtr> m_workerProcessors;
+	// keys of m_cacheIndex point into m_cacheEntries, list nodes never move.
+	std::list<std::pair<std::string, std::vector<int>>> m_cacheEntries;
+	std::unordered_map<std::string_view, std::list<std::pair<std::string, std::vector<int>>>::iterator> m_cacheIndex;
 };
 
 std::shared_ptr<Tokenizer> Tokenizer::CreateInstance() {
@@ -9,11 +9,24 @@ struct Tokenizer
 	virtual void Load(std::wstring_view fileName) = 0;
 	virtual std::vector<int> Encode(std::string_view source) = 0;
 	virtual std::vector<int> Encode(std::wstring_view source) = 0;
+	// encodes on worker threads (one SentencePieceProcessor per thread), results are cached by the utf-8 text.
+	virtual std::vector<std::vector<int>> EncodeBatch(const std::string_view* sources, size_t count) = 0;
 	virtual std::vector<int64_t> Encode64(std::wstring_view source) = 0;
 	virtual std::wstring Decode64(const int64_t* tokenPtr, size_t tokenLen) = 0;
 
+	// compares the native unigram encoder with SentencePieceProcessor on every line of a utf-8 corpus, without the cache.
+	struct EncoderCheck {
+		long long lineCount = 0;
+		long long mismatchCount = 0;
+		double nativeSeconds = 0.0;
+		double librarySeconds = 0.0;
+	};
+	virtual EncoderCheck VerifyNativeEncoder(std::wstring_view corpusFileName) = 0;
+
 	virtual int bos_id() = 0;
 	virtual int eos_id() = 0;
+	// ids are 0 .. GetPieceSize() - 1.
+	virtual int GetPieceSize() = 0;
 
 	virtual ~Tokenizer() {};
 	static std::shared_ptr<Tokenizer> CreateInstance();
@@ -0,0 +1,454 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include "protobufReader.h"
+#include "unigramEncoder.h"
+
+namespace {
+	// sentencepiece ModelProto.SentencePiece.Type
+	constexpr uint8_t c_normalPiece = 1;
+	constexpr uint8_t c_unknownPiece = 2;
+	constexpr uint8_t c_userDefinedPiece = 4;
+	constexpr uint8_t c_unusedPiece = 5;
+	constexpr uint8_t c_bytePiece = 6;
+	constexpr uint64_t c_unigramModel = 1;
+
+	constexpr float c_unkPenalty = 10.0f;
+	constexpr std::string_view c_spaceSymbol = "\xe2\x96\x81";	// U+2581
+	constexpr std::string_view c_replacementCharacter = "\xef\xbf\xbd";	// U+FFFD
+
+	struct LatticeNode {
+		int id;
+		float score;
+		int startsAt;
+	};
+
+	struct Workspace {
+		std::string normalized;
+		std::vector<LatticeNode> bestPath;
+		std::vector<int> pathEnds;
+	};
+
+	size_t GetCharLength(char lead) {
+		return "\1\1\1\1\1\1\1\1\1\1\1\1\2\2\3\4"[static_cast<uint8_t>(lead) >> 4];
+	}
+
+	bool IsTrailByte(char c) {
+		return static_cast<signed char>(c) < -0x40;
+	}
+
+	bool IsValidCodepoint(uint32_t c) {
+		return c < 0xD800 || (c >= 0xE000 && c <= 0x10FFFF);
+	}
+
+	// same rules as sentencepiece string_util::DecodeUTF8, invalid sequences give 0xFFFD with length 1.
+	uint32_t DecodeUtf8(std::string_view text, size_t& length) {
+		const auto c0 = static_cast<uint8_t>(text[0]);
+		if (c0 < 0x80) {
+			length = 1;
+			return c0;
+		}
+		if (text.size() >= 2 && (c0 & 0xE0) == 0xC0) {
+			const uint32_t cp = ((c0 & 0x1F) << 6) | (text[1] & 0x3F);
+			if (IsTrailByte(text[1]) && cp >= 0x80 && IsValidCodepoint(cp)) {
+				length = 2;
+				return cp;
+			}
+		}
+		else if (text.size() >= 3 && (c0 & 0xF0) == 0xE0) {
+			const uint32_t cp = ((c0 & 0x0F) << 12) | ((text[1] & 0x3F) << 6) | (text[2] & 0x3F);
+			if (IsTrailByte(text[1]) && IsTrailByte(text[2]) && cp >= 0x800 && IsValidCodepoint(cp)) {
+				length = 3;
+				return cp;
+			}
+		}
+		else if (text.size() >= 4 && (c0 & 0xF8) == 0xF0) {
+			const uint32_t cp = ((c0 & 0x07) << 18) | ((text[1] & 0x3F) << 12) | ((text[2] & 0x3F) << 6) | (text[3] & 0x3F);
+			if (IsTrailByte(text[1]) && IsTrailByte(text[2]) && IsTrailByte(text[3]) && cp >= 0x10000 && IsValidCodepoint(cp)) {
+				length = 4;
+				return cp;
+			}
+		}
+		length = 1;
+		return 0xFFFD;
+	}
+
+	bool IsValidUtf8(std::string_view text, size_t& length) {
+		return DecodeUtf8(text, length) != 0xFFFD || length == 3;
+	}
+
+	std::string EncodeUtf8(uint32_t cp) {
+		std::string text;
+		if (cp < 0x80) {
+			text += static_cast<char>(cp);
+		}
+		else if (cp < 0x800) {
+			text += static_cast<char>(0xC0 | (cp >> 6));
+			text += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		else {
+			text += static_cast<char>(0xE0 | (cp >> 12));
+			text += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+			text += static_cast<char>(0x80 | (cp & 0x3F));
+		}
+		return text;
+	}
+
+	// darts-clone unit layout, used by the precompiled charsmap.
+	bool HasLeaf(uint32_t unit) { return ((unit >> 8) & 1) == 1; }
+	uint32_t GetLeafValue(uint32_t unit) { return unit & ((1U << 31) - 1); }
+	uint32_t GetLabel(uint32_t unit) { return unit & ((1U << 31) | 0xFF); }
+	uint32_t GetOffset(uint32_t unit) { return (unit >> 10) << ((unit & (1U << 9)) >> 6); }
+}
+
+void UnigramEncoder::DoubleArray::Build(std::vector<std::pair<std::string_view, int>> keys) {
+	std::sort(keys.begin(), keys.end());
+	m_units.assign(512, Unit{});
+	m_units[0].check = -2;
+	m_firstFree = 1;
+	if (!keys.empty()) Place(keys, 0, 0, keys.size(), 0);
+}
+
+void UnigramEncoder::DoubleArray::Place(const std::vector<std::pair<std::string_view, int>>& keys, int node, size_t begin, size_t end, size_t depth) {
+	// keys are sorted, so the key ending here comes first.
+	if (keys[begin].first.size() == depth) {
+		m_units[node].value = keys[begin].second;
+		++begin;
+	}
+	if (begin == end) return;
+
+	std::vector<std::tuple<uint8_t, size_t, size_t>> children;
+	for (auto i = begin; i < end;) {
+		const auto label = static_cast<uint8_t>(keys[i].first[depth]);
+		auto j = i;
+		while (j < end && static_cast<uint8_t>(keys[j].first[depth]) == label) ++j;
+		children.emplace_back(label, i, j);
+		i = j;
+	}
+
+	// first base where every child slot is free, units are kept up to base + 255 for Next().
+	const auto firstLabel = std::get<0>(children.front());
+	size_t base = 0;
+	for (auto slot = std::max<size_t>(m_firstFree, firstLabel + 1);; ++slot) {
+		if (m_units.size() < slot + 256) m_units.resize(std::max(m_units.size() * 2, slot + 256));
+		if (m_units[slot].check != -1) continue;
+		base = slot - firstLabel;
+		const auto isFree = std::all_of(children.begin(), children.end(),
+			[&](const auto& child) { return m_units[base + std::get<0>(child)].check == -1; });
+		if (isFree) break;
+	}
+
+	m_units[node].base = static_cast<int32_t>(base);
+	for (const auto& [label, childBegin, childEnd] : children) {
+		m_units[base + label].check = node;
+	}
+	while (m_firstFree < m_units.size() && m_units[m_firstFree].check != -1) ++m_firstFree;
+
+	for (const auto& [label, childBegin, childEnd] : children) {
+		Place(keys, static_cast<int>(base + label), childBegin, childEnd, depth + 1);
+	}
+}
+
+size_t UnigramEncoder::DoubleArray::GetLongestPrefix(std::string_view text) const {
+	if (IsEmpty()) return 0;
+	size_t longest = 0;
+	int node = 0;
+	for (size_t i = 0; i < text.size(); ++i) {
+		node = Next(node, static_cast<uint8_t>(text[i]));
+		if (node < 0) break;
+		if (GetValue(node) >= 0) longest = i + 1;
+	}
+	return longest;
+}
+
+bool UnigramEncoder::Load(std::string_view modelBytes) {
+	*this = UnigramEncoder();
+
+	std::vector<std::string_view> pieces;
+	uint64_t modelType = c_unigramModel;
+	std::string_view charsMap;
+	ProtobufReader model(modelBytes.data(), modelBytes.size());
+	uint32_t field, wireType;
+	while (model.Next(field, wireType)) {
+		if (field == 1 && wireType == ProtobufReader::c_lengthDelimited) {
+			// SentencePiece: piece, score, type
+			auto piece = model.ReadMessage();
+			std::string_view text;
+			float score = 0.0f;
+			uint64_t type = c_normalPiece;
+			while (piece.Next(field, wireType)) {
+				if (field == 1 && wireType == ProtobufReader::c_lengthDelimited) text = piece.ReadBytes();
+				else if (field == 2 && wireType == ProtobufReader::c_fixed32) score = piece.ReadFloat();
+				else if (field == 3 && wireType == ProtobufReader::c_varint) type = piece.ReadVarint();
+				else piece.Skip(wireType);
+			}
+			pieces.push_back(text);
+			m_scores.push_back(score);
+			m_types.push_back(static_cast<uint8_t>(type));
+		}
+		else if (field == 2 && wireType == ProtobufReader::c_lengthDelimited) {
+			// TrainerSpec
+			auto spec = model.ReadMessage();
+			while (spec.Next(field, wireType)) {
+				if (field == 3 && wireType == ProtobufReader::c_varint) modelType = spec.ReadVarint();
+				else if (field == 24 && wireType == ProtobufReader::c_varint) m_treatWhitespaceAsSuffix = spec.ReadVarint() != 0;
+				else if (field == 35 && wireType == ProtobufReader::c_varint) m_byteFallback = spec.ReadVarint() != 0;
+				else spec.Skip(wireType);
+			}
+		}
+		else if (field == 3 && wireType == ProtobufReader::c_lengthDelimited) {
+			// NormalizerSpec
+			auto spec = model.ReadMessage();
+			while (spec.Next(field, wireType)) {
+				if (field == 2 && wireType == ProtobufReader::c_lengthDelimited) charsMap = spec.ReadBytes();
+				else if (field == 3 && wireType == ProtobufReader::c_varint) m_addDummyPrefix = spec.ReadVarint() != 0;
+				else if (field == 4 && wireType == ProtobufReader::c_varint) m_removeExtraWhitespaces = spec.ReadVarint() != 0;
+				else if (field == 5 && wireType == ProtobufReader::c_varint) m_escapeWhitespaces = spec.ReadVarint() != 0;
+				else spec.Skip(wireType);
+			}
+		}
+		else {
+			model.Skip(wireType);
+		}
+	}
+	if (modelType != c_unigramModel || pieces.empty()) return false;
+
+	// <trie size (4 bytes)><double array><replacement strings>
+	if (!charsMap.empty()) {
+		uint32_t trieSize = 0;
+		if (charsMap.size() < sizeof(trieSize)) throw std::runtime_error("broken precompiled charsmap");
+		memcpy(&trieSize, charsMap.data(), sizeof(trieSize));
+		if (trieSize % sizeof(uint32_t) != 0 || charsMap.size() < sizeof(trieSize) + trieSize) throw std::runtime_error("broken precompiled charsmap");
+		m_charsMapUnits.resize(trieSize / sizeof(uint32_t));
+		memcpy(m_charsMapUnits.data(), charsMap.data() + sizeof(trieSize), trieSize);
+		m_charsMapStrings = charsMap.substr(sizeof(trieSize) + trieSize);
+	}
+
+	// scores of normal pieces only, as sentencepiece does.
+	auto minScore = std::numeric_limits<float>::max();
+	auto maxScore = std::numeric_limits<float>::min();
+	std::vector<std::pair<std::string_view, int>> trieKeys;
+	std::vector<std::pair<std::string_view, int>> userDefinedKeys;
+	bool hasUnknown = false;
+	std::fill(std::begin(m_byteIds), std::end(m_byteIds), -1);
+	for (int id = 0; id < static_cast<int>(pieces.size()); ++id) {
+		const auto type = m_types[id];
+		if (type == c_normalPiece) {
+			minScore = std::min(minScore, m_scores[id]);
+			maxScore = std::max(maxScore, m_scores[id]);
+		}
+		if (type == c_normalPiece || type == c_userDefinedPiece || type == c_unusedPiece) {
+			trieKeys.emplace_back(pieces[id], id);
+		}
+		if (type == c_userDefinedPiece) {
+			userDefinedKeys.emplace_back(pieces[id], id);
+		}
+		if (type == c_unknownPiece) {
+			m_unkId = id;
+			hasUnknown = true;
+		}
+		// "<0x41>"
+		if (type == c_bytePiece && pieces[id].size() == 6) {
+			m_byteIds[std::stoi(std::string(pieces[id].substr(3, 2)), nullptr, 16)] = id;
+		}
+	}
+	if (!hasUnknown) return false;
+	if (m_byteFallback && std::find(std::begin(m_byteIds), std::end(m_byteIds), -1) != std::end(m_byteIds)) return false;
+	m_minScore = minScore == std::numeric_limits<float>::max() ? 0.0f : minScore;
+	m_maxScore = maxScore == std::numeric_limits<float>::min() ? 0.0f : maxScore;
+
+	// tries keep ids only, the piece views are not used after Build().
+	m_pieceTrie.Build(trieKeys);
+	if (!userDefinedKeys.empty()) m_userDefinedTrie.Build(userDefinedKeys);
+
+	m_passThrough.assign(0x10000, 0);
+	for (uint32_t cp = 0; cp < 0x10000; ++cp) {
+		if (cp == ' ' || !IsValidCodepoint(cp)) continue;
+		const auto& character = EncodeUtf8(cp);
+		const auto startsUserDefined = !m_userDefinedTrie.IsEmpty() && std::any_of(userDefinedKeys.begin(), userDefinedKeys.end(),
+			[&](const auto& key) { return key.first.substr(0, character.size()) == character; });
+		m_passThrough[cp] = !StartsCharsMapKey(character) && !startsUserDefined ? 1 : 0;
+	}
+	return true;
+}
+
+bool UnigramEncoder::StartsCharsMapKey(std::string_view character) const {
+	if (m_charsMapUnits.empty()) return false;
+	uint32_t nodePos = GetOffset(m_charsMapUnits[0]);
+	for (const auto c : character) {
+		nodePos ^= static_cast<uint8_t>(c);
+		if (nodePos >= m_charsMapUnits.size()) return false;
+		const auto unit = m_charsMapUnits[nodePos];
+		if (GetLabel(unit) != static_cast<uint8_t>(c)) return false;
+		nodePos ^= GetOffset(unit);
+	}
+	return true;
+}
+
+std::pair<std::string_view, size_t> UnigramEncoder::NormalizePrefix(std::string_view input) const {
+	const auto userDefinedLength = m_userDefinedTrie.GetLongestPrefix(input);
+	if (userDefinedLength > 0) return { input.substr(0, userDefinedLength), userDefinedLength };
+
+	// longest charsmap key which is a prefix of input.
+	size_t longestLength = 0;
+	uint32_t longestValue = 0;
+	if (!m_charsMapUnits.empty()) {
+		uint32_t nodePos = GetOffset(m_charsMapUnits[0]);
+		for (size_t i = 0; i < input.size(); ++i) {
+			const auto c = static_cast<uint8_t>(input[i]);
+			nodePos ^= c;
+			if (nodePos >= m_charsMapUnits.size()) break;
+			const auto unit = m_charsMapUnits[nodePos];
+			if (GetLabel(unit) != c) break;
+			nodePos ^= GetOffset(unit);
+			if (HasLeaf(unit) && nodePos < m_charsMapUnits.size()) {
+				longestLength = i + 1;
+				longestValue = GetLeafValue(m_charsMapUnits[nodePos]);
+			}
+		}
+	}
+
+	if (longestLength == 0) {
+		size_t length;
+		if (!IsValidUtf8(input, length)) return { c_replacementCharacter, 1 };
+		return { input.substr(0, length), length };
+	}
+	if (longestValue >= m_charsMapStrings.size()) throw std::runtime_error("broken precompiled charsmap");
+	const auto top = m_charsMapStrings.data() + longestValue;
+	return { std::string_view(top, strnlen(top, m_charsMapStrings.size() - longestValue)), longestLength };
+}
+
+size_t UnigramEncoder::GetPassThroughLength(std::string_view input) const {
+	size_t length = 0;
+	while (length < input.size()) {
+		const auto c = static_cast<uint8_t>(input[length]);
+		if (c < 0x80) {
+			if (!m_passThrough[c]) break;
+			++length;
+			continue;
+		}
+		size_t charLength;
+		const auto cp = DecodeUtf8(input.substr(length), charLength);
+		if (charLength == 1 || cp >= 0x10000 || !m_passThrough[cp]) break;
+		length += charLength;
+	}
+	return length;
+}
+
+void UnigramEncoder::Normalize(std::string_view input, std::string& normalized) const {
+	normalized.clear();
+
+	// leading whitespaces are dropped.
+	if (m_removeExtraWhitespaces) {
+		while (!input.empty()) {
+			const auto [piece, consumed] = NormalizePrefix(input);
+			if (piece != " ") break;
+			input.remove_prefix(consumed);
+		}
+	}
+	if (input.empty()) return;
+
+	const auto space = m_escapeWhitespaces ? c_spaceSymbol : std::string_view(" ");
+	if (!m_treatWhitespaceAsSuffix && m_addDummyPrefix) normalized.append(space);
+
+	bool isPrevSpace = m_removeExtraWhitespaces;
+	while (!input.empty()) {
+		// fast path, most kana, kanji and ascii letters are not changed by the charsmap.
+		const auto passThroughLength = GetPassThroughLength(input);
+		if (passThroughLength > 0) {
+			normalized.append(input.substr(0, passThroughLength));
+			input.remove_prefix(passThroughLength);
+			isPrevSpace = false;
+			continue;
+		}
+
+		auto [piece, consumed] = NormalizePrefix(input);
+		while (isPrevSpace && !piece.empty() && piece.front() == ' ') piece.remove_prefix(1);
+		if (!piece.empty()) {
+			for (const auto c : piece) {
+				if (m_escapeWhitespaces && c == ' ') normalized.append(c_spaceSymbol);
+				else normalized += c;
+			}
+			isPrevSpace = piece.back() == ' ';
+		}
+		input.remove_prefix(consumed);
+		if (!m_removeExtraWhitespaces) isPrevSpace = false;
+	}
+
+	// trailing whitespaces are dropped.
+	if (m_removeExtraWhitespaces) {
+		while (normalized.size() >= space.size() && std::string_view(normalized).substr(normalized.size() - space.size()) == space) {
+			normalized.resize(normalized.size() - space.size());
+		}
+	}
+	if (m_treatWhitespaceAsSuffix && m_addDummyPrefix) normalized.append(space);
+}
+
+void UnigramEncoder::Encode(std::string_view source, std::vector<int>& tokenIds) const {
+	thread_local Workspace workspace;
+	auto& normalized = workspace.normalized;
+	auto& bestPath = workspace.bestPath;
+
+	tokenIds.clear();
+	Normalize(source, normalized);
+	if (normalized.empty()) return;
+
+	// Viterbi over character boundaries, bestPath[i] is the best piece ending at byte i.
+	// score arithmetic (double sums stored as float) follows sentencepiece, ties must resolve the same way.
+	const auto size = static_cast<int>(normalized.size());
+	const auto unkScore = m_minScore - c_unkPenalty;
+	bestPath.assign(size + 1, LatticeNode{ -1, 0.0f, -1 });
+	for (int startsAt = 0; startsAt < size;) {
+		const auto scoreTillHere = bestPath[startsAt].score;
+		const auto charLength = std::min(static_cast<int>(GetCharLength(normalized[startsAt])), size - startsAt);
+		bool hasSingleNode = false;
+		int node = 0;
+		for (int keyPos = startsAt; keyPos < size;) {
+			node = m_pieceTrie.Next(node, static_cast<uint8_t>(normalized[keyPos++]));
+			if (node < 0) break;
+			const auto id = m_pieceTrie.GetValue(node);
+			if (id < 0 || m_types[id] == c_unusedPiece) continue;
+
+			const auto length = keyPos - startsAt;
+			const double score = m_types[id] == c_userDefinedPiece ? static_cast<float>(length) * m_maxScore - 0.1 : m_scores[id];
+			const auto candidateScore = score + scoreTillHere;
+			auto& target = bestPath[keyPos];
+			if (target.startsAt == -1 || candidateScore > target.score) {
+				target = LatticeNode{ id, static_cast<float>(candidateScore), startsAt };
+			}
+			if (length == charLength) hasSingleNode = true;
+		}
+		if (!hasSingleNode) {
+			const auto candidateScore = unkScore + scoreTillHere;
+			auto& target = bestPath[startsAt + charLength];
+			if (target.startsAt == -1 || candidateScore > target.score) {
+				target = LatticeNode{ m_unkId, candidateScore, startsAt };
+			}
+		}
+		startsAt += charLength;
+	}
+
+	auto& pathEnds = workspace.pathEnds;
+	pathEnds.clear();
+	for (int endsAt = size; endsAt > 0; endsAt = bestPath[endsAt].startsAt) {
+		pathEnds.push_back(endsAt);
+	}
+
+	// unknown pieces become bytes with byte fallback, otherwise a run of them is one unknown id.
+	bool isPrevUnknown = false;
+	for (auto it = pathEnds.rbegin(); it != pathEnds.rend(); ++it) {
+		const auto& pathNode = bestPath[*it];
+		const auto isUnknown = pathNode.id == m_unkId;
+		if (isUnknown && m_byteFallback) {
+			for (auto i = pathNode.startsAt; i < *it; ++i) {
+				tokenIds.push_back(m_byteIds[static_cast<uint8_t>(normalized[i])]);
+			}
+		}
+		else if (!isUnknown || !isPrevUnknown) {
+			tokenIds.push_back(pathNode.id);
+		}
+		isPrevUnknown = isUnknown;
+	}
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// sentencepiece unigram encoder reading spiece.model directly, written to give the ids of SentencePieceProcessor::Encode.
+// normalization (precompiled charsmap), whitespace handling, Viterbi and unknown/byte fallback follow sentencepiece.
+// agreement and speed are not established, Tokenizer::VerifyNativeEncoder() measures both on a corpus.
+class UnigramEncoder
+{
+public:
+	// returns false for models this encoder does not handle (BPE etc.), callers keep using the library then.
+	bool Load(std::string_view modelBytes);
+	bool IsLoaded() const { return !m_pieceTrie.IsEmpty(); }
+
+	// thread safe, scratch buffers are per thread and reused.
+	void Encode(std::string_view source, std::vector<int>& tokenIds) const;
+	// text passed to the lattice, same as sentencepiece normalizer output.
+	void Normalize(std::string_view source, std::string& normalized) const;
+
+private:
+	// byte-wise double-array trie, node 0 is the root.
+	class DoubleArray
+	{
+	public:
+		void Build(std::vector<std::pair<std::string_view, int>> keys);
+		bool IsEmpty() const { return m_units.empty(); }
+		// -1 when there is no such child.
+		int Next(int node, uint8_t label) const {
+			const auto next = m_units[node].base + label;
+			return m_units[next].check == node ? next : -1;
+		}
+		// -1 when no key ends at the node.
+		int GetValue(int node) const { return m_units[node].value; }
+		// length of the longest key which is a prefix of text, 0 for none.
+		size_t GetLongestPrefix(std::string_view text) const;
+
+	private:
+		struct Unit {
+			int32_t base = 0;	// children are at base + label, leaves keep 0 (no unit has a leaf as parent)
+			int32_t check = -1;	// parent node, -1 = free
+			int32_t value = -1;
+		};
+
+		void Place(const std::vector<std::pair<std::string_view, int>>& keys, int node, size_t begin, size_t end, size_t depth);
+
+		std::vector<Unit> m_units;
+		size_t m_firstFree = 1;
+	};
+
+	std::pair<std::string_view, size_t> NormalizePrefix(std::string_view input) const;
+	size_t GetPassThroughLength(std::string_view input) const;
+	bool StartsCharsMapKey(std::string_view character) const;
+
+	// pieces by id
+	std::vector<float> m_scores;
+	std::vector<uint8_t> m_types;
+	DoubleArray m_pieceTrie;		// normal, user defined and unused pieces
+	DoubleArray m_userDefinedTrie;	// user defined pieces are not normalized
+	int m_unkId = 0;
+	float m_minScore = 0.0f;
+	float m_maxScore = 0.0f;
+	bool m_byteFallback = false;
+	int m_byteIds[256] = {};
+
+	// precompiled charsmap: darts-clone double array and NUL terminated replacement strings.
+	std::vector<uint32_t> m_charsMapUnits;
+	std::string m_charsMapStrings;
+	bool m_addDummyPrefix = true;
+	bool m_removeExtraWhitespaces = true;
+	bool m_escapeWhitespaces = true;
+	bool m_treatWhitespaceAsSuffix = false;
+
+	// BMP characters which no charsmap key or user defined piece starts with, copied as is by the normalizer.
+	std::vector<uint8_t> m_passThrough;
+};
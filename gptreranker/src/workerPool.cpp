@@ -0,0 +1,102 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <algorithm>
+#include "workerPool.h"
+
+namespace {
+	// pool threads, the calling thread makes one more worker.
+	constexpr unsigned int c_maxPoolThreads = 3;
+
+	unsigned int GetPoolThreadCount() {
+		return std::min(c_maxPoolThreads, std::thread::hardware_concurrency() / 4);
+	}
+}
+
+WorkerPool& WorkerPool::GetShared() {
+	static const auto pool = []() {
+		HMODULE hModule = {};
+		GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN, reinterpret_cast<LPCWSTR>(GetPoolThreadCount), &hModule);
+		return new WorkerPool(GetPoolThreadCount());
+	}();
+	return *pool;
+}
+
+unsigned int WorkerPool::GetModelThreadCount() {
+	const auto processorCount = std::max(1U, std::thread::hardware_concurrency());
+	return std::max(1U, processorCount - GetPoolThreadCount());
+}
+
+WorkerPool::WorkerPool(size_t threadCount) {
+	for (size_t i = 0; i < threadCount; ++i) {
+		m_threads.emplace_back(&WorkerPool::WorkerLoop, this);
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_isStopping = true;
+	}
+	m_condition.notify_all();
+	for (auto& thread : m_threads) thread.join();
+}
+
+void WorkerPool::Run(size_t workerCount, const std::function<void(size_t worker)>& body) {
+	if (workerCount == 0) return;
+	auto job = std::make_shared<Job>();
+	job->body = &body;
+	job->workerCount = workerCount;
+
+	// one entry per pool thread which can help, an entry taken after all workers started returns at once.
+	const auto helperCount = std::min(workerCount - 1, m_threads.size());
+	if (helperCount > 0) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (size_t i = 0; i < helperCount; ++i) m_jobs.push_back(job);
+		}
+		m_condition.notify_all();
+	}
+
+	try {
+		body(0);
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> lock(job->mutex);
+		if (!job->error) job->error = std::current_exception();
+	}
+	RunWorkers(*job);
+	{
+		std::unique_lock<std::mutex> lock(job->mutex);
+		job->doneCondition.wait(lock, [&]() { return job->doneCount == job->workerCount - 1; });
+	}
+	if (job->error) std::rethrow_exception(job->error);
+}
+
+void WorkerPool::RunWorkers(Job& job) {
+	for (auto worker = job.nextWorker++; worker < job.workerCount; worker = job.nextWorker++) {
+		std::exception_ptr error;
+		try {
+			(*job.body)(worker);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		std::lock_guard<std::mutex> lock(job.mutex);
+		if (error && !job.error) job.error = error;
+		if (++job.doneCount == job.workerCount - 1) job.doneCondition.notify_all();
+	}
+}
+
+void WorkerPool::WorkerLoop() {
+	for (;;) {
+		std::shared_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_isStopping || !m_jobs.empty(); });
+			if (m_jobs.empty()) return;
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+		}
+		RunWorkers(*job);
+	}
+}
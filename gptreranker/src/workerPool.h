@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// long-lived threads for the work around model runs (tokenizing batches, reading out logits), one pool per process.
+// it is small on purpose: the connectors give WinML's intra-op pool the other processors (GetModelThreadCount()),
+// so both pools together never have more threads than the machine.
+class WorkerPool
+{
+public:
+	// never destroyed, joining its threads at DLL_PROCESS_DETACH would deadlock on the loader lock (the module is pinned).
+	static WorkerPool& GetShared();
+	// threads left for WinML's intra-op pool of each session.
+	static unsigned int GetModelThreadCount();
+
+	explicit WorkerPool(size_t threadCount);
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator = (const WorkerPool&) = delete;
+	~WorkerPool();
+
+	// including the calling thread.
+	size_t GetThreadCount() const { return m_threads.size() + 1; }
+
+	// runs body(0) .. body(workerCount - 1), body(0) on the calling thread and the others on pool threads.
+	// workers no pool thread has taken yet are run by the calling thread, so a busy pool only makes it slower.
+	// returns when all have run, the first exception thrown by body is rethrown.
+	void Run(size_t workerCount, const std::function<void(size_t worker)>& body);
+
+private:
+	struct Job {
+		const std::function<void(size_t)>* body;
+		size_t workerCount;
+		std::atomic<size_t> nextWorker = 1;
+		size_t doneCount = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable doneCondition;
+	};
+
+	static void RunWorkers(Job& job);
+	void WorkerLoop();
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<std::shared_ptr<Job>> m_jobs;
+	bool m_isStopping = false;
+	std::vector<std::thread> m_threads;
+};
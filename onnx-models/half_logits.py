@@ -0,0 +1,40 @@
+# change the logits output of decoder_model.onnx to fp16 or bf16.
+#
+#   python half_logits.py rinna-gpt2-xsmall/decoder_model.int8.onnx --type bf16
+#
+# only a Cast is appended to the graph output, the model body is not changed.
+# readout of [batch, seq, 32000] logits reads half of the bytes, the connector detects the output type.
+import argparse
+import os
+
+import onnx
+from onnx import TensorProto, helper
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model")
+    parser.add_argument("--type", choices=["fp16", "bf16"], default="fp16")
+    parser.add_argument("--output", help="default: <model>.<type>logits.onnx")
+    args = parser.parse_args()
+
+    elem_type = TensorProto.FLOAT16 if args.type == "fp16" else TensorProto.BFLOAT16
+    output = args.output or os.path.splitext(args.model)[0] + f".{args.type}logits.onnx"
+
+    model = onnx.load(args.model, load_external_data=False)
+    graph = model.graph
+    logits = next(o for o in graph.output if o.name == "logits")
+
+    # rename the producer output, then cast it back to "logits".
+    for node in graph.node:
+        node.output[:] = ["logits_fp32" if name == "logits" else name for name in node.output]
+    graph.node.append(helper.make_node("Cast", ["logits_fp32"], ["logits"], to=elem_type, name="logits_cast"))
+    logits.type.tensor_type.elem_type = elem_type
+
+    # external data stays in the original file, copy or link it beside the output if the directory differs.
+    onnx.save(model, output)
+    print(f"{args.model} -> {output}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,133 @@
+# make decoder_model.pruned.onnx whose LM head only has the tokens used in a domain corpus.
+#
+#   python prune_vocab.py rinna-gpt2-xsmall corpus.txt --coverage 0.9999
+#
+# outputs (beside decoder_model.onnx)
+#   decoder_model.pruned.onnx   : logits is [batch, seq, kept token count]
+#   decoder_model.pruned.vocab  : full token id of each logits column, one per line.
+#                                 the connector loads it and maps ids back.
+# the score error for in-vocabulary sentences of the corpus is printed at the end.
+import argparse
+import collections
+import os
+
+import numpy as np
+import onnx
+import onnxruntime as ort
+import sentencepiece as spm
+from onnx import numpy_helper
+
+KERNEL_WIDTH = 32  # readout kernels read 32 logits at once
+
+
+def count_tokens(tokenizer, corpus_file):
+    counter = collections.Counter()
+    sentences = []
+    with open(corpus_file, encoding="utf-8") as f:
+        for line in f:
+            line = line.strip()
+            if not line:
+                continue
+            ids = tokenizer.encode(line)
+            counter.update(ids)
+            counter[tokenizer.eos_id()] += 1
+            sentences.append(ids)
+    return counter, sentences
+
+
+def select_tokens(tokenizer, counter, coverage):
+    total = sum(counter.values())
+    special = {i for i in range(tokenizer.get_piece_size())
+               if tokenizer.is_control(i) or tokenizer.is_unknown(i) or tokenizer.is_byte(i)}
+    kept = set(special)
+    covered = 0
+    ranked = [token for token, _ in counter.most_common()]
+    for token in ranked:
+        if covered >= coverage * total:
+            break
+        kept.add(token)
+        covered += counter[token]
+
+    # fill up to the kernel width with next frequent tokens, then with any ids.
+    rest = [t for t in ranked if t not in kept] + [t for t in range(tokenizer.get_piece_size()) if t not in kept and t not in counter]
+    while len(kept) % KERNEL_WIDTH != 0:
+        kept.add(rest.pop(0))
+    return sorted(kept)
+
+
+def prune_lm_head(model, kept):
+    graph = model.graph
+    producer = next(node for node in graph.node if "logits" in node.output)
+    if producer.op_type != "MatMul":
+        raise RuntimeError(f"logits is made by {producer.op_type}, only MatMul LM head is supported")
+
+    initializers = {init.name: init for init in graph.initializer}
+    weight_name = producer.input[1]
+    transpose = None
+    if weight_name not in initializers:
+        # tied embedding: MatMul(hidden, Transpose(wte))
+        transpose = next((node for node in graph.node if weight_name in node.output and node.op_type == "Transpose"), None)
+        if transpose is None or transpose.input[0] not in initializers:
+            raise RuntimeError("LM head weight is not an initializer")
+        weight = numpy_helper.to_array(initializers[transpose.input[0]], base_dir=MODEL_DIR).T
+    else:
+        weight = numpy_helper.to_array(initializers[weight_name], base_dir=MODEL_DIR)
+
+    pruned = numpy_helper.from_array(np.ascontiguousarray(weight[:, kept]), name="lm_head_pruned")
+    graph.initializer.append(pruned)
+    producer.input[1] = pruned.name
+
+    logits = next(o for o in graph.output if o.name == "logits")
+    logits.type.tensor_type.shape.dim[2].dim_value = len(kept)
+
+
+def sentence_scores(session, sentences, vocab_map=None):
+    scores = []
+    for ids in sentences:
+        logits = session.run(["logits"], {
+            "input_ids": np.array([ids], dtype=np.int64),
+            "attention_mask": np.ones((1, len(ids)), dtype=np.int64)})[0][0]
+        logits = logits - logits.max(axis=-1, keepdims=True)
+        log_probs = logits - np.log(np.exp(logits).sum(axis=-1, keepdims=True))
+        targets = ids[1:] + [EOS_ID]
+        columns = [vocab_map[t] for t in targets] if vocab_map else targets
+        scores.append(float(sum(log_probs[i, c] for i, c in enumerate(columns))))
+    return np.array(scores)
+
+
+def main():
+    global MODEL_DIR, EOS_ID
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model_dir")
+    parser.add_argument("corpus", help="utf-8 text, one sentence per line")
+    parser.add_argument("--coverage", type=float, default=0.9999, help="token frequency mass to keep")
+    parser.add_argument("--eval-sentences", type=int, default=200)
+    args = parser.parse_args()
+
+    MODEL_DIR = args.model_dir
+    tokenizer = spm.SentencePieceProcessor(model_file=os.path.join(args.model_dir, "spiece.model"))
+    EOS_ID = tokenizer.eos_id()
+
+    counter, sentences = count_tokens(tokenizer, args.corpus)
+    kept = select_tokens(tokenizer, counter, args.coverage)
+    print(f"kept {len(kept)} / {tokenizer.get_piece_size()} tokens")
+
+    source = os.path.join(args.model_dir, "decoder_model.onnx")
+    target = os.path.join(args.model_dir, "decoder_model.pruned.onnx")
+    model = onnx.load(source)
+    prune_lm_head(model, kept)
+    onnx.save(model, target, save_as_external_data=model.ByteSize() > (1 << 30))
+    with open(os.path.join(args.model_dir, "decoder_model.pruned.vocab"), "w") as f:
+        f.writelines(f"{token}\n" for token in kept)
+
+    # score error for sentences whose tokens are all kept.
+    vocab_map = {token: i for i, token in enumerate(kept)}
+    in_vocab = [ids for ids in sentences if ids and all(t in vocab_map for t in ids)][:args.eval_sentences]
+    full = sentence_scores(ort.InferenceSession(source), in_vocab)
+    pruned = sentence_scores(ort.InferenceSession(target), in_vocab, vocab_map)
+    delta = np.abs(full - pruned)
+    print(f"in-vocabulary sentences: {len(in_vocab)}, score delta mean: {delta.mean():f}, max: {delta.max():f}")
+
+
+if __name__ == "__main__":
+    main()
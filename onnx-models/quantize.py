@@ -0,0 +1,73 @@
+# make INT8 variant of decoder_model.onnx for onnx-runtime-test / gptreranker.
+#
+#   python quantize.py rinna-gpt2-xsmall                      # dynamic, weights of MatMul / Gemm
+#   python quantize.py stockmark-neox-1.4b --static           # static, activations of MatMul too
+#
+# output is <model dir>/decoder_model.int8.onnx, it has the same input / output as fp32 model,
+# so the connector loads it as it is. check ranking agreement with ValidateModelVariant() in main.cpp.
+import argparse
+import os
+
+import numpy as np
+import sentencepiece as spm
+from onnxruntime.quantization import (CalibrationDataReader, QuantFormat, QuantType,
+                                      quant_pre_process, quantize_dynamic, quantize_static)
+
+# calibration text for static quantization, close to the candidates we rerank.
+CALIBRATION_TEXTS = [
+    "庭で犬を飼う",
+    "昨日から犬を買った",
+    "私の姉の名前は陽子です。先日、姉の葉子",
+    "私の姉の名前は陽子で、いとこの名前は葉子です。先日、いとこの陽子",
+    "登校時間が、いつもよりとても早い",
+    "彼の足は、いつもよりとても速い",
+    "昔々あるところに",
+    "本日はお日柄もよく",
+]
+
+
+class TextDataReader(CalibrationDataReader):
+    def __init__(self, model_dir):
+        tokenizer = spm.SentencePieceProcessor(model_file=os.path.join(model_dir, "spiece.model"))
+        self.inputs = iter([
+            {
+                "input_ids": np.array([ids], dtype=np.int64),
+                "attention_mask": np.ones((1, len(ids)), dtype=np.int64),
+            }
+            for ids in (tokenizer.encode(text) for text in CALIBRATION_TEXTS)
+        ])
+
+    def get_next(self):
+        return next(self.inputs, None)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("model_dir")
+    parser.add_argument("--static", action="store_true", help="quantize MatMul activations with calibration")
+    args = parser.parse_args()
+
+    source = os.path.join(args.model_dir, "decoder_model.onnx")
+    preprocessed = os.path.join(args.model_dir, "decoder_model.pre.onnx")
+    target = os.path.join(args.model_dir, "decoder_model.int8.onnx")
+
+    # large models (> 2GB) must keep weights in external data.
+    use_external_data = os.path.getsize(source) > (1 << 30) or os.path.exists(source + "_data")
+    quant_pre_process(source, preprocessed, skip_symbolic_shape=True, save_as_external_data=use_external_data)
+
+    if args.static:
+        quantize_static(preprocessed, target, TextDataReader(args.model_dir),
+                        quant_format=QuantFormat.QDQ, op_types_to_quantize=["MatMul"],
+                        per_channel=True, activation_type=QuantType.QUInt8, weight_type=QuantType.QInt8,
+                        use_external_data_format=use_external_data)
+    else:
+        quantize_dynamic(preprocessed, target, op_types_to_quantize=["MatMul", "Gemm"],
+                         per_channel=True, weight_type=QuantType.QInt8,
+                         use_external_data_format=use_external_data)
+
+    os.remove(preprocessed)
+    print(f"{source} ({os.path.getsize(source) >> 20}MB) -> {target} ({os.path.getsize(target) >> 20}MB)")
+
+
+if __name__ == "__main__":
+    main()
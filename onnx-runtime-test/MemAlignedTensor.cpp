@@ -3,6 +3,7 @@
 #include <cassert>
 #include <cfloat>
 #include <cstdint>
+#include <cstring>
 #include <exception>
 #include <tuple>
 #include "MemAlignedTensor.h"
@@ -10,6 +11,94 @@
 
 #pragma optimize("", on)
 
+namespace {
+	// loads logits as fp32, half precision logits are converted on the fly (F16C for fp16, shift for bf16).
+	struct Float32Loader {
+		using ElementType = float;
+		static __m256 Load8(const float* p) { return _mm256_loadu_ps(p); }
+		static float Load1(const float* p) { return *p; }
+	};
+
+	struct Float16Loader {
+		using ElementType = uint16_t;
+		static __m256 Load8(const uint16_t* p) { return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+		static float Load1(const uint16_t* p) { return _cvtsh_ss(*p); }
+	};
+
+	struct BFloat16Loader {
+		using ElementType = uint16_t;
+		static __m256 Load8(const uint16_t* p) {
+			const auto widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+			return _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16));
+		}
+		static float Load1(const uint16_t* p) {
+			const uint32_t bits = static_cast<uint32_t>(*p) << 16;
+			float value;
+			memcpy(&value, &bits, sizeof(value));
+			return value;
+		}
+	};
+
+	// same formula as the fp32 GetProbabilityInRange(), so scores differ only by rounding of the logits.
+	template <typename Loader>
+	float SoftmaxAt(const typename Loader::ElementType* row, int count, int tokenIndex) {
+		auto tmpSumVec = _mm256_setzero_ps();
+		for (auto i = 0; i < count; i += 32) {
+			const auto v1 = _mm256_exp_ps(Loader::Load8(row + i + 0));
+			const auto v2 = _mm256_exp_ps(Loader::Load8(row + i + 8));
+			const auto v3 = _mm256_exp_ps(Loader::Load8(row + i + 16));
+			const auto v4 = _mm256_exp_ps(Loader::Load8(row + i + 24));
+			tmpSumVec = _mm256_add_ps(tmpSumVec, _mm256_add_ps(_mm256_add_ps(v1, v2), _mm256_add_ps(v3, v4)));
+		}
+		return expf(Loader::Load1(row + tokenIndex)) / MemAlignedTensor::HorizontalAdd(tmpSumVec);
+	}
+
+	// argmax and its softmax probability, max is subtracted before exp.
+	template <typename Loader>
+	std::tuple<int64_t, float> ArgmaxSoftmax(const typename Loader::ElementType* row, int count) {
+		auto maxVec = _mm256_set1_ps(-FLT_MAX);
+		for (auto i = 0; i < count; i += 32) {
+			const auto max12 = _mm256_max_ps(Loader::Load8(row + i + 0), Loader::Load8(row + i + 8));
+			const auto max34 = _mm256_max_ps(Loader::Load8(row + i + 16), Loader::Load8(row + i + 24));
+			maxVec = _mm256_max_ps(maxVec, _mm256_max_ps(max12, max34));
+		}
+		const auto maxLogit = MemAlignedTensor::HorizontalMax(maxVec);
+
+		int maxIdx = 0;
+		while (maxIdx + 1 < count && Loader::Load1(row + maxIdx) != maxLogit) ++maxIdx;
+
+		const auto maxBroadcast = _mm256_set1_ps(maxLogit);
+		auto sumVec = _mm256_setzero_ps();
+		for (auto i = 0; i < count; i += 32) {
+			const auto v1 = _mm256_exp_ps(_mm256_sub_ps(Loader::Load8(row + i + 0), maxBroadcast));
+			const auto v2 = _mm256_exp_ps(_mm256_sub_ps(Loader::Load8(row + i + 8), maxBroadcast));
+			const auto v3 = _mm256_exp_ps(_mm256_sub_ps(Loader::Load8(row + i + 16), maxBroadcast));
+			const auto v4 = _mm256_exp_ps(_mm256_sub_ps(Loader::Load8(row + i + 24), maxBroadcast));
+			sumVec = _mm256_add_ps(sumVec, _mm256_add_ps(_mm256_add_ps(v1, v2), _mm256_add_ps(v3, v4)));
+		}
+		return std::make_tuple(static_cast<int64_t>(maxIdx), 1.0f / MemAlignedTensor::HorizontalAdd(sumVec));
+	}
+
+	// half precision has no gather instruction, allowed lists are short so they are read one by one.
+	template <typename Loader>
+	std::tuple<int64_t, float> MaskedArgmaxSoftmax(const typename Loader::ElementType* row, const int* allowedIds, int allowedCount) {
+		int maxIdx = 0;
+		auto maxLogit = Loader::Load1(row + allowedIds[0]);
+		for (int i = 1; i < allowedCount; ++i) {
+			const auto logit = Loader::Load1(row + allowedIds[i]);
+			if (maxLogit < logit) {
+				maxLogit = logit;
+				maxIdx = i;
+			}
+		}
+		float sumf = 0.0f;
+		for (int i = 0; i < allowedCount; ++i) {
+			sumf += expf(Loader::Load1(row + allowedIds[i]) - maxLogit);
+		}
+		return std::make_tuple(static_cast<int64_t>(allowedIds[maxIdx]), 1.0f / sumf);
+	}
+}
+
 void MemAlignedTensor::SubstractPosition(const MemAlignedTensor& wpe, int position) {
 	assert(wpe.m_column == m_column);
 	float* positionVector = wpe.m_body + wpe.m_column * position;
@@ -112,6 +201,10 @@ float MemAlignedTensor::GetProbability(int tokenIndex) {
 }
 
 float MemAlignedTensor::GetProbabilityInRange(int tokenIndex, int fromIdx, int toIdx) {
+	const auto halfRow = reinterpret_cast<const uint16_t*>(m_body) + fromIdx;
+	if (m_elementType == ElementType::Float16) return SoftmaxAt<Float16Loader>(halfRow, toIdx - fromIdx, tokenIndex);
+	if (m_elementType == ElementType::BFloat16) return SoftmaxAt<BFloat16Loader>(halfRow, toIdx - fromIdx, tokenIndex);
+
 	auto tmpSumVec = _mm256_setzero_ps();
 	for (auto i = fromIdx; i < toIdx; i += 32) {
 		const auto v1 = _mm256_exp_ps(*(reinterpret_cast<__m256*>(m_body + i + 0)));
@@ -128,6 +221,55 @@ float MemAlignedTensor::GetProbabilityInRange(int tokenIndex, int fromIdx, int t
 	return expf(m_body[fromIdx + tokenIndex]) / sumf;
 }
 
+// argmax and softmax over allowed token ids only, banned tokens are never read.
+// returned probability is normalized within the allowed set.
+std::tuple<int64_t, float> MemAlignedTensor::GetMaskedMaxInRange(const int* allowedIds, int allowedCount, int fromIdx) {
+	if (allowedCount <= 0) return std::make_tuple(-1LL, 0.0f);
+	const auto halfRow = reinterpret_cast<const uint16_t*>(m_body) + fromIdx;
+	if (m_elementType == ElementType::Float16) return MaskedArgmaxSoftmax<Float16Loader>(halfRow, allowedIds, allowedCount);
+	if (m_elementType == ElementType::BFloat16) return MaskedArgmaxSoftmax<BFloat16Loader>(halfRow, allowedIds, allowedCount);
+
+	const float* rowTop = m_body + fromIdx;
+
+	auto maxVec = _mm256_set1_ps(-FLT_MAX);
+	int i = 0;
+	for (; i + 8 <= allowedCount; i += 8) {
+		const auto idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(allowedIds + i));
+		maxVec = _mm256_max_ps(maxVec, _mm256_i32gather_ps(rowTop, idx, sizeof(float)));
+	}
+	auto maxLogit = HorizontalMax(maxVec);
+	for (; i < allowedCount; ++i) {
+		maxLogit = maxLogit < rowTop[allowedIds[i]] ? rowTop[allowedIds[i]] : maxLogit;
+	}
+
+	// bounded, a NaN logit never compares equal to the max.
+	int maxIdx = 0;
+	while (maxIdx + 1 < allowedCount && rowTop[allowedIds[maxIdx]] != maxLogit) ++maxIdx;
+
+	// subtract max before exp, allowed logits can be far from zero.
+	const auto maxBroadcast = _mm256_set1_ps(maxLogit);
+	auto sumVec = _mm256_setzero_ps();
+	i = 0;
+	for (; i + 8 <= allowedCount; i += 8) {
+		const auto idx = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(allowedIds + i));
+		const auto v = _mm256_i32gather_ps(rowTop, idx, sizeof(float));
+		sumVec = _mm256_add_ps(sumVec, _mm256_exp_ps(_mm256_sub_ps(v, maxBroadcast)));
+	}
+	auto sumf = HorizontalAdd(sumVec);
+	for (; i < allowedCount; ++i) {
+		sumf += expf(rowTop[allowedIds[i]] - maxLogit);
+	}
+
+	return std::make_tuple(static_cast<int64_t>(allowedIds[maxIdx]), 1.0f / sumf);
+}
+
+std::tuple<int64_t, float> MemAlignedTensor::GetMaxIndexInRange(int fromIdx, int toIdx) {
+	const auto halfRow = reinterpret_cast<const uint16_t*>(m_body) + fromIdx;
+	if (m_elementType == ElementType::Float16) return ArgmaxSoftmax<Float16Loader>(halfRow, toIdx - fromIdx);
+	if (m_elementType == ElementType::BFloat16) return ArgmaxSoftmax<BFloat16Loader>(halfRow, toIdx - fromIdx);
+	return ArgmaxSoftmax<Float32Loader>(m_body + fromIdx, toIdx - fromIdx);
+}
+
 float MemAlignedTensor::HorizontalMax(const __m256& x) {
 	const __m128 hiQuad = _mm256_extractf128_ps(x, 1);			// hiQuad = ( x7, x6, x5, x4 )
 	const __m128 loQuad = _mm256_castps256_ps128(x);        	// loQuad = ( x3, x2, x1, x0 )
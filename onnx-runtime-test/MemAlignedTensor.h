@@ -2,23 +2,33 @@
 #pragma once
 
 #include <immintrin.h>
+#include "pageAllocator.h"
 
 class MemAlignedTensor
 {
-private:
-	static constexpr uint32_t alignmentSize = 64;
-
 public:
+	// half precision logits are converted to fp32 on the fly in the readout kernels.
+	enum class ElementType { Float32, Float16, BFloat16 };
+	static constexpr size_t GetElementSize(ElementType elementType) {
+		return elementType == ElementType::Float32 ? sizeof(float) : sizeof(uint16_t);
+	}
+
 	MemAlignedTensor() = default;
 	MemAlignedTensor(const MemAlignedTensor&) = delete;
 	MemAlignedTensor(MemAlignedTensor&& src) noexcept {
-		m_row = src.m_row; m_column = src.m_column; m_body = src.m_body; src.m_body = nullptr;
+		m_row = src.m_row; m_column = src.m_column; m_elementType = src.m_elementType; m_body = src.m_body; m_capacity = src.m_capacity;
+		m_isPageAllocation = src.m_isPageAllocation;
+		src.m_body = nullptr; src.m_capacity = 0;
 	}
-	~MemAlignedTensor() { _aligned_free(m_body); }
+	~MemAlignedTensor() { PageAllocator::Free(m_body, m_isPageAllocation); }
 
 	MemAlignedTensor& operator = (const MemAlignedTensor&) = delete;
 	MemAlignedTensor& operator = (MemAlignedTensor&& src) noexcept {
-		m_row = src.m_row; m_column = src.m_column; m_body = src.m_body; src.m_body = nullptr;
+		if (this == &src) return *this;
+		PageAllocator::Free(m_body, m_isPageAllocation);
+		m_row = src.m_row; m_column = src.m_column; m_elementType = src.m_elementType; m_body = src.m_body; m_capacity = src.m_capacity;
+		m_isPageAllocation = src.m_isPageAllocation;
+		src.m_body = nullptr; src.m_capacity = 0;
 		return *this;
 	}
 
@@ -29,15 +39,28 @@ public:
 		return std::make_tuple(m_body, m_row, m_column);
 	}
 	float* Reserve(int64_t row, int64_t column) {
-		if ((row * column) != (m_row * m_column)) {
-			void* pv = _aligned_malloc(row * column * sizeof(float), alignmentSize);
-			if (pv == nullptr) throw std::bad_alloc();
-			_aligned_free(m_body);
+		return reinterpret_cast<float*>(ReserveAs(ElementType::Float32, row, column));
+	}
+	// heap buffers are reallocated for every size change. large page buffers (after PageAllocator::EnableLargePages())
+	// only grow, allocating them is too slow to repeat.
+	void* ReserveAs(ElementType elementType, int64_t row, int64_t column) {
+		const auto byteCount = static_cast<size_t>(row * column * GetElementSize(elementType));
+		if (m_body == nullptr || byteCount > m_capacity || (!m_isPageAllocation && byteCount != m_capacity)) {
+			bool isPageAllocation = false;
+			void* pv = PageAllocator::Allocate(byteCount, isPageAllocation);
+			PageAllocator::Free(m_body, m_isPageAllocation);
 			m_body = reinterpret_cast<float*>(pv);
+			m_capacity = byteCount;
+			m_isPageAllocation = isPageAllocation;
 		}
-		m_row = static_cast<int>(row); m_column = static_cast<int>(column);
+		m_row = static_cast<int>(row); m_column = static_cast<int>(column); m_elementType = elementType;
 		return m_body;
 	}
+	ElementType GetElementType() const { return m_elementType; }
+	// gives physical pages to a fresh buffer from the pool workers, so they are local to the node using them.
+	void TouchPages(ThreadPool& pool) {
+		PageAllocator::TouchPages(m_body, m_capacity, pool);
+	}
 	void Copy(int64_t row, int64_t column, const float* src) {
 		Reserve(row, column);
 		if (src != nullptr) {
@@ -51,6 +74,8 @@ public:
 	std::tuple<int64_t, float> GetIndexFromLogits();
 	float GetProbability(int tokenIndex);
 	float GetProbabilityInRange(int tokenIndex, int fromIdx, int toIdx);
+	std::tuple<int64_t, float> GetMaskedMaxInRange(const int* allowedIds, int allowedCount, int fromIdx);
+	std::tuple<int64_t, float> GetMaxIndexInRange(int fromIdx, int toIdx);
 	static void Subtract(float* tokenBody, const float* positionVector, int size);
 	static float InnerProduct(float* tokenBody, const float* wordEmbed, int size);
 	static float HorizontalMax(const __m256& x);
@@ -59,5 +84,8 @@ public:
 private:
 	int m_row = 0;
 	int m_column = 0;
-	float* m_body = nullptr;
+	ElementType m_elementType = ElementType::Float32;
+	float* m_body = nullptr; // uint16_t array when m_elementType is half precision
+	size_t m_capacity = 0;   // bytes allocated for m_body
+	bool m_isPageAllocation = false;
 };
@@ -0,0 +1,290 @@
+#define NOMINMAX
+#include <windows.h>
+#include "externalData.h"
+#include "miscUtils.h"
+#include "protobufReader.h"
+#include "threadPool.h"
+
+namespace {
+    // field numbers in onnx.proto
+    constexpr uint32_t c_modelGraph = 7;
+    constexpr uint32_t c_graphInitializer = 5;
+    constexpr uint32_t c_tensorDims = 1;
+    constexpr uint32_t c_tensorDataType = 2;
+    constexpr uint32_t c_tensorName = 8;
+    constexpr uint32_t c_tensorRawData = 9;
+    constexpr uint32_t c_tensorExternalData = 13;
+    constexpr uint32_t c_tensorDataLocation = 14;
+    constexpr uint32_t c_entryKey = 1;
+    constexpr uint32_t c_entryValue = 2;
+    constexpr uint64_t c_dataLocationExternal = 1;
+
+    struct ExternalInitializer {
+        std::string name;
+        std::vector<int64_t> dims;
+        ONNXTensorElementDataType dataType = ONNX_TENSOR_ELEMENT_DATA_TYPE_UNDEFINED;
+        std::string location;
+        size_t offset = 0;
+        bool isExternal = false;
+        std::string_view rawData; // points into the model file
+    };
+
+    size_t GetElementSize(ONNXTensorElementDataType dataType) {
+        switch (dataType) {
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT8:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT8:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_BOOL:
+            return 1;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT16:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT16:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_BFLOAT16:
+            return 2;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT32:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT32:
+            return 4;
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_INT64:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_UINT64:
+        case ONNX_TENSOR_ELEMENT_DATA_TYPE_DOUBLE:
+            return 8;
+        default:
+            throw std::runtime_error("unsupported external data type");
+        }
+    }
+
+    ExternalInitializer ReadInitializer(ProtobufReader tensor) {
+        ExternalInitializer result;
+        uint32_t fieldNumber, wireType;
+        while (tensor.Next(fieldNumber, wireType)) {
+            if (fieldNumber == c_tensorDims && wireType == ProtobufReader::c_varint) {
+                result.dims.push_back(static_cast<int64_t>(tensor.ReadVarint()));
+            } else if (fieldNumber == c_tensorDims && wireType == ProtobufReader::c_lengthDelimited) {
+                auto packed = tensor.ReadMessage();
+                while (!packed.IsEnd()) {
+                    result.dims.push_back(static_cast<int64_t>(packed.ReadVarint()));
+                }
+            } else if (fieldNumber == c_tensorDataType && wireType == ProtobufReader::c_varint) {
+                result.dataType = static_cast<ONNXTensorElementDataType>(tensor.ReadVarint());
+            } else if (fieldNumber == c_tensorName && wireType == ProtobufReader::c_lengthDelimited) {
+                result.name = tensor.ReadBytes();
+            } else if (fieldNumber == c_tensorRawData && wireType == ProtobufReader::c_lengthDelimited) {
+                result.rawData = tensor.ReadBytes();
+            } else if (fieldNumber == c_tensorExternalData && wireType == ProtobufReader::c_lengthDelimited) {
+                auto entry = tensor.ReadMessage();
+                std::string_view key, value;
+                while (entry.Next(fieldNumber, wireType)) {
+                    if (fieldNumber == c_entryKey) key = entry.ReadBytes();
+                    else if (fieldNumber == c_entryValue) value = entry.ReadBytes();
+                    else entry.Skip(wireType);
+                }
+                if (key == "location") result.location = value;
+                else if (key == "offset") result.offset = std::stoull(std::string(value));
+            } else if (fieldNumber == c_tensorDataLocation && wireType == ProtobufReader::c_varint) {
+                result.isExternal = tensor.ReadVarint() == c_dataLocationExternal;
+            } else {
+                tensor.Skip(wireType);
+            }
+        }
+        return result;
+    }
+
+    std::wstring GetDirectoryPart(std::wstring_view fileName) {
+        const auto separator = fileName.find_last_of(L"/\\");
+        return separator == std::wstring_view::npos ? std::wstring() : std::wstring(fileName.substr(0, separator + 1));
+    }
+
+    size_t GetByteCount(const ExternalInitializer& initializer) {
+        size_t elementCount = 1;
+        for (const auto dim : initializer.dims) elementCount *= static_cast<size_t>(dim);
+        return elementCount * GetElementSize(initializer.dataType);
+    }
+
+    // calls onInitializer for each initializer in the graph of a mapped model file.
+    template <typename Callback>
+    void ForEachInitializer(const MappedFile& modelFile, Callback&& onInitializer) {
+        ProtobufReader model(modelFile.GetData(), modelFile.GetSize());
+        uint32_t fieldNumber, wireType;
+        while (model.Next(fieldNumber, wireType)) {
+            if (fieldNumber != c_modelGraph || wireType != ProtobufReader::c_lengthDelimited) {
+                model.Skip(wireType);
+                continue;
+            }
+
+            auto graph = model.ReadMessage();
+            while (graph.Next(fieldNumber, wireType)) {
+                if (fieldNumber != c_graphInitializer || wireType != ProtobufReader::c_lengthDelimited) {
+                    graph.Skip(wireType);
+                    continue;
+                }
+                onInitializer(ReadInitializer(graph.ReadMessage()));
+            }
+        }
+    }
+
+    using DataFileList = std::vector<std::pair<std::wstring, std::unique_ptr<MappedFile>>>;
+
+    const MappedFile& GetDataFile(DataFileList& dataFiles, const std::wstring& fileName) {
+        for (const auto& [name, mappedFile] : dataFiles) {
+            if (name == fileName) return *mappedFile;
+        }
+        auto mappedFile = std::make_unique<MappedFile>();
+        mappedFile->Open(fileName);
+        dataFiles.emplace_back(fileName, std::move(mappedFile));
+        return *dataFiles.back().second;
+    }
+}
+
+void MappedFile::Open(std::wstring_view fileName) {
+    Close();
+
+    const auto file = CreateFileW(std::wstring(fileName).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+    if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("failed to open file");
+    m_file = file;
+
+    LARGE_INTEGER fileSize = {};
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) throw std::runtime_error("empty file");
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+
+    m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping == nullptr) throw std::runtime_error("failed to map file");
+
+    m_view = reinterpret_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (m_view == nullptr) throw std::runtime_error("failed to map file");
+}
+
+void MappedFile::Close() {
+    if (m_view != nullptr) UnmapViewOfFile(m_view);
+    if (m_mapping != nullptr) CloseHandle(m_mapping);
+    if (m_file != nullptr) CloseHandle(m_file);
+    m_view = nullptr;
+    m_mapping = nullptr;
+    m_file = nullptr;
+    m_size = 0;
+}
+
+void MappedFile::Prefetch(size_t offset, size_t length) const {
+    WIN32_MEMORY_RANGE_ENTRY range = { const_cast<uint8_t*>(m_view + offset), length };
+    (void)PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0); // only a hint
+}
+
+bool ExternalDataMapping::Load(std::wstring_view modelFileName, bool prefetch, const NumaNode* localNode) {
+    // model file stays mapped as the first data file, inline raw_data is used from there.
+    m_modelFileName = modelFileName;
+    const auto& modelFile = GetDataFile(m_dataFiles, m_modelFileName);
+    const auto modelDir = GetDirectoryPart(modelFileName);
+    const auto memoryInfo = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+
+    ForEachInitializer(modelFile, [&](const ExternalInitializer& initializer) {
+        // typed fields (float_data etc.) are only used for small constants, ORT loads them per session.
+        if (!initializer.isExternal && initializer.rawData.empty()) return;
+
+        const auto byteCount = GetByteCount(initializer);
+        const auto& dataFile = initializer.isExternal ? GetDataFile(m_dataFiles, modelDir + ToUtf16(initializer.location)) : modelFile;
+        const auto offset = initializer.isExternal ? initializer.offset : static_cast<size_t>(reinterpret_cast<const uint8_t*>(initializer.rawData.data()) - modelFile.GetData());
+        if (!initializer.isExternal && initializer.rawData.size() != byteCount) throw std::runtime_error("broken initializer");
+        if (offset + byteCount > dataFile.GetSize()) throw std::runtime_error("external data out of range");
+        if (prefetch) dataFile.Prefetch(offset, byteCount);
+
+        // ORT never writes into initializers, so read-only pages can be used as they are.
+        auto dataPtr = const_cast<uint8_t*>(dataFile.GetData() + offset);
+        if (localNode != nullptr) dataPtr = GetNodeCopy(dataFile, *localNode) + offset;
+        else if (PageAllocator::IsLargePageEnabled()) dataPtr = GetPageCopy(dataFile) + offset;
+        m_names.push_back(initializer.name);
+        m_values.emplace_back(Ort::Value::CreateTensor(memoryInfo, dataPtr, byteCount,
+            initializer.dims.data(), initializer.dims.size(), initializer.dataType));
+    });
+    return !m_names.empty();
+}
+
+// page cache of a mapped file is on whichever node read it first, so each NUMA replica takes its own copy.
+// the copy is made by the calling thread, which the replica keeps on the node (first touch).
+uint8_t* ExternalDataMapping::GetNodeCopy(const MappedFile& dataFile, const NumaNode& node) {
+    size_t index = 0;
+    while (m_dataFiles[index].second.get() != &dataFile) ++index;
+    if (index >= m_nodeCopies.size()) m_nodeCopies.resize(index + 1);
+
+    auto& nodeCopy = m_nodeCopies[index];
+    if (!nodeCopy) {
+        nodeCopy.reset(reinterpret_cast<uint8_t*>(NumaTopology::AllocateOnNode(dataFile.GetSize(), node)));
+        memcpy(nodeCopy.get(), dataFile.GetData(), dataFile.GetSize());
+    }
+    return nodeCopy.get();
+}
+
+// page cache of a mapping is always 4KB pages, with large pages enabled the data files are copied into them.
+// large pages are backed at allocation, so the copy can be spread over the shared pool.
+uint8_t* ExternalDataMapping::GetPageCopy(const MappedFile& dataFile) {
+    size_t index = 0;
+    while (m_dataFiles[index].second.get() != &dataFile) ++index;
+    if (index >= m_pageCopies.size()) m_pageCopies.resize(index + 1);
+
+    auto& pageCopy = m_pageCopies[index];
+    if (!pageCopy) {
+        pageCopy.reset(reinterpret_cast<uint8_t*>(PageAllocator::AllocatePages(dataFile.GetSize())));
+        PageAllocator::ParallelCopy(pageCopy.get(), dataFile.GetData(), dataFile.GetSize(), ThreadPool::GetShared());
+    }
+    return pageCopy.get();
+}
+
+// shared initializers rather than AddExternalInitializers(), only shared ones are put in a prepacked weights container.
+void ExternalDataMapping::AddTo(Ort::SessionOptions& sessionOptions) {
+    for (size_t i = 0; i < m_names.size(); ++i) {
+        sessionOptions.AddInitializer(m_names[i].c_str(), m_values[i]);
+    }
+}
+
+void ModelInitializers::Load(std::wstring_view modelFileName) {
+    // the model file stays mapped, inline raw_data is used from there.
+    m_tensors.clear();
+    m_dataFiles.clear();
+    m_pageCopy.reset();
+    m_modelFile.Open(modelFileName);
+    const auto modelDir = GetDirectoryPart(modelFileName);
+
+    ForEachInitializer(m_modelFile, [&](const ExternalInitializer& initializer) {
+        // typed fields (float_data etc.) are only used for small constants, they are not needed.
+        if (!initializer.isExternal && initializer.rawData.empty()) return;
+
+        Tensor tensor;
+        tensor.dims = initializer.dims;
+        tensor.dataType = initializer.dataType;
+
+        const auto byteCount = GetByteCount(initializer);
+        tensor.byteCount = byteCount;
+        if (initializer.isExternal) {
+            const auto& dataFile = GetDataFile(m_dataFiles, modelDir + ToUtf16(initializer.location));
+            if (initializer.offset + byteCount > dataFile.GetSize()) throw std::runtime_error("external data out of range");
+            tensor.data = dataFile.GetData() + initializer.offset;
+        } else {
+            if (initializer.rawData.size() != byteCount) throw std::runtime_error("broken initializer");
+            tensor.data = initializer.rawData.data();
+        }
+        m_tensors.emplace(initializer.name, std::move(tensor));
+    });
+    if (PageAllocator::IsLargePageEnabled()) CopyToPages();
+}
+
+void ModelInitializers::CopyToPages() {
+    const auto align = [](size_t byteCount) {
+        return (byteCount + PageAllocator::c_alignmentSize - 1) / PageAllocator::c_alignmentSize * PageAllocator::c_alignmentSize;
+    };
+    size_t totalCount = 0;
+    for (const auto& [name, tensor] : m_tensors) totalCount += align(tensor.byteCount);
+    if (totalCount == 0) return;
+
+    m_pageCopy.reset(reinterpret_cast<uint8_t*>(PageAllocator::AllocatePages(totalCount)));
+    auto top = m_pageCopy.get();
+    for (auto& [name, tensor] : m_tensors) {
+        PageAllocator::ParallelCopy(top, tensor.data, tensor.byteCount, ThreadPool::GetShared());
+        tensor.data = top;
+        top += align(tensor.byteCount);
+    }
+}
+
+const ModelInitializers::Tensor& ModelInitializers::Get(const std::string& name) const {
+    const auto it = m_tensors.find(name);
+    if (it == m_tensors.end()) throw std::runtime_error("initializer not found: " + name);
+    return it->second;
+}
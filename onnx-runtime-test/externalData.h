@@ -0,0 +1,91 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <onnxruntime_cxx_api.h>
+#include "numaTopology.h"
+#include "pageAllocator.h"
+
+// read-only file mapping, pages are shared with other processes mapping the same file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+    ~MappedFile() { Close(); }
+
+    void Open(std::wstring_view fileName);
+    void Close();
+    void Prefetch(size_t offset, size_t length) const;
+
+    const uint8_t* GetData() const { return m_view; }
+    size_t GetSize() const { return m_size; }
+
+private:
+    void* m_file = nullptr;
+    void* m_mapping = nullptr;
+    const uint8_t* m_view = nullptr;
+    size_t m_size = 0;
+};
+
+// initializers stored in onnx external data files and raw_data of inline ones, used directly from the file mappings.
+// AddTo() hands them to the session options as shared initializers, so ORT neither reads nor copies the weights,
+// and sessions of the same model given one PrepackedWeightsContainer also share the prepacked copies.
+// this object must outlive the sessions created with the options.
+class ExternalDataMapping
+{
+public:
+    // returns false when the model has no raw_data or external data initializer.
+    // with localNode, data files are copied into memory of that node instead of being used from the mapping.
+    // without localNode, they are copied into large pages when enabled, page cache of the mapping is always 4KB pages.
+    bool Load(std::wstring_view modelFileName, bool prefetch, const NumaNode* localNode = nullptr);
+    void AddTo(Ort::SessionOptions& sessionOptions);
+
+    size_t GetInitializerCount() const { return m_names.size(); }
+    bool IsLoaded(std::wstring_view modelFileName) const { return !m_modelFileName.empty() && m_modelFileName == modelFileName; }
+
+private:
+    uint8_t* GetNodeCopy(const MappedFile& dataFile, const NumaNode& node);
+    uint8_t* GetPageCopy(const MappedFile& dataFile);
+
+    struct NodeMemoryDeleter {
+        void operator()(uint8_t* memory) const { NumaTopology::FreeOnNode(memory); }
+    };
+
+    std::wstring m_modelFileName;
+    std::vector<std::pair<std::wstring, std::unique_ptr<MappedFile>>> m_dataFiles;
+    std::vector<std::unique_ptr<uint8_t, NodeMemoryDeleter>> m_nodeCopies; // same order as m_dataFiles
+    std::vector<std::unique_ptr<uint8_t, PageAllocator::PageDeleter>> m_pageCopies; // same order as m_dataFiles
+    std::vector<std::string> m_names;
+    std::vector<Ort::Value> m_values;
+};
+
+// every initializer of a model (inline raw_data and external data), viewed in place through file mappings.
+// used by the native engine, which reads the weights without ORT.
+// with large pages enabled, the weights are copied into one large page buffer instead.
+class ModelInitializers
+{
+public:
+    struct Tensor {
+        const void* data = nullptr;
+        size_t byteCount = 0;
+        std::vector<int64_t> dims;
+        ONNXTensorElementDataType dataType = ONNX_TENSOR_ELEMENT_DATA_TYPE_UNDEFINED;
+    };
+
+    void Load(std::wstring_view modelFileName);
+    bool Contains(const std::string& name) const { return m_tensors.count(name) != 0; }
+    // throws when the model has no such initializer.
+    const Tensor& Get(const std::string& name) const;
+
+private:
+    void CopyToPages();
+
+    MappedFile m_modelFile;
+    std::vector<std::pair<std::wstring, std::unique_ptr<MappedFile>>> m_dataFiles;
+    std::map<std::string, Tensor> m_tensors;
+    std::unique_ptr<uint8_t, PageAllocator::PageDeleter> m_pageCopy;
+};
@@ -0,0 +1,356 @@
+// built only with ONNX_TEST_NATIVE_ENGINE, see readme.md (native GPT-2 engine).
+#ifdef ONNX_TEST_NATIVE_ENGINE
+#define NOMINMAX
+#include <windows.h>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include "gpt2Engine.h"
+#include <immintrin.h>
+
+namespace {
+	constexpr float c_layerNormEpsilon = 1e-5f;
+	constexpr int c_defaultHeadSize = 64;
+	constexpr int c_lmHeadBlock = 128;	// vocabulary rows per block, stays in L2 while all token rows pass over it
+	constexpr size_t c_minCacheCapacity = 64;
+
+	enum class Epilogue { Bias, BiasGelu, BiasAccumulate };
+
+	// tanh approximation (gelu_new) used by GPT-2.
+	__m256 Gelu(const __m256 x) {
+		const auto x3 = _mm256_mul_ps(_mm256_mul_ps(x, x), x);
+		const auto inner = _mm256_mul_ps(_mm256_set1_ps(0.7978845608f), _mm256_fmadd_ps(_mm256_set1_ps(0.044715f), x3, x));
+		return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), x), _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_tanh_ps(inner)));
+	}
+
+	// RowCount rows x 16 columns, accumulators stay in registers over k.
+	template <int RowCount, Epilogue epilogue>
+	void GemmBlock(const float* a, int k, const float* w, const float* bias, int n, int column, float* out) {
+		__m256 acc[RowCount][2];
+		const auto bias0 = _mm256_loadu_ps(bias + column);
+		const auto bias1 = _mm256_loadu_ps(bias + column + 8);
+		for (int r = 0; r < RowCount; ++r) {
+			acc[r][0] = bias0;
+			acc[r][1] = bias1;
+		}
+		for (int i = 0; i < k; ++i) {
+			const auto weightRow = w + static_cast<size_t>(i) * n + column;
+			const auto w0 = _mm256_loadu_ps(weightRow);
+			const auto w1 = _mm256_loadu_ps(weightRow + 8);
+			for (int r = 0; r < RowCount; ++r) {
+				const auto x = _mm256_broadcast_ss(a + static_cast<size_t>(r) * k + i);
+				acc[r][0] = _mm256_fmadd_ps(x, w0, acc[r][0]);
+				acc[r][1] = _mm256_fmadd_ps(x, w1, acc[r][1]);
+			}
+		}
+		for (int r = 0; r < RowCount; ++r) {
+			auto outPtr = out + static_cast<size_t>(r) * n + column;
+			if constexpr (epilogue == Epilogue::BiasGelu) {
+				acc[r][0] = Gelu(acc[r][0]);
+				acc[r][1] = Gelu(acc[r][1]);
+			} else if constexpr (epilogue == Epilogue::BiasAccumulate) {
+				acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_loadu_ps(outPtr));
+				acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_loadu_ps(outPtr + 8));
+			}
+			_mm256_storeu_ps(outPtr, acc[r][0]);
+			_mm256_storeu_ps(outPtr + 8, acc[r][1]);
+		}
+	}
+
+	// out[rows, n] = a[rows, k] * w[k, n] + bias (gelu / residual add fused), n must be a multiple of 16.
+	// column strip of w is reused by all row blocks while it is in cache, a single row is a GEMV.
+	template <Epilogue epilogue>
+	void Gemm(const float* a, int rows, int k, const float* w, const float* bias, int n, float* out) {
+		for (int column = 0; column < n; column += 16) {
+			int row = 0;
+			for (; row + 4 <= rows; row += 4) {
+				GemmBlock<4, epilogue>(a + static_cast<size_t>(row) * k, k, w, bias, n, column, out + static_cast<size_t>(row) * n);
+			}
+			const auto rowA = a + static_cast<size_t>(row) * k;
+			const auto rowOut = out + static_cast<size_t>(row) * n;
+			switch (rows - row) {
+			case 3: GemmBlock<3, epilogue>(rowA, k, w, bias, n, column, rowOut); break;
+			case 2: GemmBlock<2, epilogue>(rowA, k, w, bias, n, column, rowOut); break;
+			case 1: GemmBlock<1, epilogue>(rowA, k, w, bias, n, column, rowOut); break;
+			}
+		}
+	}
+
+	template <int RowCount>
+	void DotBlock(const float* a, int k, const float* weightRow, int n, float* out) {
+		__m256 acc[RowCount];
+		for (int r = 0; r < RowCount; ++r) acc[r] = _mm256_setzero_ps();
+		for (int i = 0; i < k; i += 8) {
+			const auto wv = _mm256_loadu_ps(weightRow + i);
+			for (int r = 0; r < RowCount; ++r) {
+				acc[r] = _mm256_fmadd_ps(_mm256_loadu_ps(a + static_cast<size_t>(r) * k + i), wv, acc[r]);
+			}
+		}
+		for (int r = 0; r < RowCount; ++r) {
+			out[static_cast<size_t>(r) * n] = MemAlignedTensor::HorizontalAdd(acc[r]);
+		}
+	}
+
+	// out[rows, n] = a[rows, k] * w[n, k]^T for the tied LM head, k must be a multiple of 8.
+	void GemmTransposed(const float* a, int rows, int k, const float* w, int n, float* out) {
+		for (int blockTop = 0; blockTop < n; blockTop += c_lmHeadBlock) {
+			const auto blockEnd = std::min(n, blockTop + c_lmHeadBlock);
+			for (int row = 0; row < rows; row += 4) {
+				const auto rowA = a + static_cast<size_t>(row) * k;
+				const auto rowOut = out + static_cast<size_t>(row) * n;
+				for (int v = blockTop; v < blockEnd; ++v) {
+					const auto weightRow = w + static_cast<size_t>(v) * k;
+					switch (std::min(4, rows - row)) {
+					case 4: DotBlock<4>(rowA, k, weightRow, n, rowOut + v); break;
+					case 3: DotBlock<3>(rowA, k, weightRow, n, rowOut + v); break;
+					case 2: DotBlock<2>(rowA, k, weightRow, n, rowOut + v); break;
+					case 1: DotBlock<1>(rowA, k, weightRow, n, rowOut + v); break;
+					}
+				}
+			}
+		}
+	}
+
+	// statistics in one pass (sum and sum of squares), normalize and affine in the second.
+	void LayerNorm(const float* x, const float* gamma, const float* beta, int n, float* out) {
+		auto sumVec = _mm256_setzero_ps();
+		auto squareVec = _mm256_setzero_ps();
+		for (int i = 0; i < n; i += 8) {
+			const auto v = _mm256_loadu_ps(x + i);
+			sumVec = _mm256_add_ps(sumVec, v);
+			squareVec = _mm256_fmadd_ps(v, v, squareVec);
+		}
+		const auto mean = MemAlignedTensor::HorizontalAdd(sumVec) / n;
+		const auto variance = std::max(0.0f, MemAlignedTensor::HorizontalAdd(squareVec) / n - mean * mean);
+
+		const auto meanVec = _mm256_set1_ps(mean);
+		const auto scaleVec = _mm256_set1_ps(1.0f / sqrtf(variance + c_layerNormEpsilon));
+		for (int i = 0; i < n; i += 8) {
+			const auto normalized = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), meanVec), scaleVec);
+			_mm256_storeu_ps(out + i, _mm256_fmadd_ps(normalized, _mm256_loadu_ps(gamma + i), _mm256_loadu_ps(beta + i)));
+		}
+	}
+
+	float* GetData(MemAlignedTensor& tensor) {
+		return std::get<0>(tensor.GetBuffer());
+	}
+
+	std::wstring GetDirectoryPart(std::wstring_view fileName) {
+		const auto separator = fileName.find_last_of(L"/\\");
+		return separator == std::wstring_view::npos ? std::wstring() : std::wstring(fileName.substr(0, separator + 1));
+	}
+
+	// head count is not visible from the weights, "n_head" of config.json beside the model is used when present.
+	int ReadHeadCount(std::wstring_view modelFileName, int hiddenSize) {
+		std::ifstream file(GetDirectoryPart(modelFileName) + L"config.json");
+		const std::string config((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		const auto key = config.find("\"n_head\"");
+		if (key != std::string::npos) {
+			const auto colon = config.find(':', key);
+			if (colon != std::string::npos) return std::stoi(config.substr(colon + 1));
+		}
+		return hiddenSize / c_defaultHeadSize;
+	}
+}
+
+void Gpt2Engine::Load(std::wstring_view modelFileName) {
+	m_layers.clear();
+	m_initializers.Load(modelFileName);
+
+	// names of the transformers GPT2LMHeadModel export, lm_head is tied to wte.
+	const auto& tokenEmbedding = m_initializers.Get("transformer.wte.weight");
+	const auto& positionEmbedding = m_initializers.Get("transformer.wpe.weight");
+	if (tokenEmbedding.dims.size() != 2 || positionEmbedding.dims.size() != 2) throw std::runtime_error("unexpected embedding shape");
+	m_vocabularySize = static_cast<int>(tokenEmbedding.dims[0]);
+	m_hiddenSize = static_cast<int>(tokenEmbedding.dims[1]);
+	m_maxPositions = static_cast<int>(positionEmbedding.dims[0]);
+	m_headCount = ReadHeadCount(modelFileName, m_hiddenSize);
+
+	// kernels work on 16 columns (GEMM), 8 elements (head) and 32 logits (readout) at once.
+	if (m_hiddenSize % 16 != 0 || m_headCount <= 0 || m_hiddenSize % m_headCount != 0 ||
+		(m_hiddenSize / m_headCount) % 8 != 0 || m_vocabularySize % 32 != 0) {
+		throw std::runtime_error("unsupported model size");
+	}
+
+	const int64_t hidden = m_hiddenSize;
+	m_tokenEmbedding = GetWeight("transformer.wte.weight", { m_vocabularySize, hidden });
+	m_positionEmbedding = GetWeight("transformer.wpe.weight", { m_maxPositions, hidden });
+	m_finalLnWeight = GetWeight("transformer.ln_f.weight", { hidden });
+	m_finalLnBias = GetWeight("transformer.ln_f.bias", { hidden });
+
+	for (int i = 0; m_initializers.Contains("transformer.h." + std::to_string(i) + ".ln_1.weight"); ++i) {
+		const auto prefix = "transformer.h." + std::to_string(i) + ".";
+		Layer layer;
+		layer.ln1Weight = GetWeight(prefix + "ln_1.weight", { hidden });
+		layer.ln1Bias = GetWeight(prefix + "ln_1.bias", { hidden });
+		layer.attentionWeight = GetWeight(prefix + "attn.c_attn.weight", { hidden, 3 * hidden });
+		layer.attentionBias = GetWeight(prefix + "attn.c_attn.bias", { 3 * hidden });
+		layer.attentionProjWeight = GetWeight(prefix + "attn.c_proj.weight", { hidden, hidden });
+		layer.attentionProjBias = GetWeight(prefix + "attn.c_proj.bias", { hidden });
+		layer.ln2Weight = GetWeight(prefix + "ln_2.weight", { hidden });
+		layer.ln2Bias = GetWeight(prefix + "ln_2.bias", { hidden });
+		layer.fcWeight = GetWeight(prefix + "mlp.c_fc.weight", { hidden, 4 * hidden });
+		layer.fcBias = GetWeight(prefix + "mlp.c_fc.bias", { 4 * hidden });
+		layer.fcProjWeight = GetWeight(prefix + "mlp.c_proj.weight", { 4 * hidden, hidden });
+		layer.fcProjBias = GetWeight(prefix + "mlp.c_proj.bias", { hidden });
+		m_layers.push_back(layer);
+	}
+	if (m_layers.empty()) throw std::runtime_error("no transformer layer");
+
+	m_scores.Reserve(1, m_maxPositions);
+}
+
+const float* Gpt2Engine::GetWeight(const std::string& name, const std::vector<int64_t>& dims) const {
+	const auto& tensor = m_initializers.Get(name);
+	if (tensor.dataType != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT || tensor.dims != dims) {
+		throw std::runtime_error("unexpected weight: " + name);
+	}
+	return reinterpret_cast<const float*>(tensor.data);
+}
+
+void Gpt2Engine::EnsureCapacity(KvCache& cache, size_t length) const {
+	if (length <= cache.capacity) return;
+	if (length > static_cast<size_t>(m_maxPositions)) throw std::runtime_error("sequence is too long");
+
+	const auto capacity = std::min(static_cast<size_t>(m_maxPositions), std::max({ length, cache.capacity * 2, c_minCacheCapacity }));
+	cache.keys.resize(m_layers.size());
+	cache.values.resize(m_layers.size());
+	for (size_t i = 0; i < m_layers.size(); ++i) {
+		for (auto tensor : { &cache.keys[i], &cache.values[i] }) {
+			MemAlignedTensor grown;
+			auto grownData = grown.Reserve(capacity, m_hiddenSize);
+			if (cache.length > 0) memcpy(grownData, GetData(*tensor), cache.length * m_hiddenSize * sizeof(float));
+			*tensor = std::move(grown);
+		}
+	}
+	cache.capacity = capacity;
+}
+
+// causal attention of one token at position, keys / values up to position are in the cache.
+void Gpt2Engine::Attention(const float* qkv, KvCache& cache, size_t layerIndex, size_t position, float* out) {
+	const auto headSize = m_hiddenSize / m_headCount;
+	const auto scale = 1.0f / sqrtf(static_cast<float>(headSize));
+	const auto keys = GetData(cache.keys[layerIndex]);
+	const auto values = GetData(cache.values[layerIndex]);
+	const auto scores = GetData(m_scores);
+	const auto count = position + 1;
+
+	for (int head = 0; head < m_headCount; ++head) {
+		const auto headOffset = static_cast<size_t>(head) * headSize;
+		const auto query = qkv + headOffset;
+
+		auto maxScore = -FLT_MAX;
+		for (size_t j = 0; j < count; ++j) {
+			const auto key = keys + j * m_hiddenSize + headOffset;
+			auto acc = _mm256_setzero_ps();
+			for (int i = 0; i < headSize; i += 8) {
+				acc = _mm256_fmadd_ps(_mm256_loadu_ps(query + i), _mm256_loadu_ps(key + i), acc);
+			}
+			scores[j] = MemAlignedTensor::HorizontalAdd(acc) * scale;
+			maxScore = std::max(maxScore, scores[j]);
+		}
+
+		float sum = 0.0f;
+		for (size_t j = 0; j < count; ++j) {
+			scores[j] = expf(scores[j] - maxScore);
+			sum += scores[j];
+		}
+
+		const auto inverseSum = _mm256_set1_ps(1.0f / sum);
+		for (int i = 0; i < headSize; i += 8) {
+			auto acc = _mm256_setzero_ps();
+			for (size_t j = 0; j < count; ++j) {
+				acc = _mm256_fmadd_ps(_mm256_set1_ps(scores[j]), _mm256_loadu_ps(values + j * m_hiddenSize + headOffset + i), acc);
+			}
+			_mm256_storeu_ps(out + headOffset + i, _mm256_mul_ps(acc, inverseSum));
+		}
+	}
+}
+
+void Gpt2Engine::Forward(const std::vector<std::vector<int>>& newTokens, const std::vector<KvCache*>& caches,
+	bool lastTokenOnly, MemAlignedTensor& logits) {
+	// all new tokens of all sequences are packed into rows without padding, only attention is per sequence.
+	size_t rowCount = 0;
+	for (size_t s = 0; s < newTokens.size(); ++s) {
+		if (newTokens[s].empty()) throw std::runtime_error("empty sequence");
+		EnsureCapacity(*caches[s], caches[s]->length + newTokens[s].size());
+		rowCount += newTokens[s].size();
+	}
+	const auto rows = static_cast<int>(rowCount);
+	const auto hidden = static_cast<size_t>(m_hiddenSize);
+
+	auto hiddenData = m_hidden.Reserve(rows, m_hiddenSize);
+	size_t row = 0;
+	for (size_t s = 0; s < newTokens.size(); ++s) {
+		for (size_t t = 0; t < newTokens[s].size(); ++t, ++row) {
+			const auto token = newTokens[s][t];
+			if (token < 0 || token >= m_vocabularySize) throw std::runtime_error("token id out of range");
+			const auto tokenRow = m_tokenEmbedding + static_cast<size_t>(token) * hidden;
+			const auto positionRow = m_positionEmbedding + (caches[s]->length + t) * hidden;
+			for (size_t i = 0; i < hidden; i += 8) {
+				_mm256_storeu_ps(hiddenData + row * hidden + i, _mm256_add_ps(_mm256_loadu_ps(tokenRow + i), _mm256_loadu_ps(positionRow + i)));
+			}
+		}
+	}
+
+	auto normed = m_normed.Reserve(rows, m_hiddenSize);
+	auto qkv = m_qkv.Reserve(rows, 3 * m_hiddenSize);
+	auto attention = m_attention.Reserve(rows, m_hiddenSize);
+	auto mlp = m_mlp.Reserve(rows, 4 * m_hiddenSize);
+	for (size_t layerIndex = 0; layerIndex < m_layers.size(); ++layerIndex) {
+		const auto& layer = m_layers[layerIndex];
+
+		for (size_t r = 0; r < rowCount; ++r) {
+			LayerNorm(hiddenData + r * hidden, layer.ln1Weight, layer.ln1Bias, m_hiddenSize, normed + r * hidden);
+		}
+		Gemm<Epilogue::Bias>(normed, rows, m_hiddenSize, layer.attentionWeight, layer.attentionBias, 3 * m_hiddenSize, qkv);
+
+		// keys / values of the new tokens go into the cache first, then each token attends up to its own position.
+		row = 0;
+		for (size_t s = 0; s < newTokens.size(); ++s) {
+			auto& cache = *caches[s];
+			const auto keys = GetData(cache.keys[layerIndex]);
+			const auto values = GetData(cache.values[layerIndex]);
+			const auto tokenCount = newTokens[s].size();
+			for (size_t t = 0; t < tokenCount; ++t) {
+				const auto qkvRow = qkv + (row + t) * 3 * hidden;
+				memcpy(keys + (cache.length + t) * hidden, qkvRow + hidden, hidden * sizeof(float));
+				memcpy(values + (cache.length + t) * hidden, qkvRow + 2 * hidden, hidden * sizeof(float));
+			}
+			for (size_t t = 0; t < tokenCount; ++t) {
+				Attention(qkv + (row + t) * 3 * hidden, cache, layerIndex, cache.length + t, attention + (row + t) * hidden);
+			}
+			row += tokenCount;
+		}
+		Gemm<Epilogue::BiasAccumulate>(attention, rows, m_hiddenSize, layer.attentionProjWeight, layer.attentionProjBias, m_hiddenSize, hiddenData);
+
+		for (size_t r = 0; r < rowCount; ++r) {
+			LayerNorm(hiddenData + r * hidden, layer.ln2Weight, layer.ln2Bias, m_hiddenSize, normed + r * hidden);
+		}
+		Gemm<Epilogue::BiasGelu>(normed, rows, m_hiddenSize, layer.fcWeight, layer.fcBias, 4 * m_hiddenSize, mlp);
+		Gemm<Epilogue::BiasAccumulate>(mlp, rows, 4 * m_hiddenSize, layer.fcProjWeight, layer.fcProjBias, m_hiddenSize, hiddenData);
+	}
+	for (size_t s = 0; s < newTokens.size(); ++s) {
+		caches[s]->length += newTokens[s].size();
+	}
+
+	// final layer norm and LM head only on the rows which need logits.
+	int outputRows = 0;
+	row = 0;
+	for (size_t s = 0; s < newTokens.size(); ++s) {
+		const auto tokenCount = newTokens[s].size();
+		for (size_t t = lastTokenOnly ? tokenCount - 1 : 0; t < tokenCount; ++t) {
+			LayerNorm(hiddenData + (row + t) * hidden, m_finalLnWeight, m_finalLnBias, m_hiddenSize, normed + outputRows * hidden);
+			++outputRows;
+		}
+		row += tokenCount;
+	}
+	auto logitsData = logits.Reserve(outputRows, m_vocabularySize);
+	GemmTransposed(normed, outputRows, m_hiddenSize, m_tokenEmbedding, m_vocabularySize, logitsData);
+}
+
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include "externalData.h"
+#include "MemAlignedTensor.h"
+
+// GPT-2 decoder running on MemAlignedTensor, without ORT.
+// fp32 weights are read from the onnx initializers in place, for the small rinna gpt2 models (xsmall / small)
+// where per-op overhead of ORT dominates at batch 1-4.
+class Gpt2Engine
+{
+public:
+	// past keys / values of one sequence, [capacity, hidden] per layer. grows as tokens are added.
+	struct KvCache {
+		std::vector<MemAlignedTensor> keys;
+		std::vector<MemAlignedTensor> values;
+		size_t length = 0;
+		size_t capacity = 0;
+	};
+
+	void Load(std::wstring_view modelFileName);
+	bool IsLoaded() const { return m_layers.size() > 0; }
+	int GetVocabularySize() const { return m_vocabularySize; }
+
+	// runs new tokens of each sequence on top of its cache, caches are extended.
+	// logits rows are the new tokens in sequence order, or only the last new token of each sequence.
+	void Forward(const std::vector<std::vector<int>>& newTokens, const std::vector<KvCache*>& caches,
+		bool lastTokenOnly, MemAlignedTensor& logits);
+
+private:
+	struct Layer {
+		const float* ln1Weight;
+		const float* ln1Bias;
+		const float* attentionWeight;		// [hidden, 3 * hidden]
+		const float* attentionBias;
+		const float* attentionProjWeight;	// [hidden, hidden]
+		const float* attentionProjBias;
+		const float* ln2Weight;
+		const float* ln2Bias;
+		const float* fcWeight;				// [hidden, 4 * hidden]
+		const float* fcBias;
+		const float* fcProjWeight;			// [4 * hidden, hidden]
+		const float* fcProjBias;
+	};
+
+	const float* GetWeight(const std::string& name, const std::vector<int64_t>& dims) const;
+	void EnsureCapacity(KvCache& cache, size_t length) const;
+	void Attention(const float* qkv, KvCache& cache, size_t layerIndex, size_t position, float* out);
+
+	ModelInitializers m_initializers;
+	std::vector<Layer> m_layers;
+	const float* m_tokenEmbedding = nullptr;		// [vocabulary, hidden], also the LM head (tied)
+	const float* m_positionEmbedding = nullptr;		// [max positions, hidden]
+	const float* m_finalLnWeight = nullptr;
+	const float* m_finalLnBias = nullptr;
+	int m_vocabularySize = 0;
+	int m_hiddenSize = 0;
+	int m_headCount = 0;
+	int m_maxPositions = 0;
+
+	// work buffers, reused between calls
+	MemAlignedTensor m_hidden;
+	MemAlignedTensor m_normed;
+	MemAlignedTensor m_qkv;
+	MemAlignedTensor m_attention;
+	MemAlignedTensor m_mlp;
+	MemAlignedTensor m_scores;
+};
@@ -1,9 +1,21 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <psapi.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
 #include <iostream>
 #include <io.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include "tokenizer.h"
+#include "MemAlignedTensor.h"
+#include "modelCache.h"
 #include "onnxConnector.h"
+#include "tokenTrie.h"
 
 #pragma comment(lib, "onnxruntime.lib")
 
@@ -50,36 +62,112 @@ void TestLongPrediction(std::wstring_view sourceText) {
 	auto&& onnx = OnnxConnector::CreateInstance();
 	onnx->Initialize((modelDir + L"decoder_model.onnx").c_str());
 
-	std::wstring currentText(sourceText);
+	// get next 10 tokens by greedy algorithm, new text is printed as soon as each token arrives.
+	const auto startTime = std::chrono::steady_clock::now();
+	auto firstTokenTime = startTime;
+	auto streamDecoder = tokenizer->CreateStreamDecoder(false);
+
+	wprintf(L"%s", sourceText.data());
+	onnx->GenerateTokens(tokenizer->Encode64(sourceText), tokenizer->eos_id(), 10, [&](int64_t token, float) {
+		if (firstTokenTime == startTime) firstTokenTime = std::chrono::steady_clock::now();
+		wprintf(L"%s", streamDecoder->Push(token).c_str());
+		return true;
+	});
+	wprintf(L"%s", streamDecoder->Flush().c_str());
+
+	const auto endTime = std::chrono::steady_clock::now();
+	wprintf(L" (first token: %lldms, total: %lldms)\n",
+		std::chrono::duration_cast<std::chrono::milliseconds>(firstTokenTime - startTime).count(),
+		std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count());
+}
 
-	// get next 10 tokens by greedy algorithm.
-	for (int i = 0; i < 10; ++i) {
-		auto tokenVector = tokenizer->Encode64(currentText);
+void TestConstrainedPrediction(std::wstring_view sourceText, const std::vector<std::wstring>& phrases) {
+	wprintf(L"%s => ", sourceText.data());
 
-		auto [nextToken, nextProb] = onnx->GetPrediction(tokenVector);
+	auto&& tokenizer = Tokenizer::CreateInstance();
+	tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+	auto&& onnx = OnnxConnector::CreateInstance();
+	onnx->Initialize((modelDir + L"decoder_model.onnx").c_str());
 
+	TokenTrie trie;
+	trie.Build(*tokenizer, phrases, tokenizer->eos_id());
+
+	auto tokenVector = tokenizer->Encode64(sourceText);
+	const auto sourceTokenSize = tokenVector.size();
+
+	// walk the trie until the model chooses eos on a terminal node.
+	float phraseProb = 1.0f;
+	for (int node = TokenTrie::c_rootNode; node != TokenTrie::c_invalidNode;) {
+		const auto [allowedIds, allowedCount] = trie.GetAllowedTokens(node);
+		auto [nextToken, nextProb] = onnx->GetConstrainedPrediction(tokenVector, allowedIds, allowedCount);
+		if (nextToken < 0 || nextToken == tokenizer->eos_id()) break;
+
+		phraseProb *= nextProb;
 		tokenVector.push_back(nextToken);
-		currentText = tokenizer->Decode(&tokenVector[0], tokenVector.size());
+		node = trie.Next(node, static_cast<int>(nextToken));
 	}
 
-	wprintf(L"%s\n", currentText.c_str());
+	const auto phraseText = tokenizer->Decode(&tokenVector[sourceTokenSize], tokenVector.size() - sourceTokenSize);
+	wprintf(L"%s (%f)\n", phraseText.c_str(), phraseProb);
 }
 
-void CompareSentences(const std::vector<const wchar_t*> sentences) {
-	auto&& tokenizer = Tokenizer::CreateInstance();
-	tokenizer->Load((modelDir + L"spiece.model").c_str());
-
+// candidate sets used by CompareSentences() and the model variant validation.
+const std::vector<std::vector<const wchar_t*>> c_compareTestSets = {
+	{
+		L"庭で犬を飼う",
+		L"庭で犬を買う",
+		L"庭で犬をかう",
+	},
+	{
+		L"昨日犬を買った",
+		L"昨日犬を飼った",
+		L"昨日犬をかった",
+		L"昨日犬を勝った",
+	},
+	{
+		L"昨日から犬を買った",
+		L"昨日から犬を飼った",
+		L"昨日から犬をかった",
+		L"昨日から犬を勝った",
+	},
+	{
+		L"私の姉の名前は陽子です。先日、姉の陽子",
+		L"私の姉の名前は陽子です。先日、姉の葉子",
+		L"私の姉の名前は陽子です。先日、姉の洋子",
+	},
+	{
+		L"私の姉の名前は葉子です。先日、姉の陽子",
+		L"私の姉の名前は葉子です。先日、姉の葉子",
+		L"私の姉の名前は葉子です。先日、姉の洋子",
+	},
+	{
+		L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、姉の陽子",
+		L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、姉の葉子",
+	},
+	{
+		L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、いとこの陽子",
+		L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、いとこの葉子",
+	},
+};
+
+std::shared_ptr<OnnxConnector> GetCompareConnector() {
 	static std::shared_ptr<OnnxConnector> onnx;
 	if (!onnx) {
 		onnx = OnnxConnector::CreateInstance();
 		onnx->Initialize((modelDir + L"decoder_model.onnx").c_str());
+		onnx->SetShapeBuckets({ { 2, 16 }, { 3, 16 }, { 4, 16 }, { 3, 32 } });
 	}
+	return onnx;
+}
 
-	std::vector<std::vector<int>> tokensList;
-	for (const auto sentence : sentences) {
-		auto&& encodedSentence = tokenizer->Encode(sentence);
-		tokensList.emplace_back(encodedSentence);
-	}
+void CompareSentences(const std::vector<const wchar_t*> sentences) {
+	auto&& tokenizer = Tokenizer::CreateInstance();
+	tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+	auto&& onnx = GetCompareConnector();
+
+	const auto& tokensList = tokenizer->EncodeBatch(sentences);
 
 	const auto& resultMatrix = onnx->CompareSentences(tokensList, tokenizer->eos_id());
 
@@ -98,6 +186,265 @@ void CompareSentences(const std::vector<const wchar_t*> sentences) {
 	}
 }
 
+std::vector<float> GetSentenceScores(OnnxConnector& onnx, Tokenizer& tokenizer, const std::vector<const wchar_t*>& sentences) {
+	const auto& tokensList = tokenizer.EncodeBatch(sentences);
+
+	std::vector<float> scores;
+	for (const auto& probList : onnx.CompareSentences(tokensList, tokenizer.eos_id())) {
+		float logProb = 0.0f;
+		for (const auto prob : probList) logProb += logf(prob);
+		scores.push_back(logProb);
+	}
+	return scores;
+}
+
+// compares a model variant (quantized, pruned vocabulary etc.) with the fp32 model on c_compareTestSets.
+// top-1 agreement is the ratio of sets where both models choose the same best candidate.
+void ValidateModelVariant(std::wstring_view variantModelFileName) {
+	auto&& tokenizer = Tokenizer::CreateInstance();
+	tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+	auto&& reference = GetCompareConnector();
+	auto&& variant = OnnxConnector::CreateInstance();
+	variant->Initialize((modelDir + variantModelFileName.data()).c_str());
+
+	size_t agreedCount = 0;
+	size_t scoreCount = 0;
+	float sumDelta = 0.0f;
+	float maxDelta = 0.0f;
+	for (const auto& testSet : c_compareTestSets) {
+		const auto& referenceScores = GetSentenceScores(*reference, *tokenizer, testSet);
+		const auto& variantScores = GetSentenceScores(*variant, *tokenizer, testSet);
+		if (referenceScores.size() != testSet.size() || variantScores.size() != testSet.size()) {
+			wprintf(L"%s: failed to score\n", testSet[0]);
+			continue;
+		}
+
+		const auto referenceBest = std::max_element(referenceScores.begin(), referenceScores.end()) - referenceScores.begin();
+		const auto variantBest = std::max_element(variantScores.begin(), variantScores.end()) - variantScores.begin();
+		agreedCount += referenceBest == variantBest ? 1 : 0;
+
+		for (size_t i = 0; i < testSet.size(); ++i) {
+			const auto delta = fabsf(referenceScores[i] - variantScores[i]);
+			wprintf(L"%s: %f, %f (%f)\n", testSet[i], referenceScores[i], variantScores[i], delta);
+			sumDelta += delta;
+			maxDelta = std::max(maxDelta, delta);
+			++scoreCount;
+		}
+	}
+
+	wprintf(L"top-1 agreement: %zu/%zu, score delta mean: %f, max: %f\n",
+		agreedCount, c_compareTestSets.size(), scoreCount > 0 ? sumDelta / scoreCount : 0.0f, maxDelta);
+}
+
+// time to the first score without the optimized model cache (graph optimization + writing the cache), then with it.
+// the second start finds the model files in the OS file cache, run it on a fresh process too for a cold disk.
+void TestColdStart() {
+	const auto modelFileName = modelDir + L"decoder_model.onnx";
+	OptimizedModelCache::RemoveStaleCaches(modelFileName, L"");
+
+	for (const auto caseName : { L"without cache", L"with cache" }) {
+		const auto startTime = std::chrono::steady_clock::now();
+
+		auto&& tokenizer = Tokenizer::CreateInstance();
+		tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+		auto&& onnx = OnnxConnector::CreateInstance();
+		onnx->Initialize(modelFileName.c_str());
+
+		const std::vector<std::vector<int>> tokensList = { tokenizer->Encode(L"庭で犬を飼う"), tokenizer->Encode(L"庭で犬を買う") };
+		onnx->CompareSentences(tokensList, tokenizer->eos_id());
+
+		const auto endTime = std::chrono::steady_clock::now();
+		wprintf(L"%s: %lldms to first score\n", caseName, std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime).count());
+	}
+}
+
+// private memory added by each connector of the same model, weights and prepacked weights are shared after the first.
+void TestSharedWeights() {
+	constexpr int connectorCount = 4;
+
+	auto&& tokenizer = Tokenizer::CreateInstance();
+	tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+	const auto getPrivateBytes = []() {
+		PROCESS_MEMORY_COUNTERS_EX counters = {};
+		GetProcessMemoryInfo(GetCurrentProcess(), reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters), sizeof(counters));
+		return static_cast<long long>(counters.PrivateUsage);
+	};
+
+	std::vector<std::shared_ptr<OnnxConnector>> connectors;
+	for (int i = 0; i < connectorCount; ++i) {
+		const auto privateBytes = getPrivateBytes();
+		auto&& onnx = OnnxConnector::CreateInstance();
+		onnx->Initialize((modelDir + L"decoder_model.onnx").c_str());
+		const auto& scores = GetSentenceScores(*onnx, *tokenizer, c_compareTestSets[0]);
+		connectors.push_back(onnx);
+		wprintf(L"connector %d: +%lldMB, score %f\n", i, (getPrivateBytes() - privateBytes) / (1024 * 1024), scores.empty() ? 0.0f : scores[0]);
+	}
+	wprintf(L"%s", connectors.back()->GetStatistics().c_str());
+}
+
+// readout kernel timings on a [64, 32000] logits buffer, for each logits element type and page size.
+void BenchmarkKernels() {
+	constexpr int rowCount = 64;
+	constexpr int columnCount = 32000;
+	constexpr int repeatCount = 20;
+
+	std::mt19937 random(0);
+	std::normal_distribution<float> distribution(0.0f, 3.0f);
+	std::vector<float> source(rowCount * columnCount);
+	for (auto& x : source) x = distribution(random);
+
+	const std::tuple<MemAlignedTensor::ElementType, const wchar_t*> elementTypes[] = {
+		{ MemAlignedTensor::ElementType::Float32, L"fp32" },
+		{ MemAlignedTensor::ElementType::Float16, L"fp16" },
+		{ MemAlignedTensor::ElementType::BFloat16, L"bf16" },
+	};
+	// 4KB pages first, then 2MB pages when the account may lock pages in memory.
+	for (const auto useLargePages : { false, true }) {
+		if (useLargePages && !PageAllocator::EnableLargePages()) {
+			wprintf(L"large pages are not available\n");
+			break;
+		}
+		const auto pageName = useLargePages ? L"large pages" : L"4KB pages";
+		for (const auto& [elementType, typeName] : elementTypes) {
+			MemAlignedTensor logits;
+			auto buffer = logits.ReserveAs(elementType, rowCount, columnCount);
+			for (size_t i = 0; i < source.size(); ++i) {
+				if (elementType == MemAlignedTensor::ElementType::Float32) {
+					reinterpret_cast<float*>(buffer)[i] = source[i];
+				} else if (elementType == MemAlignedTensor::ElementType::Float16) {
+					reinterpret_cast<uint16_t*>(buffer)[i] = _cvtss_sh(source[i], 0);
+				} else {
+					uint32_t bits;
+					memcpy(&bits, &source[i], sizeof(bits));
+					reinterpret_cast<uint16_t*>(buffer)[i] = static_cast<uint16_t>(bits >> 16);
+				}
+			}
+
+			float checksum = 0.0f;
+			const auto startTime = std::chrono::steady_clock::now();
+			for (int repeat = 0; repeat < repeatCount; ++repeat) {
+				for (int row = 0; row < rowCount; ++row) {
+					checksum += logits.GetProbabilityInRange(row, row * columnCount, (row + 1) * columnCount);
+				}
+			}
+			const auto probabilityTime = std::chrono::steady_clock::now();
+			for (int repeat = 0; repeat < repeatCount; ++repeat) {
+				for (int row = 0; row < rowCount; ++row) {
+					checksum += std::get<1>(logits.GetMaxIndexInRange(row * columnCount, (row + 1) * columnCount));
+				}
+			}
+			const auto endTime = std::chrono::steady_clock::now();
+
+			const auto perRow = [](auto duration) {
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count() / (repeatCount * rowCount);
+			};
+			wprintf(L"%s %s: probability %lldns/row, argmax %lldns/row (%f)\n", pageName, typeName,
+				perRow(probabilityTime - startTime), perRow(endTime - probabilityTime), checksum);
+		}
+	}
+}
+
+#ifdef ONNX_TEST_NATIVE_ENGINE
+// scores and small-batch latency of the built-in GPT-2 engine against the ORT connector (set modelDir to a gpt2 model).
+void CompareNativeEngine() {
+	constexpr int repeatCount = 10;
+
+	auto&& tokenizer = Tokenizer::CreateInstance();
+	tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+	const std::tuple<std::shared_ptr<OnnxConnector>, const wchar_t*> connectors[] = {
+		{ OnnxConnector::CreateInstance(), L"ort" },
+		{ OnnxConnector::CreateNativeInstance(), L"native" },
+	};
+	std::vector<std::vector<float>> scoreSets[2];
+	for (size_t i = 0; i < 2; ++i) {
+		const auto& [connector, name] = connectors[i];
+		connector->Initialize((modelDir + L"decoder_model.onnx").c_str());
+		GetSentenceScores(*connector, *tokenizer, c_compareTestSets[0]); // load and warm up
+
+		const auto startTime = std::chrono::steady_clock::now();
+		for (int repeat = 0; repeat < repeatCount; ++repeat) {
+			scoreSets[i].clear();
+			for (const auto& testSet : c_compareTestSets) {
+				scoreSets[i].emplace_back(GetSentenceScores(*connector, *tokenizer, testSet));
+			}
+		}
+		const auto elapsed = std::chrono::steady_clock::now() - startTime;
+		wprintf(L"%s: %lldus/set\n", name,
+			std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / (repeatCount * static_cast<long long>(c_compareTestSets.size())));
+	}
+
+	float maxDelta = 0.0f;
+	for (size_t setIndex = 0; setIndex < c_compareTestSets.size(); ++setIndex) {
+		const auto& ortScores = scoreSets[0][setIndex];
+		const auto& nativeScores = scoreSets[1][setIndex];
+		for (size_t i = 0; i < ortScores.size() && i < nativeScores.size(); ++i) {
+			maxDelta = std::max(maxDelta, fabsf(ortScores[i] - nativeScores[i]));
+		}
+	}
+	wprintf(L"score delta max: %f\n", maxDelta);
+}
+#endif
+
+// concurrent scoring on one replica per NUMA node against a single connector.
+// set ONNX_TEST_SIMULATE_NUMA=2 to split a single-node machine into two nodes.
+void TestNumaReplicas() {
+	constexpr int repeatCount = 10;
+
+	auto&& tokenizer = Tokenizer::CreateInstance();
+	tokenizer->Load((modelDir + L"spiece.model").c_str());
+
+	const auto& nodes = NumaTopology::GetNodes();
+	for (const auto& node : nodes) {
+		wprintf(L"node %d: %d processors%s\n", node.nodeNumber, NumaTopology::GetProcessorCount(node), node.isSimulated ? L" (simulated)" : L"");
+	}
+
+	const std::tuple<std::shared_ptr<OnnxConnector>, const wchar_t*> connectors[] = {
+		{ OnnxConnector::CreateInstance(), L"single" },
+		{ OnnxConnector::CreateNumaRouter([]() { return OnnxConnector::CreateInstance(); }, nodes), L"replicas" },
+	};
+	std::vector<std::vector<float>> scoreSets[2];
+	for (size_t i = 0; i < 2; ++i) {
+		const auto& [connector, name] = connectors[i];
+		connector->Initialize((modelDir + L"decoder_model.onnx").c_str());
+		for (const auto& testSet : c_compareTestSets) {
+			scoreSets[i].emplace_back(GetSentenceScores(*connector, *tokenizer, testSet)); // load and warm up
+		}
+
+		// one caller per node, each scores every set repeatCount times. the single connector takes one request at a time.
+		std::mutex singleMutex;
+		const auto startTime = std::chrono::steady_clock::now();
+		std::vector<std::thread> callers;
+		for (size_t caller = 0; caller < nodes.size(); ++caller) {
+			callers.emplace_back([&, isSingle = i == 0]() {
+				for (int repeat = 0; repeat < repeatCount; ++repeat) {
+					for (const auto& testSet : c_compareTestSets) {
+						std::unique_lock<std::mutex> lock(singleMutex, std::defer_lock);
+						if (isSingle) lock.lock();
+						GetSentenceScores(*connector, *tokenizer, testSet);
+					}
+				}
+			});
+		}
+		for (auto& caller : callers) caller.join();
+		const auto elapsed = std::chrono::steady_clock::now() - startTime;
+		wprintf(L"%s: %lldus/set\n", name, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() /
+			(repeatCount * static_cast<long long>(c_compareTestSets.size() * nodes.size())));
+	}
+	wprintf(L"%s", std::get<0>(connectors[1])->GetStatistics().c_str());
+
+	float maxDelta = 0.0f;
+	for (size_t setIndex = 0; setIndex < c_compareTestSets.size(); ++setIndex) {
+		for (size_t i = 0; i < scoreSets[0][setIndex].size() && i < scoreSets[1][setIndex].size(); ++i) {
+			maxDelta = std::max(maxDelta, fabsf(scoreSets[0][setIndex][i] - scoreSets[1][setIndex][i]));
+		}
+	}
+	wprintf(L"score delta max: %f\n", maxDelta);
+}
+
 int main()
 {
 	(void)_setmode(_fileno(stdout), _O_U16TEXT);
@@ -108,53 +455,41 @@ int main()
 #if 0
 	TestOnnxModel();
 #endif
+#if 0
+	TestColdStart();
+#endif
+#if 0
+	TestSharedWeights();
+#endif
+#if 0
+	BenchmarkKernels();
+#endif
+#if 0
+	CompareNativeEngine();
+#endif
+#if 0
+	TestNumaReplicas();
+#endif
+#if 0
+	ValidateModelVariant(L"decoder_model.int8.onnx");
+#endif
+#if 0
+	ValidateModelVariant(L"decoder_model.pruned.onnx");
+#endif
+#if 0
+	TestConstrainedPrediction(L"私の姉の名前は", { L"陽子", L"葉子", L"洋子" });
+#endif
 #if 0
 	TestLongPrediction(L"昔々あるところに");
 	TestLongPrediction(L"このたびは誠に");
 	TestLongPrediction(L"本日はお日柄もよく");
 #endif
 
-	CompareSentences({
-			L"庭で犬を飼う",
-			L"庭で犬を買う",
-			L"庭で犬をかう"
-		});
-
-	CompareSentences({
-			L"昨日犬を買った",
-			L"昨日犬を飼った",
-			L"昨日犬をかった",
-			L"昨日犬を勝った",
-		});
-
-	CompareSentences({
-			L"昨日から犬を買った",
-			L"昨日から犬を飼った",
-			L"昨日から犬をかった",
-			L"昨日から犬を勝った",
-		});
-
-	CompareSentences({
-			L"私の姉の名前は陽子です。先日、姉の陽子",
-			L"私の姉の名前は陽子です。先日、姉の葉子",
-			L"私の姉の名前は陽子です。先日、姉の洋子",
-		});
-
-	CompareSentences({
-			L"私の姉の名前は葉子です。先日、姉の陽子",
-			L"私の姉の名前は葉子です。先日、姉の葉子",
-			L"私の姉の名前は葉子です。先日、姉の洋子",
-		});
-
-	CompareSentences({
-			L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、姉の陽子",
-			L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、姉の葉子",
-		});
-
-	CompareSentences({
-			L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、いとこの陽子",
-			L"私の姉の名前は陽子で、いとこの名前は葉子です。先日、いとこの葉子",
-		});
+	for (const auto& testSet : c_compareTestSets) {
+		CompareSentences(testSet);
+	}
+
+	wprintf(L"%s", GetCompareConnector()->GetStatistics().c_str());
 
 	return 0;
 }
\ No newline at end of file
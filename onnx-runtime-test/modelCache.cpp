@@ -0,0 +1,124 @@
+#define NOMINMAX
+#include <windows.h>
+#include <intrin.h>
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <onnxruntime_cxx_api.h>
+#include "modelCache.h"
+
+namespace {
+    constexpr uint64_t c_fnvOffsetBasis = 14695981039346656037ULL;
+    constexpr uint64_t c_fnvPrime = 1099511628211ULL;
+    constexpr size_t c_sampleSize = 1024 * 1024;
+    const std::wstring c_cacheInfix = L".opt-";
+
+    uint64_t HashBytes(uint64_t hash, const void* data, size_t size) {
+        const auto bytes = reinterpret_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * c_fnvPrime;
+        }
+        return hash;
+    }
+
+    // file size, last write time and the head and tail of the file are hashed.
+    // hashing the whole file costs as much as the loading we want to skip.
+    uint64_t HashModelFile(std::wstring_view modelFileName, uint64_t hash) {
+        const auto file = CreateFileW(std::wstring(modelFileName).c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("failed to open model");
+
+        LARGE_INTEGER fileSize = {};
+        FILETIME lastWriteTime = {};
+        GetFileSizeEx(file, &fileSize);
+        GetFileTime(file, nullptr, nullptr, &lastWriteTime);
+        hash = HashBytes(hash, &fileSize, sizeof(fileSize));
+        hash = HashBytes(hash, &lastWriteTime, sizeof(lastWriteTime));
+
+        std::vector<uint8_t> sample(c_sampleSize);
+        for (const auto offset : { 0LL, std::max(0LL, fileSize.QuadPart - static_cast<LONGLONG>(c_sampleSize)) }) {
+            LARGE_INTEGER position = {};
+            position.QuadPart = offset;
+            DWORD readSize = 0;
+            if (SetFilePointerEx(file, position, nullptr, FILE_BEGIN) &&
+                ReadFile(file, sample.data(), static_cast<DWORD>(sample.size()), &readSize, nullptr)) {
+                hash = HashBytes(hash, sample.data(), readSize);
+            }
+        }
+        CloseHandle(file);
+        return hash;
+    }
+
+    // size and last write time only, for a file which may not exist.
+    uint64_t HashFileStamp(std::wstring_view fileName, uint64_t hash) {
+        WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+        if (!GetFileAttributesExW(std::wstring(fileName).c_str(), GetFileExInfoStandard, &attributes)) return hash;
+        hash = HashBytes(hash, &attributes.nFileSizeHigh, sizeof(attributes.nFileSizeHigh));
+        hash = HashBytes(hash, &attributes.nFileSizeLow, sizeof(attributes.nFileSizeLow));
+        hash = HashBytes(hash, &attributes.ftLastWriteTime, sizeof(attributes.ftLastWriteTime));
+        return hash;
+    }
+
+    // optimized graph depends on the kernels ORT selects for this CPU.
+    uint64_t HashCpuFeatures(uint64_t hash) {
+        std::array<int, 4> leaf1 = {}, leaf7 = {};
+        __cpuid(leaf1.data(), 1);
+        __cpuidex(leaf7.data(), 7, 0);
+        hash = HashBytes(hash, leaf1.data() + 2, sizeof(int) * 2); // ecx, edx
+        hash = HashBytes(hash, leaf7.data() + 1, sizeof(int) * 3); // ebx, ecx, edx
+        return hash;
+    }
+
+    std::wstring GetStem(std::wstring_view modelFileName) {
+        const auto dot = modelFileName.find_last_of(L'.');
+        const auto separator = modelFileName.find_last_of(L"/\\");
+        if (dot == std::wstring_view::npos || (separator != std::wstring_view::npos && dot < separator)) {
+            return std::wstring(modelFileName);
+        }
+        return std::wstring(modelFileName.substr(0, dot));
+    }
+
+    std::wstring GetDirectoryPart(std::wstring_view fileName) {
+        const auto separator = fileName.find_last_of(L"/\\");
+        return separator == std::wstring_view::npos ? std::wstring() : std::wstring(fileName.substr(0, separator + 1));
+    }
+}
+
+std::wstring OptimizedModelCache::GetCacheFileName(std::wstring_view modelFileName) {
+    auto hash = HashModelFile(modelFileName, c_fnvOffsetBasis);
+    // weights of large models are in <model>.onnx_data, which can be replaced without touching the graph file.
+    hash = HashFileStamp(std::wstring(modelFileName) + L"_data", hash);
+
+    const std::string ortVersion = Ort::GetVersionString();
+    hash = HashBytes(hash, ortVersion.data(), ortVersion.size());
+    hash = HashCpuFeatures(hash);
+
+    wchar_t keyText[17] = {};
+    swprintf_s(keyText, L"%016llx", hash);
+    return GetStem(modelFileName) + c_cacheInfix + keyText + L".onnx";
+}
+
+std::wstring OptimizedModelCache::GetExternalDataFileName(std::wstring_view cacheFileName) {
+    return std::wstring(cacheFileName) + L"_data";
+}
+
+bool OptimizedModelCache::Exists(std::wstring_view cacheFileName) {
+    const auto attributes = GetFileAttributesW(std::wstring(cacheFileName).c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+}
+
+void OptimizedModelCache::RemoveStaleCaches(std::wstring_view modelFileName, std::wstring_view keepFileName) {
+    const auto directory = GetDirectoryPart(modelFileName);
+    const auto pattern = GetStem(modelFileName) + c_cacheInfix + L"*";
+
+    WIN32_FIND_DATAW findData = {};
+    const auto findHandle = FindFirstFileW(pattern.c_str(), &findData);
+    if (findHandle == INVALID_HANDLE_VALUE) return;
+    do {
+        const auto fileName = directory + findData.cFileName;
+        if (fileName != keepFileName && fileName != GetExternalDataFileName(keepFileName)) {
+            DeleteFileW(fileName.c_str());
+        }
+    } while (FindNextFileW(findHandle, &findData));
+    FindClose(findHandle);
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// optimized model cache placed beside the original model.
+// file name has a key made from the model file (and its .onnx_data weights), ORT version and CPU features,
+// so a cache made by other model / runtime / machine is never picked up.
+struct OptimizedModelCache
+{
+    static std::wstring GetCacheFileName(std::wstring_view modelFileName);
+    static std::wstring GetExternalDataFileName(std::wstring_view cacheFileName);
+    static bool Exists(std::wstring_view cacheFileName);
+    // removes cache files of the model except keepFileName (and its external data).
+    static void RemoveStaleCaches(std::wstring_view modelFileName, std::wstring_view keepFileName);
+};
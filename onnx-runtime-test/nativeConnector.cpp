@@ -0,0 +1,136 @@
+// built only with ONNX_TEST_NATIVE_ENGINE, see readme.md (native GPT-2 engine).
+#ifdef ONNX_TEST_NATIVE_ENGINE
+#define NOMINMAX
+#include <sstream>
+#include "gpt2Engine.h"
+#include "onnxConnector.h"
+#include "threadPool.h"
+
+// OnnxConnector on Gpt2Engine, drop-in replacement of the ORT connector for GPT-2 models.
+struct NativeConnectorImpl : public OnnxConnector {
+public:
+    void Initialize(const std::wstring_view modelFileName) override {
+        m_modelFileName = modelFileName;
+    }
+
+    // no fixed shape sessions, sequences are packed without padding.
+    void SetShapeBuckets(const std::vector<std::tuple<int, int>>&) override {}
+
+    // the engine runs on the calling thread and reads weights from the file mapping, only readout workers are placed.
+    void SetNumaNode(const NumaNode& node) override {
+        auto options = ThreadPool::GetShared().GetOptions();
+        options.threadCount = static_cast<size_t>(NumaTopology::GetProcessorCount(node));
+        options.affinityMask = node.processorMask;
+        m_nodePool = std::make_unique<ThreadPool>(options);
+    }
+
+    std::wstring GetStatistics() override {
+        std::wstringstream ss;
+        ss << L"native forward: " << m_forwardCount << L"\n";
+        ss << L"native token rows: " << m_tokenRowCount << L"\n";
+        return ss.str();
+    }
+
+    std::tuple<int64_t, float> GetPrediction(const std::vector<int64_t>& tokens) override try {
+        EnsureInitialized();
+        Gpt2Engine::KvCache cache;
+        Forward({ std::vector<int>(tokens.begin(), tokens.end()) }, { &cache }, true);
+        return m_logits.GetMaxIndexInRange(0, m_engine.GetVocabularySize());
+    }
+    catch (...) { return std::make_tuple(-1LL, 0.0f); }
+
+    std::tuple<int64_t, float> GetConstrainedPrediction(const std::vector<int64_t>& tokens, const int* allowedIds, int allowedCount) override try {
+        EnsureInitialized();
+        Gpt2Engine::KvCache cache;
+        Forward({ std::vector<int>(tokens.begin(), tokens.end()) }, { &cache }, true);
+        return m_logits.GetMaskedMaxInRange(allowedIds, allowedCount, 0);
+    }
+    catch (...) { return std::make_tuple(-1LL, 0.0f); }
+
+    void GenerateTokens(const std::vector<int64_t>& promptTokens, int eosId, int maxNewTokens,
+        const std::function<bool(int64_t token, float probability)>& onToken) override try {
+        EnsureInitialized();
+
+        // prompt runs once, then each step feeds only the new token on top of the kv cache.
+        Gpt2Engine::KvCache cache;
+        std::vector<int> stepTokens(promptTokens.begin(), promptTokens.end());
+        for (int i = 0; i < maxNewTokens; ++i) {
+            Forward({ stepTokens }, { &cache }, true);
+
+            const auto [nextToken, probability] = m_logits.GetMaxIndexInRange(0, m_engine.GetVocabularySize());
+            if (nextToken == eosId) break;
+            if (!onToken(nextToken, probability)) break;
+            stepTokens.assign(1, static_cast<int>(nextToken));
+        }
+    }
+    catch (...) { }
+
+    std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) override {
+        return SplitSentenceValues(sentences, [&](float* probabilities) { return CompareSentencesFlat(sentences, eosId, probabilities); });
+    }
+
+    bool CompareSentencesFlat(const std::vector<std::vector<int>>& sentences, int eosId, float* probabilities) override try {
+        EnsureInitialized();
+
+        std::vector<Gpt2Engine::KvCache> caches(sentences.size());
+        std::vector<Gpt2Engine::KvCache*> cachePtrs;
+        for (auto& cache : caches) cachePtrs.push_back(&cache);
+        Forward(sentences, cachePtrs, false);
+
+        // logits rows are packed sentence by sentence, same readout as the ORT connector.
+        // value i reads row m_readoutRows[i] (-1 = first token, probability 1).
+        m_readoutRows.clear();
+        m_readoutTokens.clear();
+        int rowTop = 0;
+        for (const auto& sentence : sentences) {
+            m_readoutRows.push_back(-1);
+            m_readoutTokens.push_back(0);
+            for (size_t tokenIndex = 1; tokenIndex < sentence.size(); ++tokenIndex) {
+                m_readoutRows.push_back(rowTop + static_cast<int>(tokenIndex) - 1);
+                m_readoutTokens.push_back(sentence[tokenIndex]);
+            }
+            m_readoutRows.push_back(rowTop + static_cast<int>(sentence.size()) - 1);
+            m_readoutTokens.push_back(eosId);
+            rowTop += static_cast<int>(sentence.size());
+        }
+
+        const auto vocabularySize = m_engine.GetVocabularySize();
+        auto& pool = m_nodePool ? *m_nodePool : ThreadPool::GetShared();
+        pool.ParallelFor(m_readoutRows.size(), 4, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                const auto offset = m_readoutRows[i] * vocabularySize;
+                probabilities[i] = m_readoutRows[i] < 0 ? 1.0f : m_logits.GetProbabilityInRange(m_readoutTokens[i], offset, offset + vocabularySize);
+            }
+        });
+        return true;
+    }
+    catch (...) { return false; }
+
+private:
+    void EnsureInitialized() {
+        if (!m_engine.IsLoaded()) {
+            m_engine.Load(m_modelFileName);
+        }
+    }
+
+    void Forward(const std::vector<std::vector<int>>& newTokens, const std::vector<Gpt2Engine::KvCache*>& caches, bool lastTokenOnly) {
+        m_engine.Forward(newTokens, caches, lastTokenOnly, m_logits);
+        ++m_forwardCount;
+        for (const auto& tokens : newTokens) m_tokenRowCount += tokens.size();
+    }
+
+    std::wstring m_modelFileName;
+    Gpt2Engine m_engine;
+    MemAlignedTensor m_logits;
+    std::vector<int> m_readoutRows;
+    std::vector<int> m_readoutTokens;
+    size_t m_forwardCount = 0;
+    size_t m_tokenRowCount = 0;
+    std::unique_ptr<ThreadPool> m_nodePool;
+};
+
+std::shared_ptr<OnnxConnector> OnnxConnector::CreateNativeInstance() {
+    return std::make_shared<NativeConnectorImpl>();
+}
+
+#endif
@@ -0,0 +1,106 @@
+#define NOMINMAX
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <type_traits>
+#include "onnxConnector.h"
+
+// OnnxConnector over one replica per NUMA node. a request runs entirely on one node: the replica's session,
+// weights and readout workers are there, and the calling thread is pinned to the node while the request runs.
+struct NumaRouterImpl : public OnnxConnector {
+public:
+    NumaRouterImpl(const std::function<std::shared_ptr<OnnxConnector>()>& createReplica, const std::vector<NumaNode>& nodes) {
+        for (const auto& node : nodes) {
+            auto replica = std::make_unique<Replica>();
+            replica->node = node;
+            replica->connector = createReplica();
+            replica->connector->SetNumaNode(node);
+            m_replicas.emplace_back(std::move(replica));
+        }
+        if (m_replicas.empty()) throw std::runtime_error("no numa node");
+    }
+
+    void Initialize(const std::wstring_view modelFileName) override {
+        for (auto& replica : m_replicas) replica->connector->Initialize(modelFileName);
+    }
+
+    void SetShapeBuckets(const std::vector<std::tuple<int, int>>& shapes) override {
+        for (auto& replica : m_replicas) replica->connector->SetShapeBuckets(shapes);
+    }
+
+    // replicas are placed when they are created.
+    void SetNumaNode(const NumaNode&) override {}
+
+    std::wstring GetStatistics() override {
+        std::wstringstream ss;
+        for (auto& replica : m_replicas) {
+            std::lock_guard<std::mutex> lock(replica->mutex);
+            ss << L"replica node " << replica->node.nodeNumber << (replica->node.isSimulated ? L" (simulated)" : L"")
+                << L": " << replica->requestCount << L" requests\n";
+            ss << replica->connector->GetStatistics();
+        }
+        return ss.str();
+    }
+
+    std::tuple<int64_t, float> GetPrediction(const std::vector<int64_t>& tokens) override {
+        return Route([&](OnnxConnector& connector) { return connector.GetPrediction(tokens); });
+    }
+
+    std::tuple<int64_t, float> GetConstrainedPrediction(const std::vector<int64_t>& tokens, const int* allowedIds, int allowedCount) override {
+        return Route([&](OnnxConnector& connector) { return connector.GetConstrainedPrediction(tokens, allowedIds, allowedCount); });
+    }
+
+    // every step of a generation stays on the same replica.
+    void GenerateTokens(const std::vector<int64_t>& promptTokens, int eosId, int maxNewTokens,
+        const std::function<bool(int64_t token, float probability)>& onToken) override {
+        Route([&](OnnxConnector& connector) { connector.GenerateTokens(promptTokens, eosId, maxNewTokens, onToken); });
+    }
+
+    std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) override {
+        return Route([&](OnnxConnector& connector) { return connector.CompareSentences(sentences, eosId); });
+    }
+
+    bool CompareSentencesFlat(const std::vector<std::vector<int>>& sentences, int eosId, float* probabilities) override {
+        return Route([&](OnnxConnector& connector) { return connector.CompareSentencesFlat(sentences, eosId, probabilities); });
+    }
+
+private:
+    struct Replica {
+        NumaNode node;
+        std::shared_ptr<OnnxConnector> connector;
+        std::mutex mutex;                   // connectors are not thread safe, one request at a time
+        std::atomic<int> inFlightCount = 0; // running and waiting requests
+        size_t requestCount = 0;
+    };
+
+    // least busy replica, ties go to the lower node so a single caller stays on one node.
+    Replica& SelectReplica() {
+        auto selected = m_replicas[0].get();
+        for (auto& replica : m_replicas) {
+            if (replica->inFlightCount < selected->inFlightCount) selected = replica.get();
+        }
+        ++selected->inFlightCount;
+        return *selected;
+    }
+
+    template <typename Body>
+    std::invoke_result_t<Body, OnnxConnector&> Route(Body&& body) {
+        auto& replica = SelectReplica();
+        struct InFlightGuard {
+            Replica& replica;
+            ~InFlightGuard() { --replica.inFlightCount; }
+        } inFlightGuard{ replica };
+
+        std::lock_guard<std::mutex> lock(replica.mutex);
+        NumaThreadScope nodeScope(replica.node);
+        ++replica.requestCount;
+        return body(*replica.connector);
+    }
+
+    std::vector<std::unique_ptr<Replica>> m_replicas;
+};
+
+std::shared_ptr<OnnxConnector> OnnxConnector::CreateNumaRouter(const std::function<std::shared_ptr<OnnxConnector>()>& createReplica,
+    const std::vector<NumaNode>& nodes) {
+    return std::make_shared<NumaRouterImpl>(createReplica, nodes);
+}
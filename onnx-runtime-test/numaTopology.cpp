@@ -0,0 +1,88 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <algorithm>
+#include <bit>
+#include <new>
+#include <string>
+#include "numaTopology.h"
+
+std::vector<NumaNode> NumaTopology::Detect() {
+	std::vector<NumaNode> nodes;
+	ULONG highestNode = 0;
+	if (GetNumaHighestNodeNumber(&highestNode)) {
+		for (ULONG nodeNumber = 0; nodeNumber <= highestNode; ++nodeNumber) {
+			GROUP_AFFINITY affinity = {};
+			if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(nodeNumber), &affinity)) continue;
+			// nodes in other processor groups can not be reached with 64-bit masks.
+			if (affinity.Group != 0 || affinity.Mask == 0) continue;
+			nodes.push_back(NumaNode{ static_cast<int>(nodeNumber), static_cast<uint64_t>(affinity.Mask), false });
+		}
+	}
+	if (nodes.empty()) {
+		nodes = Simulate(1);
+		nodes[0].isSimulated = false;
+	}
+	return nodes;
+}
+
+std::vector<NumaNode> NumaTopology::Simulate(int nodeCount) {
+	DWORD_PTR processMask = 0, systemMask = 0;
+	GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+
+	std::vector<int> processors;
+	for (int i = 0; i < 64; ++i) {
+		if ((static_cast<uint64_t>(processMask) >> i) & 1) processors.push_back(i);
+	}
+	nodeCount = std::max(1, std::min(nodeCount, static_cast<int>(processors.size())));
+
+	// contiguous ranges, like cores of one socket.
+	std::vector<NumaNode> nodes(nodeCount);
+	for (size_t i = 0; i < processors.size(); ++i) {
+		auto& node = nodes[i * nodeCount / processors.size()];
+		node.processorMask |= 1ULL << processors[i];
+		node.isSimulated = true;
+	}
+	return nodes;
+}
+
+std::vector<NumaNode> NumaTopology::GetNodes() {
+	wchar_t value[8] = {};
+	if (GetEnvironmentVariable(L"ONNX_TEST_SIMULATE_NUMA", value, ARRAYSIZE(value)) != 0 && _wtoi(value) > 0) {
+		return Simulate(_wtoi(value));
+	}
+	return Detect();
+}
+
+int NumaTopology::GetProcessorCount(const NumaNode& node) {
+	return std::popcount(node.processorMask);
+}
+
+std::string NumaTopology::GetProcessorList(const NumaNode& node) {
+	std::string list;
+	for (int i = 0; i < 64; ++i) {
+		if (((node.processorMask >> i) & 1) == 0) continue;
+		if (!list.empty()) list += ',';
+		// ORT counts logical processors from 1.
+		list += std::to_string(i + 1);
+	}
+	return list;
+}
+
+void* NumaTopology::AllocateOnNode(size_t size, const NumaNode& node) {
+	const auto memory = VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE,
+		static_cast<DWORD>(node.nodeNumber));
+	if (memory == nullptr) throw std::bad_alloc();
+	return memory;
+}
+
+void NumaTopology::FreeOnNode(void* memory) {
+	if (memory != nullptr) VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+NumaThreadScope::NumaThreadScope(const NumaNode& node) {
+	m_previousMask = static_cast<uint64_t>(SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(node.processorMask)));
+}
+
+NumaThreadScope::~NumaThreadScope() {
+	if (m_previousMask != 0) SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(m_previousMask));
+}
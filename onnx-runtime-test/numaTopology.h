@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// NUMA node and its logical processors (processor group 0).
+struct NumaNode {
+	int nodeNumber = 0;			// memory is allocated on this OS node
+	uint64_t processorMask = 0;
+	bool isSimulated = false;	// carved out of a smaller machine, memory is not really node local
+};
+
+struct NumaTopology {
+	static std::vector<NumaNode> Detect();
+	// splits the processors of this process into nodeCount nodes, for testing replicas on a single-node machine.
+	static std::vector<NumaNode> Simulate(int nodeCount);
+	// Simulate(n) when ONNX_TEST_SIMULATE_NUMA=n is set, otherwise Detect().
+	static std::vector<NumaNode> GetNodes();
+
+	static int GetProcessorCount(const NumaNode& node);
+	// comma separated processor numbers, for ORT affinity strings.
+	static std::string GetProcessorList(const NumaNode& node);
+
+	// committed memory preferring the node, freed by FreeOnNode().
+	static void* AllocateOnNode(size_t size, const NumaNode& node);
+	static void FreeOnNode(void* memory);
+};
+
+// pins the current thread to the node while alive, the previous affinity is restored on exit.
+class NumaThreadScope
+{
+public:
+	explicit NumaThreadScope(const NumaNode& node);
+	NumaThreadScope(const NumaThreadScope&) = delete;
+	NumaThreadScope& operator = (const NumaThreadScope&) = delete;
+	~NumaThreadScope();
+
+private:
+	uint64_t m_previousMask = 0;
+};
@@ -1,53 +1,158 @@
 
 #define NOMINMAX
+#include <algorithm>
 #include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <onnxruntime_cxx_api.h>
+#include "externalData.h"
 #include "MemAlignedTensor.h"
+#include "modelCache.h"
 #include "onnxConnector.h"
 #include "miscUtils.h"
+#include "threadPool.h"
+
+// initializers and ORT's prepacked GEMM weights of one model file, shared by every session made from it in the process
+// (connectors, shape buckets). NUMA replicas get one set per node, their copies must stay node local.
+class SharedModelWeights
+{
+public:
+    static std::shared_ptr<SharedModelWeights> Acquire(const std::wstring& modelFileName, const std::optional<NumaNode>& node) {
+        static std::mutex registryMutex;
+        static std::map<std::tuple<std::wstring, uint64_t>, std::weak_ptr<SharedModelWeights>> registry;
+
+        // loading is also done under the lock, the second connector waits for the first one's weights.
+        // sets released by their last session are dropped here, so swapped or unloaded models do not leave entries.
+        std::lock_guard<std::mutex> lock(registryMutex);
+        std::erase_if(registry, [](const auto& item) { return item.second.expired(); });
+        auto& entry = registry[std::make_tuple(modelFileName, node ? node->processorMask : 0)];
+        auto weights = entry.lock();
+        if (!weights) {
+            weights = std::make_shared<SharedModelWeights>();
+            weights->m_modelFileName = modelFileName;
+            weights->m_mapping.Load(modelFileName, true, node ? &*node : nullptr);
+            entry = weights;
+        }
+        return weights;
+    }
+
+    bool IsFor(const std::wstring& modelFileName) const { return m_modelFileName == modelFileName; }
+
+    Ort::Session CreateSession(const Ort::Env& env, Ort::SessionOptions& sessionOptions) {
+        m_mapping.AddTo(sessionOptions);
+        return Ort::Session(env, m_modelFileName.c_str(), sessionOptions, m_prepackedWeights);
+    }
+
+private:
+    std::wstring m_modelFileName;
+    ExternalDataMapping m_mapping;
+    Ort::PrepackedWeightsContainer m_prepackedWeights;
+};
 
 struct OnnxConnectorImpl : public OnnxConnector {
     const char* c_inputIds = "input_ids";
     const char* c_attentionMask = "attention_mask";
     const char* c_logits = "logits";
+    // probability given to tokens cut from a pruned LM head, they are rare in the domain by construction.
+    static constexpr float c_prunedTokenProbability = 1e-7f;
+    static constexpr size_t c_readoutGrainSize = 4;
 
 public:
     void Initialize(const std::wstring_view modelFileName) {
         m_modelFileName = modelFileName;
     }
 
+    void SetShapeBuckets(const std::vector<std::tuple<int, int>>& shapes) override {
+        m_buckets.clear();
+        for (const auto& [batchSize, sequenceLength] : shapes) {
+            m_buckets.emplace_back(ShapeBucket{ static_cast<size_t>(batchSize), static_cast<size_t>(sequenceLength) });
+        }
+    }
+
+    void SetNumaNode(const NumaNode& node) override {
+        m_numaNode = node;
+        auto options = ThreadPool::GetShared().GetOptions();
+        options.threadCount = static_cast<size_t>(NumaTopology::GetProcessorCount(node));
+        options.affinityMask = node.processorMask;
+        m_nodePool = std::make_unique<ThreadPool>(options);
+    }
+
+    std::wstring GetStatistics() override {
+        std::wstringstream ss;
+        if (m_numaNode) ss << L"numa node: " << m_numaNode->nodeNumber << (m_numaNode->isSimulated ? L" (simulated)" : L"") << L"\n";
+        for (const auto& bucket : m_buckets) {
+            ss << L"bucket(" << bucket.batchSize << L"," << bucket.sequenceLength << L"): " << bucket.hitCount << L"\n";
+        }
+        ss << L"dynamic: " << m_dynamicHitCount << L"\n";
+        ss << L"padded tokens: " << m_paddedTokenCount << L"\n";
+        if (m_weights) ss << L"shared weights references: " << m_weights.use_count() << L"\n";
+        return ss.str();
+    }
+
     std::tuple<int64_t, float> GetPrediction(const std::vector<int64_t>& tokens) override try {
-        const auto startTime = std::chrono::system_clock::now();
         EnsureInitialized();
+        RunLogits(tokens);
 
-        // create attention-mask, that is filled by '1' where token vector has token value.
-        const auto tokenSize = static_cast<int64_t>(tokens.size());
-        std::vector<int64_t> attentionMask(tokens.size(), 1LL);
+        const auto lastRowOffset = static_cast<int>((tokens.size() - 1) * m_tokenIdCount);
+        const auto [index, probability] = m_logits.GetMaxIndexInRange(lastRowOffset, lastRowOffset + static_cast<int>(m_tokenIdCount));
+        return std::make_tuple(ToTokenId(index), probability);
+    }
+    catch (...) { return std::make_tuple(-1LL, 0.0f); }
 
-        auto memory_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
-        auto inputShape = std::array<int64_t, 2> { 1, static_cast<int64_t>(tokens.size()) };
-        auto idTensor = Ort::Value::CreateTensor<int64_t>(memory_info, const_cast<int64_t*>(tokens.data()), tokens.size(), inputShape.data(), inputShape.size());
-        auto maskTensor = Ort::Value::CreateTensor<int64_t>(memory_info, const_cast<int64_t*>(attentionMask.data()), attentionMask.size(), inputShape.data(), inputShape.size());
+    std::tuple<int64_t, float> GetConstrainedPrediction(const std::vector<int64_t>& tokens, const int* allowedIds, int allowedCount) override try {
+        EnsureInitialized();
+        RunLogits(tokens);
+
+        if (!m_prunedToFull.empty()) {
+            // allowed ids are full vocabulary ids, pruned ones can never be picked.
+            m_allowedIndices.clear();
+            for (int i = 0; i < allowedCount; ++i) {
+                const auto index = ToLogitsIndex(allowedIds[i]);
+                if (index >= 0) m_allowedIndices.push_back(index);
+            }
+            if (m_allowedIndices.empty()) return std::make_tuple(-1LL, 0.0f);
+            allowedIds = m_allowedIndices.data();
+            allowedCount = static_cast<int>(m_allowedIndices.size());
+        }
 
-        auto outputShape = std::array<int64_t, 3> { 1, static_cast<int64_t>(tokens.size()), static_cast<int64_t>(m_tokenIdCount) };
-        std::vector<float> logits(tokens.size() * m_tokenIdCount, 0.0f);
-        auto outputTensor = Ort::Value::CreateTensor<float>(memory_info, logits.data(), logits.size(), outputShape.data(), outputShape.size());
+        // only the allowed ids of the last position are read, see MemAlignedTensor::GetMaskedMaxInRange()
+        const auto lastRowOffset = static_cast<int>((tokens.size() - 1) * m_tokenIdCount);
+        const auto [index, probability] = m_logits.GetMaskedMaxInRange(allowedIds, allowedCount, lastRowOffset);
+        return std::make_tuple(ToTokenId(index), probability);
+    }
+    catch (...) { return std::make_tuple(-1LL, 0.0f); }
 
-        auto ioBinding = Ort::IoBinding(m_session);
-        ioBinding.BindInput("input_ids", idTensor);
-        ioBinding.BindInput("attention_mask", maskTensor);
-        ioBinding.BindOutput("logits", outputTensor);
+    void GenerateTokens(const std::vector<int64_t>& promptTokens, int eosId, int maxNewTokens,
+        const std::function<bool(int64_t token, float probability)>& onToken) override try {
+        EnsureInitialized();
 
-        auto runOptions = Ort::RunOptions();
-        m_session.Run(runOptions, ioBinding);
+        // token ids are extended in place, text is never re-encoded between steps.
+        std::vector<int64_t> tokens;
+        tokens.reserve(promptTokens.size() + maxNewTokens);
+        tokens.assign(promptTokens.begin(), promptTokens.end());
+
+        for (int i = 0; i < maxNewTokens; ++i) {
+            RunLogits(tokens);
 
-        const auto maxIndex = FindMaxIndex(logits, m_tokenIdCount * (tokens.size() - 1), 32000 * tokens.size());
-        return std::make_tuple(maxIndex, logits[m_tokenIdCount * (tokens.size() - 1) + maxIndex]); // TODO: should softmax
+            const auto lastRowOffset = static_cast<int>((tokens.size() - 1) * m_tokenIdCount);
+            const auto [index, probability] = m_logits.GetMaxIndexInRange(lastRowOffset, lastRowOffset + static_cast<int>(m_tokenIdCount));
+            const auto nextToken = ToTokenId(index);
+            if (nextToken == eosId) break;
+
+            tokens.push_back(nextToken);
+            if (!onToken(nextToken, probability)) break;
+        }
+    }
+    catch (...) { }
+
+    std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) override {
+        return SplitSentenceValues(sentences, [&](float* probabilities) { return CompareSentencesFlat(sentences, eosId, probabilities); });
     }
-    catch (...) { return std::make_tuple(-1LL, 0.0f); }
 
-    std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) override try {
+    bool CompareSentencesFlat(const std::vector<std::vector<int>>& sentences, int eosId, float* probabilities) override try {
         auto lastTime = std::chrono::system_clock::now();
         EnsureInitialized();
         // wprintf(L"Model setup: %lld\n", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastTime).count()); lastTime = std::chrono::system_clock::now();
@@ -59,15 +164,18 @@ public:
             maxTokenSize = std::max(maxTokenSize, sentence.size());
         }
 
+        // pad up to the shape bucket, padded rows and columns have zero attention-mask.
+        auto [session, batchSize, sequenceSize] = SelectSession(sentences.size(), maxTokenSize);
+
         // allocate token and attention-mask matrix
-        std::vector<int64_t> tokenArray(maxTokenSize * sentences.size(), 0LL);
-        std::vector<int64_t> attentionMaskArray(maxTokenSize * sentences.size(), 0LL);
+        std::vector<int64_t> tokenArray(sequenceSize * batchSize, 0LL);
+        std::vector<int64_t> attentionMaskArray(sequenceSize * batchSize, 0LL);
 
         // setup token and attention-mask matrix
         for (size_t i = 0; i < sentences.size(); ++i) {
             const auto& sentence = sentences[i];
-            auto tokenTop = &tokenArray[i * maxTokenSize];
-            auto maskTop = &attentionMaskArray[i * maxTokenSize];
+            auto tokenTop = &tokenArray[i * sequenceSize];
+            auto maskTop = &attentionMaskArray[i * sequenceSize];
             for (size_t j = 0; j < sentence.size(); ++j) {
                 tokenTop[j] = sentence[j];
                 maskTop[j] = 1LL;
@@ -94,18 +202,17 @@ public:
 
         // binding input
         auto memory_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
-        auto inputShape = std::array<int64_t, 2> { static_cast<int64_t>(sentences.size()), static_cast<int64_t>(maxTokenSize) };
+        auto inputShape = std::array<int64_t, 2> { static_cast<int64_t>(batchSize), static_cast<int64_t>(sequenceSize) };
         auto idTensor = Ort::Value::CreateTensor<int64_t>(memory_info, const_cast<int64_t*>(tokenArray.data()), tokenArray.size(), inputShape.data(), inputShape.size());
         auto maskTensor = Ort::Value::CreateTensor<int64_t>(memory_info, const_cast<int64_t*>(attentionMaskArray.data()), attentionMaskArray.size(), inputShape.data(), inputShape.size());
 
         MemAlignedTensor tokenVector;
-        tokenVector.Reserve(sentences.size() * maxTokenSize, m_tokenIdCount);
-        auto [outDataPtr, outDataRowCount, outDataColumnCount] = tokenVector.GetBuffer();
+        auto outDataPtr = tokenVector.ReserveAs(m_logitsElementType, batchSize * sequenceSize, m_tokenIdCount);
 
-        auto outputShape = std::array<int64_t, 3> { static_cast<int64_t>(sentences.size()), static_cast<int64_t>(maxTokenSize), static_cast<int64_t>(m_tokenIdCount) };
-        auto outputTensor = Ort::Value::CreateTensor<float>(memory_info, outDataPtr, sentences.size() * maxTokenSize * m_tokenIdCount, outputShape.data(), outputShape.size());
+        auto outputShape = std::array<int64_t, 3> { static_cast<int64_t>(batchSize), static_cast<int64_t>(sequenceSize), static_cast<int64_t>(m_tokenIdCount) };
+        auto outputTensor = CreateLogitsTensor(memory_info, outDataPtr, outputShape);
 
-        auto ioBinding = Ort::IoBinding(m_session);
+        auto ioBinding = Ort::IoBinding(*session);
         ioBinding.BindInput(c_inputIds, idTensor);
         ioBinding.BindInput(c_attentionMask, maskTensor);
         ioBinding.BindOutput(c_logits, outputTensor);
@@ -113,55 +220,272 @@ public:
         // wprintf(L"Bind in/out: %lld\n", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastTime).count()); lastTime = std::chrono::system_clock::now();
 
         auto runOptions = Ort::RunOptions();
-        m_session.Run(runOptions, ioBinding);
+        session->Run(runOptions, ioBinding);
 
         // wprintf(L"Model exec: %lld\n", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastTime).count()); lastTime = std::chrono::system_clock::now();
 
-        std::vector<std::vector<float>> result;
+        // one softmax per (sentence, position), spread over the shared pool.
+        m_readoutItems.clear();
         for (size_t i = 0; i < sentences.size(); ++i) {
-            std::vector<float> probList;
-            probList.emplace_back(1.0f);
+            m_readoutItems.push_back(ReadoutItem{ -1, 0 });
             for (size_t tokenIndex = 1; tokenIndex < sentences[i].size(); ++tokenIndex) {
-                const auto targetVectorOffset = static_cast<int>(i * maxTokenSize * m_tokenIdCount + (tokenIndex - 1) * m_tokenIdCount);
-                const auto probability = tokenVector.GetProbabilityInRange(sentences[i][tokenIndex], targetVectorOffset, targetVectorOffset + m_tokenIdCount);
-                probList.emplace_back(probability);
+                const auto targetVectorOffset = static_cast<int>(i * sequenceSize * m_tokenIdCount + (tokenIndex - 1) * m_tokenIdCount);
+                m_readoutItems.push_back(ReadoutItem{ targetVectorOffset, sentences[i][tokenIndex] });
             }
-            const auto targetVectorOffset = static_cast<int>(i * maxTokenSize * m_tokenIdCount + (sentences[i].size() - 1) * m_tokenIdCount);
-            const auto probability = tokenVector.GetProbabilityInRange(eosId, targetVectorOffset, targetVectorOffset + m_tokenIdCount);
-            probList.emplace_back(probability);
-
-            result.emplace_back(std::move(probList));
+            const auto targetVectorOffset = static_cast<int>(i * sequenceSize * m_tokenIdCount + (sentences[i].size() - 1) * m_tokenIdCount);
+            m_readoutItems.push_back(ReadoutItem{ targetVectorOffset, eosId });
         }
+        ReadProbabilities(tokenVector, probabilities);
 
         // wprintf(L"Read output: %lld\n", std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastTime).count()); lastTime = std::chrono::system_clock::now();
 
-        return result;
+        return true;
     }
-    catch (...) { return std::vector<std::vector<float>>(); }
+    catch (...) { return false; }
 
 private:
+    // run single sequence and keep whole logits in m_logits, buffer is reused between calls.
+    void RunLogits(const std::vector<int64_t>& tokens) {
+        const auto tokenSize = static_cast<int64_t>(tokens.size());
+        m_attentionMask.assign(tokens.size(), 1LL);
+
+        auto memory_info = Ort::MemoryInfo::CreateCpu(OrtDeviceAllocator, OrtMemTypeCPU);
+        auto inputShape = std::array<int64_t, 2> { 1, tokenSize };
+        auto idTensor = Ort::Value::CreateTensor<int64_t>(memory_info, const_cast<int64_t*>(tokens.data()), tokens.size(), inputShape.data(), inputShape.size());
+        auto maskTensor = Ort::Value::CreateTensor<int64_t>(memory_info, m_attentionMask.data(), m_attentionMask.size(), inputShape.data(), inputShape.size());
+
+        auto logitsPtr = m_logits.ReserveAs(m_logitsElementType, tokenSize, m_tokenIdCount);
+        auto outputShape = std::array<int64_t, 3> { 1, tokenSize, static_cast<int64_t>(m_tokenIdCount) };
+        auto outputTensor = CreateLogitsTensor(memory_info, logitsPtr, outputShape);
+
+        auto ioBinding = Ort::IoBinding(m_session);
+        ioBinding.BindInput(c_inputIds, idTensor);
+        ioBinding.BindInput(c_attentionMask, maskTensor);
+        ioBinding.BindOutput(c_logits, outputTensor);
+
+        auto runOptions = Ort::RunOptions();
+        m_session.Run(runOptions, ioBinding);
+    }
+
+    // pruned LM head: logits column <-> full vocabulary id, both are identity without a vocabulary map.
+    int ToLogitsIndex(int tokenId) const {
+        if (m_fullToPruned.empty()) return tokenId;
+        return tokenId >= 0 && tokenId < static_cast<int>(m_fullToPruned.size()) ? m_fullToPruned[tokenId] : -1;
+    }
+
+    int64_t ToTokenId(int64_t logitsIndex) const {
+        if (m_prunedToFull.empty() || logitsIndex < 0) return logitsIndex;
+        return m_prunedToFull[static_cast<size_t>(logitsIndex)];
+    }
+
+    // logits row offset (-1 = first token, probability 1) and token of each output value.
+    struct ReadoutItem {
+        int rowOffset;
+        int tokenId;
+    };
+
+    // items cost one 32000-wide softmax each, a few per task keeps the scheduling overhead small.
+    void ReadProbabilities(MemAlignedTensor& logits, float* probabilities) {
+        GetReadoutPool().ParallelFor(m_readoutItems.size(), c_readoutGrainSize, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                const auto& item = m_readoutItems[i];
+                probabilities[i] = item.rowOffset < 0 ? 1.0f : GetTokenProbability(logits, item.tokenId, item.rowOffset);
+            }
+        });
+    }
+
+    ThreadPool& GetReadoutPool() {
+        return m_nodePool ? *m_nodePool : ThreadPool::GetShared();
+    }
+
+    float GetTokenProbability(MemAlignedTensor& logits, int tokenId, int rowOffset) const {
+        const auto index = ToLogitsIndex(tokenId);
+        if (index < 0) return c_prunedTokenProbability;
+        return logits.GetProbabilityInRange(index, rowOffset, rowOffset + static_cast<int>(m_tokenIdCount));
+    }
+
+    // "<model>.vocab" written by onnx-models/prune_vocab.py, full token id of each logits column per line.
+    void LoadVocabularyMap() {
+        m_prunedToFull.clear();
+        m_fullToPruned.clear();
+
+        const auto dot = m_modelFileName.find_last_of(L'.');
+        std::ifstream file(m_modelFileName.substr(0, dot) + L".vocab");
+        if (!file) return;
+
+        int tokenId;
+        while (file >> tokenId) {
+            m_prunedToFull.push_back(tokenId);
+        }
+        if (m_prunedToFull.size() != m_tokenIdCount) {
+            throw std::runtime_error("vocabulary map does not match logits");
+        }
+
+        const auto maxTokenId = *std::max_element(m_prunedToFull.begin(), m_prunedToFull.end());
+        m_fullToPruned.assign(static_cast<size_t>(maxTokenId) + 1, -1);
+        for (size_t i = 0; i < m_prunedToFull.size(); ++i) {
+            m_fullToPruned[m_prunedToFull[i]] = static_cast<int>(i);
+        }
+    }
+
+    // logits may be fp32, fp16 or bf16, readout kernels convert half precision on the fly.
+    Ort::Value CreateLogitsTensor(const Ort::MemoryInfo& memoryInfo, void* buffer, const std::array<int64_t, 3>& shape) {
+        const auto byteCount = shape[0] * shape[1] * shape[2] * MemAlignedTensor::GetElementSize(m_logitsElementType);
+        return Ort::Value::CreateTensor(memoryInfo, buffer, byteCount, shape.data(), shape.size(), m_logitsType);
+    }
+
     void EnsureInitialized() {
         if (!m_session) {
-            Ort::Env env;
-            Ort::SessionOptions sessionOptions;
-
-            m_session = Ort::Session(env, m_modelFileName.c_str(), sessionOptions);
+            // graph optimization runs only once per model / ORT version / CPU, later starts load the saved result.
+            const auto& cacheFileName = OptimizedModelCache::GetCacheFileName(m_modelFileName);
+            if (OptimizedModelCache::Exists(cacheFileName)) {
+                try {
+                    m_session = CreateSession(cacheFileName, m_weights, true, L"");
+                }
+                catch (const std::exception&) {
+                    // broken cache (e.g. process was killed while writing), rebuild it from the original model.
+                    m_session = Ort::Session{ nullptr };
+                }
+            }
+            if (!m_session) {
+                OptimizedModelCache::RemoveStaleCaches(m_modelFileName, L"");
+                try {
+                    m_session = CreateSession(m_modelFileName, m_weights, false, cacheFileName);
+                }
+                catch (const std::exception&) {
+                    // cache can not be written (read-only directory etc.)
+                    m_session = CreateSession(m_modelFileName, m_weights, false, L"");
+                }
+            }
             m_tokenIdCount = GetTokenIdCount();
+            LoadVocabularyMap();
 
             // PrintInputOutput();
         }
     }
 
-    int64_t FindMaxIndex(const std::vector<float>& list, size_t fromIndex, size_t toIndex) {
-        size_t resultIndex = fromIndex;
-        float maxLogit = list[fromIndex];
-        for (size_t i = fromIndex + 1; i < toIndex; ++i) {
-            if (maxLogit < list[i]) {
-                maxLogit = list[i];
-                resultIndex = i;
+    // one environment per process. every session runs on its global intra-op pool, whose threads are made by
+    // ThreadPool with the same count, affinity and spin policy as the application side workers.
+    static Ort::Env& GetSharedEnv() {
+        static Ort::Env env = CreateSharedEnv();
+        return env;
+    }
+
+    static Ort::Env CreateSharedEnv() {
+        auto& pool = ThreadPool::GetShared();
+        Ort::ThreadingOptions threadingOptions;
+        threadingOptions.SetGlobalIntraOpNumThreads(static_cast<int>(pool.GetThreadCount()));
+        threadingOptions.SetGlobalInterOpNumThreads(1);
+        threadingOptions.SetGlobalSpinControl(pool.GetOptions().allowSpinning ? 1 : 0);
+        threadingOptions.SetGlobalCustomThreadCreationOptions(&pool);
+        threadingOptions.SetGlobalCustomCreateThreadFn(CreateOrtThread);
+        threadingOptions.SetGlobalCustomJoinThreadFn(JoinOrtThread);
+        return Ort::Env(threadingOptions, ORT_LOGGING_LEVEL_WARNING, "onnx-runtime-test");
+    }
+
+    static OrtCustomThreadHandle CreateOrtThread(void* pool, OrtThreadWorkerFn workerFunction, void* parameter) {
+        return reinterpret_cast<OrtCustomThreadHandle>(ThreadPool::CreateExternalThread(pool, workerFunction, parameter));
+    }
+
+    static void JoinOrtThread(OrtCustomThreadHandle handle) {
+        ThreadPool::JoinExternalThread(handle);
+    }
+
+    using DimOverrides = std::vector<std::tuple<std::string, int64_t>>;
+
+    Ort::Session CreateSession(const std::wstring& modelFileName, std::shared_ptr<SharedModelWeights>& weights, bool isOptimized,
+        const std::wstring& saveCacheFileName, const DimOverrides& dimOverrides = {}) {
+        auto& env = GetSharedEnv();
+        Ort::SessionOptions sessionOptions;
+        std::optional<NumaThreadScope> nodeScope;
+        if (m_numaNode) {
+            // own intra-op threads on the node. the session is also built on the node, so prepacked copies
+            // which ORT allocates here are first touched there.
+            nodeScope.emplace(*m_numaNode);
+            SetNodeThreads(sessionOptions);
+        } else {
+            sessionOptions.DisablePerSessionThreads();
+        }
+
+        // weights are used from the file mappings and shared with other sessions of the model file.
+        if (!weights || !weights->IsFor(modelFileName)) {
+            weights = SharedModelWeights::Acquire(modelFileName, m_numaNode);
+        }
+
+        sessionOptions.SetGraphOptimizationLevel(isOptimized ? ORT_DISABLE_ALL : ORT_ENABLE_ALL);
+        if (!saveCacheFileName.empty()) {
+            // weights are written to external data of the cache, so the cache is also loaded by file mapping.
+            const auto& externalDataFileName = OptimizedModelCache::GetExternalDataFileName(saveCacheFileName);
+            const auto& externalDataName = ToUtf8(externalDataFileName.substr(externalDataFileName.find_last_of(L"/\\") + 1));
+            sessionOptions.SetOptimizedModelFilePath(saveCacheFileName.c_str());
+            sessionOptions.AddConfigEntry("session.optimized_model_external_initializers_file_name", externalDataName.c_str());
+            sessionOptions.AddConfigEntry("session.optimized_model_external_initializers_min_size_in_bytes", "1024");
+        }
+        for (const auto& [dimName, dimValue] : dimOverrides) {
+            sessionOptions.AddFreeDimensionOverrideByName(dimName.c_str(), dimValue);
+        }
+
+        return weights->CreateSession(env, sessionOptions);
+    }
+
+    // every intra-op thread may run on any processor of the node, ORT takes one entry per thread except the caller.
+    void SetNodeThreads(Ort::SessionOptions& sessionOptions) {
+        const auto threadCount = NumaTopology::GetProcessorCount(*m_numaNode);
+        const auto& processorList = NumaTopology::GetProcessorList(*m_numaNode);
+        std::string affinities;
+        for (int i = 1; i < threadCount; ++i) {
+            if (!affinities.empty()) affinities += ';';
+            affinities += processorList;
+        }
+        sessionOptions.SetIntraOpNumThreads(threadCount);
+        sessionOptions.SetInterOpNumThreads(1);
+        sessionOptions.AddConfigEntry("session.intra_op.allow_spinning", m_nodePool->GetOptions().allowSpinning ? "1" : "0");
+        if (!affinities.empty()) sessionOptions.AddConfigEntry("session.intra_op_thread_affinities", affinities.c_str());
+    }
+
+    // picks the smallest bucket which can hold (batch, seq), or the dynamic session when none fits.
+    // bucket sessions are created on the first hit.
+    std::tuple<Ort::Session*, size_t, size_t> SelectSession(size_t batchSize, size_t sequenceLength) {
+        ShapeBucket* selected = nullptr;
+        for (auto& bucket : m_buckets) {
+            if (bucket.batchSize >= batchSize && bucket.sequenceLength >= sequenceLength &&
+                (selected == nullptr || bucket.batchSize * bucket.sequenceLength < selected->batchSize * selected->sequenceLength)) {
+                selected = &bucket;
             }
         }
-        return static_cast<int64_t>(resultIndex - fromIndex);
+        if (selected == nullptr) {
+            ++m_dynamicHitCount;
+            return std::make_tuple(&m_session, batchSize, sequenceLength);
+        }
+
+        if (!selected->session) {
+            // made from the original model with full optimization, so shape specific fusions are done for the fixed
+            // dims. the optimized cache can not be used: it is loaded without optimization and made for dynamic shapes.
+            // initializers come from the original model's shared set, which all buckets and connectors reuse.
+            const auto [batchDimName, sequenceDimName] = GetInputDimNames();
+            const DimOverrides dimOverrides = {
+                { batchDimName, static_cast<int64_t>(selected->batchSize) },
+                { sequenceDimName, static_cast<int64_t>(selected->sequenceLength) } };
+            selected->session = CreateSession(m_modelFileName, m_bucketWeights, false, L"", dimOverrides);
+        }
+        ++selected->hitCount;
+        m_paddedTokenCount += selected->batchSize * selected->sequenceLength - batchSize * sequenceLength;
+        return std::make_tuple(&selected->session, selected->batchSize, selected->sequenceLength);
+    }
+
+    // symbolic names of input_ids dims, "batch_size" and "sequence_length" for optimum exports.
+    std::tuple<std::string, std::string> GetInputDimNames() {
+        Ort::AllocatorWithDefaultOptions alloc;
+        for (size_t i = 0; i < m_session.GetInputCount(); ++i) {
+            auto inputName = m_session.GetInputNameAllocated(i, alloc);
+            if (std::string(c_inputIds) == inputName.get()) {
+                const auto inputType = m_session.GetInputTypeInfo(i);
+                const auto& dimNames = inputType.GetTensorTypeAndShapeInfo().GetSymbolicDimensions();
+                if (dimNames.size() != 2) break;
+                return std::make_tuple(std::string(dimNames[0]), std::string(dimNames[1]));
+            }
+        }
+        throw std::runtime_error("unexpected shape");
     }
 
     int64_t GetTokenIdCount()
@@ -179,6 +503,18 @@ private:
                 if (shape[0] != -1 || shape[1] != -1) {
                     throw std::runtime_error("unexpected shape");
                 }
+
+                m_logitsType = shapeInfo.GetElementType();
+                switch (m_logitsType) {
+                case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT:
+                    m_logitsElementType = MemAlignedTensor::ElementType::Float32; break;
+                case ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16:
+                    m_logitsElementType = MemAlignedTensor::ElementType::Float16; break;
+                case ONNX_TENSOR_ELEMENT_DATA_TYPE_BFLOAT16:
+                    m_logitsElementType = MemAlignedTensor::ElementType::BFloat16; break;
+                default:
+                    throw std::runtime_error("unexpected logits type");
+                }
                 return shape[2];
             }
         }
@@ -294,12 +630,51 @@ private:
 
 private:
     std::wstring m_modelFileName;
+    std::shared_ptr<SharedModelWeights> m_weights;          // must be alive while m_session is alive
+    std::shared_ptr<SharedModelWeights> m_bucketWeights;    // of the original model, must be alive while bucket sessions are alive
     Ort::Session m_session{ nullptr };
     size_t m_tokenIdCount;
+    ONNXTensorElementDataType m_logitsType = ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT;
+    MemAlignedTensor::ElementType m_logitsElementType = MemAlignedTensor::ElementType::Float32;
+
+    struct ShapeBucket {
+        size_t batchSize;
+        size_t sequenceLength;
+        Ort::Session session{ nullptr };
+        size_t hitCount = 0;
+    };
+    std::vector<ShapeBucket> m_buckets;
+    size_t m_dynamicHitCount = 0;
+    size_t m_paddedTokenCount = 0;
+    MemAlignedTensor m_logits;
+    std::vector<int64_t> m_attentionMask;
+    std::vector<int> m_prunedToFull;    // empty unless the LM head is pruned
+    std::vector<int> m_fullToPruned;    // -1 for pruned tokens
+    std::vector<int> m_allowedIndices;
+    std::vector<ReadoutItem> m_readoutItems;
+    std::optional<NumaNode> m_numaNode;
+    std::unique_ptr<ThreadPool> m_nodePool;    // readout workers on m_numaNode
 };
 
 std::shared_ptr<OnnxConnector> OnnxConnector::CreateInstance() {
     return std::make_shared<OnnxConnectorImpl>();
 }
 
+std::vector<std::vector<float>> OnnxConnector::SplitSentenceValues(const std::vector<std::vector<int>>& sentences,
+    const std::function<bool(float* probabilities)>& compareFlat) {
+    size_t valueCount = 0;
+    for (const auto& sentence : sentences) valueCount += sentence.size() + 1;
+
+    std::vector<float> probabilities(valueCount, 0.0f);
+    if (!compareFlat(probabilities.data())) return std::vector<std::vector<float>>();
+
+    std::vector<std::vector<float>> result;
+    auto top = probabilities.begin();
+    for (const auto& sentence : sentences) {
+        result.emplace_back(top, top + sentence.size() + 1);
+        top += sentence.size() + 1;
+    }
+    return result;
+}
+
 
@@ -1,13 +1,41 @@
 #pragma once
+#include <functional>
 #include <memory>
+#include <string>
 #include <string_view>
 #include <vector>
+#include "numaTopology.h"
 
 struct OnnxConnector {
     virtual void Initialize(const std::wstring_view modelFile) = 0;
+    // (batch, sequence) shapes which get a dedicated session with fixed input shape.
+    // requests are padded up to the nearest bucket, others run on the dynamic shape session.
+    virtual void SetShapeBuckets(const std::vector<std::tuple<int, int>>& shapes) = 0;
+    // keeps threads and weight memory of this instance on the node, must be called before the first request.
+    virtual void SetNumaNode(const NumaNode& node) = 0;
+    virtual std::wstring GetStatistics() = 0;
     virtual std::tuple<int64_t, float> GetPrediction(const std::vector<int64_t>& tokens) = 0;
+    virtual std::tuple<int64_t, float> GetConstrainedPrediction(const std::vector<int64_t>& tokens, const int* allowedIds, int allowedCount) = 0;
+    // greedy generation on token ids, onToken is called for each new token and returns false to stop.
+    virtual void GenerateTokens(const std::vector<int64_t>& promptTokens, int eosId, int maxNewTokens,
+        const std::function<bool(int64_t token, float probability)>& onToken) = 0;
     virtual std::vector<std::vector<float>> CompareSentences(const std::vector<std::vector<int>>& sentences, int eosId) = 0;
+    // same values as CompareSentences(), sentence i takes (size + 1) values back to back in probabilities.
+    // returns false on failure.
+    virtual bool CompareSentencesFlat(const std::vector<std::vector<int>>& sentences, int eosId, float* probabilities) = 0;
 
     virtual ~OnnxConnector() {};
     static std::shared_ptr<OnnxConnector> CreateInstance();
+#ifdef ONNX_TEST_NATIVE_ENGINE
+    // GPT-2 models run on the built-in engine (gpt2Engine.h) instead of ORT, same interface.
+    static std::shared_ptr<OnnxConnector> CreateNativeInstance();
+#endif
+    // one replica made by createReplica per node, each request runs on the least busy replica (numaRouter.cpp).
+    static std::shared_ptr<OnnxConnector> CreateNumaRouter(const std::function<std::shared_ptr<OnnxConnector>()>& createReplica,
+        const std::vector<NumaNode>& nodes);
+
+protected:
+    // CompareSentences() on top of CompareSentencesFlat(), empty on failure.
+    static std::vector<std::vector<float>> SplitSentenceValues(const std::vector<std::vector<int>>& sentences,
+        const std::function<bool(float* probabilities)>& compareFlat);
 };
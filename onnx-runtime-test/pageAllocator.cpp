@@ -0,0 +1,89 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <malloc.h>
+#include <new>
+#include "pageAllocator.h"
+#include "threadPool.h"
+
+namespace {
+	std::atomic<bool> g_isLargePageEnabled = false;
+
+	constexpr size_t c_touchPageSize = 4096;
+	constexpr size_t c_copyChunkSize = 1024 * 1024;
+}
+
+bool PageAllocator::EnableLargePages() {
+	if (GetLargePageMinimum() == 0) return false;
+
+	HANDLE token = nullptr;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) return false;
+	TOKEN_PRIVILEGES privileges = {};
+	privileges.PrivilegeCount = 1;
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	auto isEnabled = LookupPrivilegeValueW(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) &&
+		GetLastError() == ERROR_SUCCESS; // ERROR_NOT_ALL_ASSIGNED when the account does not hold it
+	CloseHandle(token);
+
+	g_isLargePageEnabled = isEnabled;
+	return isEnabled;
+}
+
+bool PageAllocator::IsLargePageEnabled() {
+	return g_isLargePageEnabled;
+}
+
+void* PageAllocator::Allocate(size_t byteCount, bool& isPageAllocation) {
+	isPageAllocation = g_isLargePageEnabled && byteCount >= c_pageAllocationMinimum;
+	if (isPageAllocation) return AllocatePages(byteCount);
+	const auto memory = _aligned_malloc(byteCount, c_alignmentSize);
+	if (memory == nullptr) throw std::bad_alloc();
+	return memory;
+}
+
+void PageAllocator::Free(void* memory, bool isPageAllocation) {
+	if (isPageAllocation) {
+		FreePages(memory);
+	} else {
+		_aligned_free(memory);
+	}
+}
+
+void* PageAllocator::AllocatePages(size_t byteCount, int numaNode) {
+	const auto process = GetCurrentProcess();
+	const auto preferredNode = numaNode < 0 ? NUMA_NO_PREFERRED_NODE : static_cast<DWORD>(numaNode);
+	if (g_isLargePageEnabled && byteCount >= c_pageAllocationMinimum) {
+		const auto largePageSize = GetLargePageMinimum();
+		const auto roundedCount = (byteCount + largePageSize - 1) / largePageSize * largePageSize;
+		const auto memory = VirtualAllocExNuma(process, nullptr, roundedCount, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, preferredNode);
+		if (memory != nullptr) return memory;
+		// physical memory is fragmented, fall through to 4KB pages.
+	}
+	const auto memory = VirtualAllocExNuma(process, nullptr, byteCount, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, preferredNode);
+	if (memory == nullptr) throw std::bad_alloc();
+	return memory;
+}
+
+void PageAllocator::FreePages(void* memory) {
+	if (memory != nullptr) VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+void PageAllocator::TouchPages(void* memory, size_t byteCount, ThreadPool& pool) {
+	const auto bytes = reinterpret_cast<volatile uint8_t*>(memory);
+	const auto pageCount = (byteCount + c_touchPageSize - 1) / c_touchPageSize;
+	pool.ParallelFor(pageCount, c_copyChunkSize / c_touchPageSize, [&](size_t begin, size_t end) {
+		for (auto i = begin; i < end; ++i) bytes[i * c_touchPageSize] = 0;
+	});
+}
+
+void PageAllocator::ParallelCopy(void* destination, const void* source, size_t byteCount, ThreadPool& pool) {
+	const auto chunkCount = (byteCount + c_copyChunkSize - 1) / c_copyChunkSize;
+	pool.ParallelFor(chunkCount, 1, [&](size_t begin, size_t end) {
+		const auto offset = begin * c_copyChunkSize;
+		const auto length = std::min(end * c_copyChunkSize, byteCount) - offset;
+		memcpy(reinterpret_cast<uint8_t*>(destination) + offset, reinterpret_cast<const uint8_t*>(source) + offset, length);
+	});
+}
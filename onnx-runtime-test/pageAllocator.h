@@ -0,0 +1,35 @@
+#pragma once
+#include <cstddef>
+
+class ThreadPool;
+
+// buffers for logits, weight copies etc. after EnableLargePages(), large ones come from VirtualAlloc with 2MB large pages,
+// which take one TLB entry instead of 512 while scanning 32000-wide rows or weights. until then everything stays on the heap.
+// large pages need "Lock pages in memory" (SeLockMemoryPrivilege) for the account, 4KB pages are used without it
+// or when the OS has no contiguous free memory left.
+struct PageAllocator {
+	static constexpr size_t c_pageAllocationMinimum = 2 * 1024 * 1024;	// smaller buffers stay on the aligned heap
+	static constexpr size_t c_alignmentSize = 64;
+
+	// enables the privilege for the process, returns false when it is not granted. call once at start up,
+	// buffers allocated before keep their pages.
+	static bool EnableLargePages();
+	static bool IsLargePageEnabled();
+
+	// 64-byte aligned, a page allocation only when large pages are enabled. freed by Free() with the same isPageAllocation.
+	static void* Allocate(size_t byteCount, bool& isPageAllocation);
+	static void Free(void* memory, bool isPageAllocation);
+
+	// always VirtualAlloc, numaNode -1 = no preferred node. freed by FreePages().
+	static void* AllocatePages(size_t byteCount, int numaNode = -1);
+	static void FreePages(void* memory);
+	struct PageDeleter {
+		void operator()(void* memory) const { FreePages(memory); }
+	};
+
+	// 4KB pages get physical memory on the first write, so the pool workers doing it decide where they land
+	// (node of the worker, unless a preferred node was given to AllocatePages()). large pages are backed at allocation.
+	// TouchPages() writes zero into every page, only for buffers which have no content yet.
+	static void TouchPages(void* memory, size_t byteCount, ThreadPool& pool);
+	static void ParallelCopy(void* destination, const void* source, size_t byteCount, ThreadPool& pool);
+};
@@ -0,0 +1,179 @@
+#define NOMINMAX
+#include <Windows.h>
+#include <algorithm>
+#include <immintrin.h>
+#include "threadPool.h"
+
+namespace {
+	std::mutex g_sharedMutex;
+	ThreadPool::Options g_sharedOptions;
+	bool g_isSharedCreated = false;
+
+	// worker index of the current thread, for Submit() from inside a task.
+	thread_local const ThreadPool* t_currentPool = nullptr;
+	thread_local size_t t_currentIndex = 0;
+}
+
+bool ThreadPool::ConfigureShared(const Options& options) {
+	std::lock_guard<std::mutex> lock(g_sharedMutex);
+	if (g_isSharedCreated) return false;
+	g_sharedOptions = options;
+	return true;
+}
+
+ThreadPool& ThreadPool::GetShared() {
+	static ThreadPool pool([]() {
+		std::lock_guard<std::mutex> lock(g_sharedMutex);
+		g_isSharedCreated = true;
+		return g_sharedOptions;
+	}());
+	return pool;
+}
+
+ThreadPool::ThreadPool(const Options& options) : m_options(options) {
+	if (m_options.threadCount == 0) {
+		m_options.threadCount = std::max(1U, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 1; i < m_options.threadCount; ++i) {
+		m_queues.emplace_back(std::make_unique<WorkerQueue>());
+	}
+	for (size_t i = 0; i < m_queues.size(); ++i) {
+		m_workers.emplace_back([this, i]() { WorkerLoop(i); });
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		m_isStopping = true;
+	}
+	m_wakeCondition.notify_all();
+	for (auto& worker : m_workers) worker.join();
+}
+
+void ThreadPool::Submit(std::function<void()> task) {
+	if (m_queues.empty()) {
+		task();
+		return;
+	}
+	const auto index = t_currentPool == this ? t_currentIndex : m_nextQueue++ % m_queues.size();
+	{
+		std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->tasks.push_back(std::move(task));
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_sleepMutex);
+		++m_pendingCount;
+	}
+	m_wakeCondition.notify_one();
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& body) {
+	grainSize = std::max<size_t>(grainSize, 1);
+	if (count == 0) return;
+	if (m_queues.empty() || count <= grainSize) {
+		body(0, count);
+		return;
+	}
+
+	auto job = std::make_shared<Job>();
+	job->body = &body;
+	job->count = count;
+	job->grainSize = grainSize;
+
+	// helpers only take chunks, the ones arriving after all are taken return at once.
+	const auto helperCount = std::min(m_queues.size(), (count + grainSize - 1) / grainSize - 1);
+	for (size_t i = 0; i < helperCount; ++i) {
+		Submit([job]() { RunChunks(*job); });
+	}
+	RunChunks(*job);
+	{
+		std::unique_lock<std::mutex> lock(job->mutex);
+		job->doneCondition.wait(lock, [&]() { return job->doneCount == job->count; });
+	}
+	if (job->error) std::rethrow_exception(job->error);
+}
+
+void ThreadPool::RunChunks(Job& job) {
+	for (;;) {
+		const auto begin = job.nextBegin.fetch_add(job.grainSize);
+		if (begin >= job.count) return;
+		const auto end = std::min(begin + job.grainSize, job.count);
+		try {
+			(*job.body)(begin, end);
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(job.mutex);
+			if (!job.error) job.error = std::current_exception();
+		}
+		if (job.doneCount.fetch_add(end - begin) + (end - begin) == job.count) {
+			// taking the lock orders this notification after the caller started waiting.
+			std::lock_guard<std::mutex> lock(job.mutex);
+			job.doneCondition.notify_all();
+		}
+	}
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+	t_currentPool = this;
+	t_currentIndex = index;
+	ApplyAffinity();
+
+	std::function<void()> task;
+	for (;;) {
+		if (TryPop(index, task)) {
+			task();
+			task = nullptr;
+			continue;
+		}
+
+		if (m_options.allowSpinning) {
+			for (int i = 0; i < m_options.spinCount && m_pendingCount == 0; ++i) _mm_pause();
+			if (m_pendingCount > 0) continue;
+		}
+
+		std::unique_lock<std::mutex> lock(m_sleepMutex);
+		m_wakeCondition.wait(lock, [&]() { return m_isStopping || m_pendingCount > 0; });
+		if (m_isStopping && m_pendingCount == 0) return;
+	}
+}
+
+// own queue from the back, then the others from the front.
+bool ThreadPool::TryPop(size_t index, std::function<void()>& task) {
+	for (size_t i = 0; i < m_queues.size(); ++i) {
+		auto& queue = *m_queues[(index + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty()) continue;
+		if (i == 0) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+		--m_pendingCount;
+		return true;
+	}
+	return false;
+}
+
+void ThreadPool::ApplyAffinity() const {
+	if (m_options.affinityMask != 0) {
+		SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(m_options.affinityMask));
+	}
+}
+
+const void* ThreadPool::CreateExternalThread(void* pool, void (*workerFunction)(void*), void* parameter) {
+	const auto threadPool = reinterpret_cast<const ThreadPool*>(pool);
+	return new std::thread([threadPool, workerFunction, parameter]() {
+		threadPool->ApplyAffinity();
+		workerFunction(parameter);
+	});
+}
+
+void ThreadPool::JoinExternalThread(const void* handle) {
+	const auto thread = const_cast<std::thread*>(reinterpret_cast<const std::thread*>(handle));
+	thread->join();
+	delete thread;
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// process-wide work-stealing pool for the application side stages (tokenizing, readout etc.).
+// ORT's global intra-op threads are created through CreateExternalThread(), so both sides share one core set,
+// one thread count and one spin policy instead of competing with each other.
+class ThreadPool
+{
+public:
+	struct Options {
+		size_t threadCount = 0;		// including the thread calling ParallelFor(), 0 = hardware threads
+		bool allowSpinning = false;	// idle threads spin before sleeping, lower latency but the core stays busy
+		int spinCount = 2000;
+		uint64_t affinityMask = 0;	// logical processors for workers and ORT threads, 0 = no pinning
+	};
+
+	// takes effect only before the first GetShared(), returns false after that.
+	static bool ConfigureShared(const Options& options);
+	static ThreadPool& GetShared();
+
+	explicit ThreadPool(const Options& options);
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator = (const ThreadPool&) = delete;
+	~ThreadPool();
+
+	const Options& GetOptions() const { return m_options; }
+	// including the calling thread.
+	size_t GetThreadCount() const { return m_workers.size() + 1; }
+
+	// tasks submitted from a worker go to its own queue (LIFO), idle workers steal from the other end.
+	void Submit(std::function<void()> task);
+	// returns when body has run for every chunk, the first exception thrown by body is rethrown.
+	void ParallelFor(size_t count, size_t grainSize, const std::function<void(size_t begin, size_t end)>& body);
+
+	// OrtCustomCreateThreadFn / OrtCustomJoinThreadFn compatible, pool is the ThreadPool giving the affinity.
+	static const void* CreateExternalThread(void* pool, void (*workerFunction)(void*), void* parameter);
+	static void JoinExternalThread(const void* handle);
+
+private:
+	struct Job {
+		const std::function<void(size_t, size_t)>* body;
+		size_t count;
+		size_t grainSize;
+		std::atomic<size_t> nextBegin = 0;
+		std::atomic<size_t> doneCount = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable doneCondition;
+	};
+
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	void WorkerLoop(size_t index);
+	bool TryPop(size_t index, std::function<void()>& task);
+	void ApplyAffinity() const;
+	static void RunChunks(Job& job);
+
+	Options m_options;
+	std::vector<std::thread> m_workers;
+	std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+	std::atomic<size_t> m_nextQueue = 0;
+	std::atomic<size_t> m_pendingCount = 0;
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wakeCondition;
+	bool m_isStopping = false;
+};
@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <map>
+#include "tokenTrie.h"
+
+void TokenTrie::Build(Tokenizer& tokenizer, const std::vector<std::wstring>& phrases, int eosId) {
+	std::vector<std::vector<int>> phraseTokens;
+	for (const auto& phrase : phrases) {
+		phraseTokens.emplace_back(tokenizer.EncodeContinuation(phrase));
+	}
+	Build(phraseTokens, eosId);
+}
+
+void TokenTrie::Build(const std::vector<std::vector<int>>& phraseTokens, int eosId) {
+	// build with std::map first, then flatten to contiguous arrays.
+	std::vector<std::map<int, int>> children(1);
+	std::vector<bool> terminals(1, false);
+
+	for (const auto& tokens : phraseTokens) {
+		if (tokens.empty()) continue;
+		int node = c_rootNode;
+		for (const auto token : tokens) {
+			const auto it = children[node].find(token);
+			if (it != children[node].end()) {
+				node = it->second;
+				continue;
+			}
+			const auto newNode = static_cast<int>(children.size());
+			children[node].emplace(token, newNode);
+			children.emplace_back();
+			terminals.push_back(false);
+			node = newNode;
+		}
+		terminals[node] = true;
+	}
+
+	m_nodes.assign(children.size(), Node{});
+	m_childTokens.clear();
+	m_childNodes.clear();
+	for (size_t node = 0; node < children.size(); ++node) {
+		auto& nodeInfo = m_nodes[node];
+		nodeInfo.childBegin = static_cast<int>(m_childTokens.size());
+		nodeInfo.isTerminal = terminals[node];
+
+		// eos is allowed on terminal node and loops back to the same node, caller stops there.
+		auto childMap = children[node];
+		if (nodeInfo.isTerminal) {
+			childMap.emplace(eosId, static_cast<int>(node));
+		}
+		for (const auto& [token, child] : childMap) {
+			m_childTokens.push_back(token);
+			m_childNodes.push_back(child);
+		}
+		nodeInfo.childCount = static_cast<int>(m_childTokens.size()) - nodeInfo.childBegin;
+	}
+}
+
+int TokenTrie::Next(int node, int token) const {
+	if (node < 0 || node >= static_cast<int>(m_nodes.size())) return c_invalidNode;
+
+	const auto& nodeInfo = m_nodes[node];
+	const auto begin = m_childTokens.begin() + nodeInfo.childBegin;
+	const auto end = begin + nodeInfo.childCount;
+	const auto it = std::lower_bound(begin, end, token);
+	if (it == end || *it != token) return c_invalidNode;
+	return m_childNodes[it - m_childTokens.begin()];
+}
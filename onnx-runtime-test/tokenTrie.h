@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+#include <tuple>
+#include <vector>
+#include "tokenizer.h"
+
+// Token trie for constrained decoding.
+// Each node keeps a flat, sorted list of the token ids that can follow it, so the list can be
+// passed to MemAlignedTensor::GetMaskedMaxInRange() as an allowed-token index list as it is.
+class TokenTrie
+{
+public:
+	static constexpr int c_rootNode = 0;
+	static constexpr int c_invalidNode = -1;
+
+	// phrases continue the source text, so they are encoded without the dummy prefix piece.
+	void Build(Tokenizer& tokenizer, const std::vector<std::wstring>& phrases, int eosId);
+	void Build(const std::vector<std::vector<int>>& phraseTokens, int eosId);
+
+	int Next(int node, int token) const;
+	bool IsTerminal(int node) const { return m_nodes[node].isTerminal; }
+
+	// returns allowed token id list, eos is included when the node is terminal.
+	std::tuple<const int*, int> GetAllowedTokens(int node) const {
+		const auto& nodeInfo = m_nodes[node];
+		return std::make_tuple(m_childTokens.data() + nodeInfo.childBegin, nodeInfo.childCount);
+	}
+
+private:
+	struct Node {
+		int childBegin = 0;
+		int childCount = 0;
+		bool isTerminal = false;
+	};
+
+	std::vector<Node> m_nodes;
+	std::vector<int> m_childTokens;	// sorted per node
+	std::vector<int> m_childNodes;	// parallel to m_childTokens
+};
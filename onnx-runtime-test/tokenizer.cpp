@@ -1,8 +1,88 @@
 #include <Windows.h>
 #include "miscUtils.h"
+#include "threadPool.h"
 #include "tokenizer.h"
 #include <sentencepiece_processor.h>
 
+struct TokenStreamDecoderImpl : public TokenStreamDecoder
+{
+	TokenStreamDecoderImpl(const sentencepiece::SentencePieceProcessor* processor, bool isTextTop) :
+		m_processor(processor), m_isTextTop(isTextTop) {}
+
+	std::wstring Push(int64_t token) override {
+		const auto id = static_cast<int>(token);
+		if (m_processor->IsControl(id)) {
+			return std::wstring();
+		}
+
+		if (m_processor->IsByte(id)) {
+			// byte piece is "<0xXX>"
+			const auto& piece = m_processor->IdToPiece(id);
+			m_pendingBytes.push_back(static_cast<char>(std::stoi(piece.substr(3, 2), nullptr, 16)));
+			return ToUtf16(TakeCompletedBytes());
+		}
+
+		// bytes which did not make a character are broken, sentencepiece also outputs U+FFFD for them.
+		std::string utf8Text;
+		if (!m_pendingBytes.empty()) {
+			utf8Text = c_replacementChar;
+			m_pendingBytes.clear();
+		}
+
+		if (m_processor->IsUnknown(id)) {
+			utf8Text += c_unknownSurface;
+		} else {
+			const auto& piece = m_processor->IdToPiece(id);
+			for (size_t pos = 0; pos < piece.size();) {
+				if (piece.compare(pos, c_spaceSymbol.size(), c_spaceSymbol) == 0) {
+					if (!m_isTextTop || !utf8Text.empty() || m_hasOutput) {
+						utf8Text += ' ';
+					}
+					pos += c_spaceSymbol.size();
+				} else {
+					utf8Text += piece[pos++];
+				}
+			}
+		}
+
+		m_hasOutput = m_hasOutput || !utf8Text.empty();
+		return ToUtf16(utf8Text);
+	}
+
+	std::wstring Flush() override {
+		if (m_pendingBytes.empty()) {
+			return std::wstring();
+		}
+		m_pendingBytes.clear();
+		return ToUtf16(c_replacementChar);
+	}
+
+private:
+	// move out leading complete UTF-8 characters from pending bytes.
+	std::string TakeCompletedBytes() {
+		size_t completed = 0;
+		while (completed < m_pendingBytes.size()) {
+			const auto lead = static_cast<unsigned char>(m_pendingBytes[completed]);
+			const size_t charLen = lead < 0x80 ? 1 : lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+			if (completed + charLen > m_pendingBytes.size()) break;
+			completed += charLen;
+		}
+		std::string result = m_pendingBytes.substr(0, completed);
+		m_pendingBytes.erase(0, completed);
+		m_hasOutput = m_hasOutput || !result.empty();
+		return result;
+	}
+
+	static inline const std::string c_spaceSymbol = "\xE2\x96\x81"; // U+2581
+	static inline const std::string c_replacementChar = "\xEF\xBF\xBD"; // U+FFFD
+	static inline const std::string c_unknownSurface = " \xE2\x81\x87 "; // U+2047
+
+	const sentencepiece::SentencePieceProcessor* m_processor;
+	std::string m_pendingBytes;
+	bool m_isTextTop;
+	bool m_hasOutput = false;
+};
+
 struct TokenizerImpl : public Tokenizer
 {
 	void Load(std::wstring_view fileName) override {
@@ -27,6 +107,22 @@ struct TokenizerImpl : public Tokenizer
 		return tokenVector;
 	}
 
+	// SentencePieceProcessor::Encode() is const, one processor serves every worker.
+	std::vector<std::vector<int>> EncodeBatch(const std::vector<const wchar_t*>& sources) override {
+		if (!m_processor) {
+			throw std::exception("processor is not loaded");
+		}
+
+		std::vector<std::vector<int>> results(sources.size());
+		ThreadPool::GetShared().ParallelFor(sources.size(), 4, [&](size_t begin, size_t end) {
+			for (auto i = begin; i < end; ++i) {
+				const auto& result = m_processor->Encode(ToUtf8(sources[i]), &results[i]);
+				if (!result.ok()) throw std::exception("failed to encode");
+			}
+		});
+		return results;
+	}
+
 	std::vector<int64_t> Encode64(std::wstring_view source) override {
 		if (!m_processor) {
 			throw std::exception("processor is not loaded");
@@ -45,6 +141,15 @@ struct TokenizerImpl : public Tokenizer
 		return resultVector;
 	}
 
+	std::vector<int> EncodeContinuation(std::wstring_view source) override {
+		auto tokenVector = Encode(source);
+		// text which starts with a word keeps its merged "\u2581word" piece, only the separate one is an artifact.
+		if (!tokenVector.empty() && m_processor->IdToPiece(tokenVector[0]) == c_dummyPrefixPiece) {
+			tokenVector.erase(tokenVector.begin());
+		}
+		return tokenVector;
+	}
+
 	std::wstring Decode(const int64_t* tokenPtr, size_t tokenLen) override {
 		if (!m_processor) {
 			throw std::exception("processor is not loaded");
@@ -61,10 +166,19 @@ struct TokenizerImpl : public Tokenizer
 		return ToUtf16(decodedText);
 	}
 
+	std::shared_ptr<TokenStreamDecoder> CreateStreamDecoder(bool isTextTop) override {
+		if (!m_processor) {
+			throw std::exception("processor is not loaded");
+		}
+		return std::make_shared<TokenStreamDecoderImpl>(m_processor.get(), isTextTop);
+	}
+
 	int bos_id() override { return m_processor->bos_id(); }
 	int eos_id() override { return m_processor->eos_id(); }
 
 private:
+	static inline const std::string c_dummyPrefixPiece = "\xE2\x96\x81"; // U+2581
+
 	std::unique_ptr<sentencepiece::SentencePieceProcessor> m_processor;
 };
 
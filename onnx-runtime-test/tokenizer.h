@@ -4,12 +4,28 @@
 #include <string_view>
 #include <vector>
 
+// decodes token ids one by one, returns only the newly completed text.
+// byte-fallback tokens are kept until they form a complete UTF-8 character.
+struct TokenStreamDecoder
+{
+	virtual std::wstring Push(int64_t token) = 0;
+	virtual std::wstring Flush() = 0;
+
+	virtual ~TokenStreamDecoder() {};
+};
+
 struct Tokenizer
 {
 	virtual void Load(std::wstring_view fileName) = 0;
 	virtual std::vector<int> Encode(std::wstring_view source) = 0;
+	// sentences are encoded on the shared ThreadPool.
+	virtual std::vector<std::vector<int>> EncodeBatch(const std::vector<const wchar_t*>& sources) = 0;
 	virtual std::vector<int64_t> Encode64(std::wstring_view source) = 0;
+	// for text continuing other text: the lone dummy prefix piece ("\u2581") added at the top is dropped.
+	virtual std::vector<int> EncodeContinuation(std::wstring_view source) = 0;
 	virtual std::wstring Decode(const int64_t* tokenPtr, size_t tokenLen) = 0;
+	// isTextTop: strip the leading space of the first piece as Decode() does for the top of text.
+	virtual std::shared_ptr<TokenStreamDecoder> CreateStreamDecoder(bool isTextTop) = 0;
 
 	virtual int bos_id() = 0;
 	virtual int eos_id() = 0;